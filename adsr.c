@@ -20,11 +20,41 @@
 
 #include "debug.h"
 #include "adsr.h"
+#include "synth.h"
 #include <stdlib.h>
 #ifdef __AVR_ARCH__
 #include <avr/pgmspace.h>
 #endif
 
+#ifndef ADSR_FEATURES
+/*!
+ * Envelope features supported by the generator, `ADSR_FEATURE_*` bits.
+ * The others can be stripped in the `SYNTH_CFG` file to save flash.
+ */
+#define ADSR_FEATURES		(ADSR_FEATURE_ALL)
+#endif
+
+/*! Non-zero if the phase is supported and has a time */
+#define ADSR_HAS(feature, units) \
+	((ADSR_FEATURES & ADSR_FEATURE_##feature) && (units))
+
+#ifdef ADSR_SHARED_DEF
+#define ADSR_DEF(adsr)		((adsr)->def)
+#else
+#define ADSR_DEF(adsr)		(&(adsr)->def)
+#endif
+
+#if defined(ADSR_DEF_PROGMEM) && defined(__AVR_ARCH__)
+/* Shared definitions in flash */
+#define ADSR_DEF_BYTE(adsr, field) \
+	pgm_read_byte(&ADSR_DEF(adsr)->field)
+#define ADSR_DEF_TIME_SCALE(adsr) \
+	pgm_read_dword(&ADSR_DEF(adsr)->time_scale)
+#else
+#define ADSR_DEF_BYTE(adsr, field)	(ADSR_DEF(adsr)->field)
+#define ADSR_DEF_TIME_SCALE(adsr)	(ADSR_DEF(adsr)->time_scale)
+#endif
+
 /* ADSR attack/decay adjustments */
 #define ADSR_LIN_AMP_FACTOR	(5)
 
@@ -34,7 +64,8 @@
  * UINT32_MAX.
  */
 static inline uint32_t adsr_num_samples(uint32_t scale, uint8_t units) {
-	if (units != ADSR_INFINITE)
+	if (!(ADSR_FEATURES & ADSR_FEATURE_INFINITE)
+			|| (units != ADSR_INFINITE))
 		return scale * units;
 	else
 		return UINT32_MAX;
@@ -58,6 +89,97 @@ static uint8_t adsr_release_amp(uint8_t amp, uint8_t count) {
 	return adsr_attack_amp(amp, 16 - count);
 }
 
+/*!
+ * Helper, returns the number of samples of a phase divided in 16
+ * segments: each segment is computed on one sample, then held for
+ * `time_step` samples.
+ */
+static inline uint32_t adsr_segments_samples(uint32_t scale, uint8_t units) {
+	uint16_t time_step = (uint16_t)((units * scale) >> 4);
+	return 16 * ((uint32_t)time_step + 1);
+}
+
+/*!
+ * Helper, saturating addition: UINT32_MAX stays infinite.
+ */
+static inline uint32_t adsr_add_samples(uint32_t a, uint32_t b) {
+	if (b >= (UINT32_MAX - a))
+		return UINT32_MAX;
+	return a + b;
+}
+
+uint32_t adsr_duration(const struct adsr_env_def_t* const def) {
+	/* Same checks of the IDLE state: the envelope would never start */
+	if (!def->time_scale)
+		return UINT32_MAX;
+	if (!(def->delay_time || def->attack_time || def->decay_time
+			|| def->sustain_time || def->release_time))
+		return UINT32_MAX;
+	if (!(def->peak_amp || def->sustain_amp))
+		return UINT32_MAX;
+
+	/*
+	 * Follow `adsr_next`: DELAY and SUSTAIN take one sample to set up
+	 * the wait, the other phases start on the same sample the previous
+	 * one expired.  The final sample is the one reaching DONE.
+	 */
+	uint32_t samples = 1;
+	if (ADSR_HAS(DELAY, def->delay_time)) {
+		uint32_t wait = adsr_num_samples(def->time_scale,
+				def->delay_time);
+		if (wait == UINT32_MAX)
+			return UINT32_MAX;
+		samples = adsr_add_samples(samples, wait);
+		samples = adsr_add_samples(samples, 1);
+	}
+	if (ADSR_HAS(ATTACK, def->attack_time))
+		samples = adsr_add_samples(samples, adsr_segments_samples(
+					def->time_scale, def->attack_time));
+	if (ADSR_HAS(DECAY, def->decay_time))
+		samples = adsr_add_samples(samples, adsr_segments_samples(
+					def->time_scale, def->decay_time));
+	if (ADSR_HAS(SUSTAIN, def->sustain_time)) {
+		uint32_t wait = adsr_num_samples(def->time_scale,
+				def->sustain_time);
+		if (wait == UINT32_MAX)
+			return UINT32_MAX;
+		samples = adsr_add_samples(samples, wait);
+		samples = adsr_add_samples(samples, 1);
+	}
+	if (ADSR_HAS(RELEASE, def->release_time))
+		samples = adsr_add_samples(samples, adsr_segments_samples(
+					def->time_scale, def->release_time));
+	return samples;
+}
+
+uint32_t adsr_skip(struct adsr_env_gen_t* const adsr, uint32_t samples,
+		uint32_t* audible) {
+	uint32_t done = 0;
+	*audible = 0;
+	while (done < samples) {
+		if (adsr->next_event) {
+			/* Waiting: the amplitude holds until the next event */
+			uint32_t wait = samples - done;
+			if (adsr->next_event != UINT32_MAX) {
+				if (wait > adsr->next_event)
+					wait = adsr->next_event;
+				adsr->next_event -= wait;
+			}
+			if (adsr->amplitude)
+				*audible += wait;
+			done += wait;
+		} else {
+			/* An event: take the sample as `adsr_next` */
+			if (adsr_next(adsr))
+				(*audible)++;
+			done++;
+			if (adsr_is_done(adsr))
+				break;
+		}
+	}
+	return done;
+}
+
 /*!
  * Compute the ADSR amplitude
  */
@@ -95,23 +217,25 @@ uint8_t adsr_next(struct adsr_env_gen_t* const adsr) {
 				adsr->sustain_amp);
 
 		/* Are registers set up? */
-		if (!adsr->def.time_scale)
+		if (!ADSR_DEF_TIME_SCALE(adsr))
 			return 0;
 		_DPRINTF("adsr=%p time scale set\n", adsr);
 
-		if (!(adsr->def.delay_time || adsr->def.attack_time
-				|| adsr->def.decay_time
-				|| adsr->def.sustain_time
-				|| adsr->def.release_time))
+		if (!(ADSR_DEF_BYTE(adsr, delay_time)
+				|| ADSR_DEF_BYTE(adsr, attack_time)
+				|| ADSR_DEF_BYTE(adsr, decay_time)
+				|| ADSR_DEF_BYTE(adsr, sustain_time)
+				|| ADSR_DEF_BYTE(adsr, release_time)))
 			return 0;
 		_DPRINTF("adsr=%p envelope timings set\n", adsr);
 
-		if (!(adsr->def.peak_amp || adsr->def.sustain_amp))
+		if (!(ADSR_DEF_BYTE(adsr, peak_amp)
+				|| ADSR_DEF_BYTE(adsr, sustain_amp)))
 			return 0;
 		_DPRINTF("adsr=%p envelope amplitudes set\n", adsr);
 
 		/* All good */
-		if (adsr->def.delay_time)
+		if (ADSR_HAS(DELAY, ADSR_DEF_BYTE(adsr, delay_time)))
 			adsr->state = ADSR_STATE_DELAY_INIT;
 		else
 			adsr->state = ADSR_STATE_DELAY_EXPIRE;
@@ -123,7 +247,8 @@ uint8_t adsr_next(struct adsr_env_gen_t* const adsr) {
 		/* Setting up a delay */
 		adsr->amplitude = 0;
 		adsr->next_event = adsr_num_samples(
-				adsr->def.time_scale, adsr->def.delay_time);
+				ADSR_DEF_TIME_SCALE(adsr),
+				ADSR_DEF_BYTE(adsr, delay_time));
 		adsr->state = ADSR_STATE_DELAY_EXPIRE;
 		/* Wait for delay */
 		return adsr->amplitude;
@@ -133,7 +258,7 @@ uint8_t adsr_next(struct adsr_env_gen_t* const adsr) {
 		_DPRINTF("adsr=%p DELAY EXPIRE\n", adsr);
 
 		/* Delay has expired */
-		if (adsr->def.attack_time)
+		if (ADSR_HAS(ATTACK, ADSR_DEF_BYTE(adsr, attack_time)))
 			adsr->state = ADSR_STATE_ATTACK_INIT;
 		else
 			adsr->state = ADSR_STATE_ATTACK_EXPIRE;
@@ -141,8 +266,8 @@ uint8_t adsr_next(struct adsr_env_gen_t* const adsr) {
 
 	if (adsr->state == ADSR_STATE_ATTACK_INIT) {
 		/* Attack is divided into 16 segments */
-		adsr->time_step = (uint16_t)((adsr->def.attack_time
-				* adsr->def.time_scale) >> 4);
+		adsr->time_step = (uint16_t)((ADSR_DEF_BYTE(adsr, attack_time)
+				* ADSR_DEF_TIME_SCALE(adsr)) >> 4);
 		adsr->counter = 16;
 		adsr->next_event = adsr->time_step;
 		adsr->state = ADSR_STATE_ATTACK;
@@ -158,9 +283,10 @@ uint8_t adsr_next(struct adsr_env_gen_t* const adsr) {
 		if (adsr->counter) {
 			/* Change of amplitude */
 			uint16_t lin_amp = (16-adsr->counter)
-				* adsr->def.peak_amp;
+				* ADSR_DEF_BYTE(adsr, peak_amp);
 			uint16_t exp_amp = adsr_attack_amp(
-					adsr->def.peak_amp, adsr->counter);
+					ADSR_DEF_BYTE(adsr, peak_amp),
+					adsr->counter);
 			lin_amp >>= ADSR_LIN_AMP_FACTOR;
 			_DPRINTF("adsr=%p ATTACK lin=%d exp=%d\n",
 					adsr, lin_amp, exp_amp);
@@ -177,7 +303,7 @@ uint8_t adsr_next(struct adsr_env_gen_t* const adsr) {
 	if (adsr->state == ADSR_STATE_ATTACK_EXPIRE) {
 		_DPRINTF("adsr=%p ATTACK EXPIRE\n", adsr);
 
-		if (adsr->def.decay_time)
+		if (ADSR_HAS(DECAY, ADSR_DEF_BYTE(adsr, decay_time)))
 			adsr->state = ADSR_STATE_DECAY_INIT;
 		else
 			adsr->state = ADSR_STATE_DECAY_EXPIRE;
@@ -187,10 +313,10 @@ uint8_t adsr_next(struct adsr_env_gen_t* const adsr) {
 		_DPRINTF("adsr=%p DECAY INIT\n", adsr);
 
 		/* We should be at full amplitude */
-		adsr->amplitude = adsr->def.peak_amp;
+		adsr->amplitude = ADSR_DEF_BYTE(adsr, peak_amp);
 
-		adsr->time_step = (uint16_t)((adsr->def.decay_time
-					* adsr->def.time_scale) >> 4);
+		adsr->time_step = (uint16_t)((ADSR_DEF_BYTE(adsr, decay_time)
+					* ADSR_DEF_TIME_SCALE(adsr)) >> 4);
 		adsr->counter = 16;
 		adsr->next_event = adsr->time_step;
 		adsr->state = ADSR_STATE_DECAY;
@@ -201,12 +327,12 @@ uint8_t adsr_next(struct adsr_env_gen_t* const adsr) {
 
 		if (adsr->counter) {
 			/* Linear decrease in amplitude */
-			uint16_t delta = adsr->def.peak_amp
-				- adsr->def.sustain_amp;
+			uint16_t delta = ADSR_DEF_BYTE(adsr, peak_amp)
+				- ADSR_DEF_BYTE(adsr, sustain_amp);
 			delta *= adsr->counter;
 			delta >>= 4;
 
-			adsr->amplitude = adsr->def.sustain_amp + delta;
+			adsr->amplitude = ADSR_DEF_BYTE(adsr, sustain_amp) + delta;
 			adsr->next_event = adsr->time_step;
 			adsr->counter--;
 		} else {
@@ -217,7 +343,7 @@ uint8_t adsr_next(struct adsr_env_gen_t* const adsr) {
 	if (adsr->state == ADSR_STATE_DECAY_EXPIRE) {
 		_DPRINTF("adsr=%p DECAY EXPIRE\n", adsr);
 
-		if (adsr->def.sustain_time)
+		if (ADSR_HAS(SUSTAIN, ADSR_DEF_BYTE(adsr, sustain_time)))
 			adsr->state = ADSR_STATE_SUSTAIN_INIT;
 		else
 			adsr->state = ADSR_STATE_SUSTAIN_EXPIRE;
@@ -226,9 +352,10 @@ uint8_t adsr_next(struct adsr_env_gen_t* const adsr) {
 	if (adsr->state == ADSR_STATE_SUSTAIN_INIT) {
 		_DPRINTF("adsr=%p SUSTAIN INIT\n", adsr);
 
-		adsr->amplitude = adsr->def.sustain_amp;
+		adsr->amplitude = ADSR_DEF_BYTE(adsr, sustain_amp);
 		adsr->next_event = adsr_num_samples(
-				adsr->def.time_scale, adsr->def.sustain_time);
+				ADSR_DEF_TIME_SCALE(adsr),
+				ADSR_DEF_BYTE(adsr, sustain_time));
 		adsr->state = ADSR_STATE_SUSTAIN_EXPIRE;
 		/* Wait for delay */
 		return adsr->amplitude;
@@ -237,7 +364,7 @@ uint8_t adsr_next(struct adsr_env_gen_t* const adsr) {
 	if (adsr->state == ADSR_STATE_SUSTAIN_EXPIRE) {
 		_DPRINTF("adsr=%p SUSTAIN EXPIRE\n", adsr);
 
-		if (adsr->def.release_time)
+		if (ADSR_HAS(RELEASE, ADSR_DEF_BYTE(adsr, release_time)))
 			adsr->state = ADSR_STATE_RELEASE_INIT;
 		else
 			adsr->state = ADSR_STATE_RELEASE_EXPIRE;
@@ -246,8 +373,8 @@ uint8_t adsr_next(struct adsr_env_gen_t* const adsr) {
 	if (adsr->state == ADSR_STATE_RELEASE_INIT) {
 		_DPRINTF("adsr=%p RELEASE INIT\n", adsr);
 
-		adsr->time_step = (uint16_t)((adsr->def.release_time
-					* adsr->def.time_scale) >> 4);
+		adsr->time_step = (uint16_t)((ADSR_DEF_BYTE(adsr, release_time)
+					* ADSR_DEF_TIME_SCALE(adsr)) >> 4);
 		adsr->counter = 16;
 		adsr->next_event = adsr->time_step;
 		adsr->state = ADSR_STATE_RELEASE;
@@ -259,9 +386,10 @@ uint8_t adsr_next(struct adsr_env_gen_t* const adsr) {
 		if (adsr->counter) {
 			/* Change of amplitude */
 			uint16_t lin_amp = adsr->counter
-				* adsr->def.sustain_amp;
+				* ADSR_DEF_BYTE(adsr, sustain_amp);
 			uint16_t exp_amp = adsr_release_amp(
-					adsr->def.sustain_amp, adsr->counter);
+					ADSR_DEF_BYTE(adsr, sustain_amp),
+					adsr->counter);
 			lin_amp >>= ADSR_LIN_AMP_FACTOR;
 			_DPRINTF("adsr=%p RELEASE lin=%d exp=%d\n",
 					adsr, lin_amp, exp_amp);
@@ -23,6 +23,11 @@
 #include "debug.h"
 #include <stdint.h>
 
+/* The envelope layout depends on the configuration */
+#ifdef SYNTH_CFG
+#include SYNTH_CFG
+#endif
+
 /* ADSR states */
 #define ADSR_STATE_IDLE			(0x00)
 #define ADSR_STATE_DELAY_INIT		(0x10)
@@ -46,6 +51,18 @@
  */
 #define ADSR_INFINITE			UINT8_MAX
 
+/*!
+ * Envelope features, for `ADSR_FEATURES`: the phases and the infinite
+ * times not in the set are stripped from the generator.
+ */
+#define ADSR_FEATURE_DELAY		(1 << 0)
+#define ADSR_FEATURE_ATTACK		(1 << 1)
+#define ADSR_FEATURE_DECAY		(1 << 2)
+#define ADSR_FEATURE_SUSTAIN		(1 << 3)
+#define ADSR_FEATURE_RELEASE		(1 << 4)
+#define ADSR_FEATURE_INFINITE		(1 << 5)
+#define ADSR_FEATURE_ALL		(0x3f)
+
 /*!
  * ADSR Envelope Generator definition.  11 bytes.
  */
@@ -68,12 +85,30 @@ struct adsr_env_def_t {
 	uint8_t sustain_amp;
 };
 
+#if defined(ADSR_DEF_PROGMEM) && defined(__AVR_ARCH__)
+#include <avr/pgmspace.h>
+/*! Storage of the definitions shared by the voices */
+#define ADSR_DEF_MEM			PROGMEM
+#else
+#define ADSR_DEF_MEM
+#endif
+
 /*!
- * ADSR Envelope Generator data.  20 bytes.
+ * ADSR Envelope Generator data.  20 bytes, or 9 bytes plus a pointer
+ * with `ADSR_SHARED_DEF`.
  */
 struct adsr_env_gen_t {
+#ifdef ADSR_SHARED_DEF
+	/*!
+	 * Definition, shared by the voices playing the same envelope: it
+	 * must not change while in use.  On AVR it is in flash
+	 * (`PROGMEM`) if `ADSR_DEF_PROGMEM` is defined.
+	 */
+	const struct adsr_env_def_t* def;
+#else
 	/*! Definition */
 	struct adsr_env_def_t def;
+#endif
 	/*! Time to next event, samples.  UINT32_MAX = infinite */
 	uint32_t next_event;
 	/*! Time step, samples */
@@ -113,8 +148,12 @@ static inline void adsr_reset(struct adsr_env_gen_t* const adsr) {
 /*!
  * Configure the ADSR.
  */
-static inline void adsr_config(struct adsr_env_gen_t* const adsr, struct adsr_env_def_t* const def) {
+static inline void adsr_config(struct adsr_env_gen_t* const adsr, const struct adsr_env_def_t* const def) {
+#ifdef ADSR_SHARED_DEF
+	adsr->def = def;
+#else
 	adsr->def = *def;
+#endif
 	adsr_reset(adsr);
 }
 
@@ -123,6 +162,23 @@ static inline void adsr_config(struct adsr_env_gen_t* const adsr, struct adsr_en
  */
 uint8_t adsr_next(struct adsr_env_gen_t* const adsr);
 
+/*!
+ * Compute the number of samples the envelope takes to reach the DONE
+ * state once configured, including the sample that reaches it.  Returns
+ * UINT32_MAX if the envelope never ends (infinite delay or sustain, or
+ * incomplete definition).
+ */
+uint32_t adsr_duration(const struct adsr_env_def_t* const def);
+
+/*!
+ * Advance the envelope by up to `samples` calls of `adsr_next` without
+ * computing them one by one, stopping after the call that reaches the
+ * DONE state.  Returns the calls made, and in `audible` how many of them
+ * returned a non-zero amplitude.
+ */
+uint32_t adsr_skip(struct adsr_env_gen_t* const adsr, uint32_t samples,
+		uint32_t* audible);
+
 /*!
  * Test to see if the ADSR is done.
  */
@@ -0,0 +1,79 @@
+/*!
+ * Polyphonic synthesizer for microcontrollers.  Sample FIFO.
+ * (C) 2026 The atinysynth contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+#ifndef _FIFO_H
+#define _FIFO_H
+
+#include "synth.h"
+
+/*!
+ * Ring of rendered samples between the main loop, that computes them in
+ * batches, and the sample rate interrupt, that only outputs them: a slow
+ * sample (an envelope change, a new frame) no longer delays the output.
+ *
+ * One producer and one consumer, with 8-bit indexes that are written
+ * atomically on AVR.  Not meant for threads.
+ */
+
+#ifndef SYNTH_FIFO
+/*! Size of the FIFO in samples, a power of two up to 128 */
+#define SYNTH_FIFO		(32)
+#endif
+
+#if (SYNTH_FIFO & (SYNTH_FIFO - 1)) || (SYNTH_FIFO > 128)
+#error "SYNTH_FIFO must be a power of two up to 128"
+#endif
+
+struct synth_fifo_t {
+	/*! Samples pushed, only written by the producer */
+	volatile uint8_t head;
+	/*! Samples popped, only written by the consumer */
+	volatile uint8_t tail;
+	volatile int8_t samples[SYNTH_FIFO];
+};
+
+/*! Number of samples that can be pushed */
+static inline uint8_t synth_fifo_space(const struct synth_fifo_t* const fifo) {
+	return SYNTH_FIFO - (uint8_t)(fifo->head - fifo->tail);
+}
+
+/*! Push a sample, there must be space */
+static inline void synth_fifo_push(struct synth_fifo_t* const fifo,
+		int8_t sample) {
+	uint8_t head = fifo->head;
+	fifo->samples[head & (SYNTH_FIFO - 1)] = sample;
+	/* Publish the sample only once written */
+	fifo->head = head + 1;
+}
+
+/*!
+ * Pop a sample.  Returns zero if the FIFO is empty (the producer is late),
+ * leaving `sample` untouched.
+ */
+static inline uint8_t synth_fifo_pop(struct synth_fifo_t* const fifo,
+		int8_t* sample) {
+	uint8_t tail = fifo->tail;
+	if (tail == fifo->head)
+		return 0;
+	*sample = fifo->samples[tail & (SYNTH_FIFO - 1)];
+	fifo->tail = tail + 1;
+	return 1;
+}
+
+#endif
@@ -0,0 +1,73 @@
+#!/usr/bin/env python
+
+"""
+Polyphonic synthesizer for microcontrollers: Sequencer stream embedder
+(C) 2026 The atinysynth contributors
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+MA  02110-1301  USA
+"""
+
+import textwrap
+import argparse
+
+# Arguments
+parser = argparse.ArgumentParser(
+        description='Embed a compiled sequencer stream in a C array, '\
+                'stored in flash on AVR'
+)
+parser.add_argument('stream',
+        help='Compiled sequencer stream (compact format)',
+        type=str)
+parser.add_argument('--name',
+        help='Name of the C array',
+        type=str, default='seq_song')
+args = parser.parse_args()
+
+with open(args.stream, 'rb') as f:
+    data = bytearray(f.read())
+
+if data[0:3] != b'SEQ':
+    parser.error('%s is not a compact sequencer stream' % args.stream)
+
+# Output C file
+print ("""/* Generated from %(STREAM)s */
+#include <stdint.h>
+#ifdef __AVR_ARCH__
+#include <avr/pgmspace.h>
+#endif
+const uint16_t %(NAME)s_sz = %(SIZE)d;
+const uint8_t %(NAME)s[%(SIZE)d]
+#ifdef __AVR_ARCH__
+PROGMEM
+#endif
+= {
+%(DATA)s
+};""" % {
+    'STREAM': args.stream,
+    'NAME': args.name,
+    'SIZE': len(data),
+    'DATA': '\n'.join(
+        textwrap.TextWrapper(
+            width=78,
+            initial_indent='    ',
+            subsequent_indent='    '
+        ).wrap(
+            ', '.join([
+                ('0x%02x' % byte) for byte in data
+            ])
+        )
+    )
+})
@@ -0,0 +1,402 @@
+#!/usr/bin/env python
+
+"""
+Polyphonic synthesizer for microcontrollers: Song to C compiler
+(C) 2026 The atinysynth contributors
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+MA  02110-1301  USA
+"""
+
+import textwrap
+import argparse
+
+# Arguments
+parser = argparse.ArgumentParser(
+        description='Compile a sequencer stream to C: constant tables in '\
+                'flash and a player specialised for the song'
+)
+parser.add_argument('stream',
+        help='Compiled sequencer stream (compact format)',
+        type=str)
+parser.add_argument('--header',
+        help='Emit the configuration header instead of the C source, '\
+                'it strips the unused waveform modes and envelope phases',
+        action='store_const', default=False, const=True)
+args = parser.parse_args()
+
+# Constants of waveform.h, adsr.h and seqpack.h
+VOICE_MODES = ['DC', 'SQUARE', 'SAWTOOTH', 'TRIANGLE', 'NOISE']
+ADSR_INFINITE = 0xff
+UINT32_MAX = 0xffffffff
+SEQ_PACK_INSTRUMENT_ESCAPE = 0x3f
+SEQ_PACK_FLAG_INSTRUMENTS = 0x01
+SEQ_PACK_FLAG_LOOPS = 0x02
+SEQ_PACK_CONTROL = 0x80
+SEQ_PACK_CONTROL_INDEX = 0xff
+
+with open(args.stream, 'rb') as f:
+    data = bytearray(f.read())
+
+if data[0:3] != b'SEQ' or data[3] not in (1, 2, 3):
+    parser.error('%s is not a compact sequencer stream' % args.stream)
+
+# Decoder, same as `seq_pack_read_frame`
+pos = 0
+def read():
+    global pos
+    if pos >= len(data):
+        parser.error('%s is truncated' % args.stream)
+    byte = data[pos]
+    pos += 1
+    return byte
+
+def read_varint():
+    value = 0
+    shift = 0
+    while True:
+        byte = read()
+        value |= (byte & 0x7f) << shift
+        shift += 7
+        if not (byte & 0x80) or shift >= 32:
+            return value & UINT32_MAX
+
+def read_period(last):
+    zigzag = read_varint()
+    delta = -((zigzag + 1) >> 1) if zigzag & 1 else (zigzag >> 1)
+    return (last + delta) & 0xffff
+
+def read_u32():
+    return read() | (read() << 8) | (read() << 16) | (read() << 24)
+
+def signed(byte):
+    return byte - 256 if byte & 0x80 else byte
+
+# Frame fields, in `seq_pack_instrument_t` order after period and scale
+FIELDS = ['period', 'time_scale', 'mode', 'amplitude', 'delay_time',
+        'attack_time', 'decay_time', 'sustain_time', 'release_time',
+        'peak_amp', 'sustain_amp']
+INSTRUMENT = FIELDS[2:]
+
+for _ in range(3):
+    read()
+version = read()
+frequency = read() | (read() << 8)
+voices = read()
+chunk_frames = 0
+flags = 0
+if version == 3:
+    # 32-bit count, chunks coded from an all zeros frame.  A repeated
+    # stream is played once: the song tables are unrolled
+    frame_count = read_u32()
+    flags = read()
+    version = 2 if flags & SEQ_PACK_FLAG_INSTRUMENTS else 1
+    chunk_frames = read() | (read() << 8)
+    read_u32()
+    read_u32()
+else:
+    frame_count = read() | (read() << 8)
+
+instruments = []
+if version == 2:
+    for _ in range(read()):
+        instrument = dict((name, read()) for name in INSTRUMENT)
+        instrument['amplitude'] = signed(instrument['amplitude'])
+        instruments.append(instrument)
+
+def is_control(code, index):
+    if not flags & SEQ_PACK_FLAG_LOOPS:
+        return False
+    if version == 2:
+        return index == SEQ_PACK_CONTROL_INDEX
+    return bool(code & SEQ_PACK_CONTROL)
+
+# Loops are unrolled: open loops, as [first frame offset, repetitions left]
+frames = []
+loops = []
+last = dict((name, 0) for name in FIELDS)
+for position in range(frame_count):
+    if chunk_frames and not position % chunk_frames:
+        last = dict((name, 0) for name in FIELDS)
+    while True:
+        code = read()
+        index = code >> 2
+        if version == 2 and index == SEQ_PACK_INSTRUMENT_ESCAPE:
+            index = read()
+        if not is_control(code, index):
+            break
+        times = read_varint()
+        if times:
+            loops.append([pos, times - 1])
+        elif not loops:
+            parser.error('%s is malformed: loop end without start'
+                    % args.stream)
+        elif loops[-1][1]:
+            loops[-1][1] -= 1
+            pos = loops[-1][0]
+        else:
+            loops.pop()
+            continue
+        last = dict((name, 0) for name in FIELDS)
+    if version == 2:
+        if index < len(instruments):
+            last.update(instruments[index])
+        if code & 1:
+            last['period'] = read_period(last['period'])
+        if code & 2:
+            last['time_scale'] = read_varint()
+    else:
+        mask = code
+        if mask & 0x01:
+            last['mode'] = read()
+        if mask & 0x02:
+            last['amplitude'] = signed(read())
+        if mask & 0x04:
+            last['period'] = read_period(last['period'])
+        if mask & 0x08:
+            last['time_scale'] = read_varint()
+        if mask & 0x10:
+            for name in ('delay_time', 'attack_time', 'decay_time'):
+                last[name] = read()
+        if mask & 0x20:
+            for name in ('sustain_time', 'release_time'):
+                last[name] = read()
+        if mask & 0x40:
+            for name in ('peak_amp', 'sustain_amp'):
+                last[name] = read()
+    frames.append(dict(last))
+
+# Envelope duration in samples, same as `adsr_duration`
+def num_samples(scale, units):
+    if units == ADSR_INFINITE:
+        return UINT32_MAX
+    return (scale * units) & UINT32_MAX
+
+def segments_samples(scale, units):
+    time_step = (((units * scale) & UINT32_MAX) >> 4) & 0xffff
+    return 16 * (time_step + 1)
+
+def add_samples(a, b):
+    if b >= UINT32_MAX - a:
+        return UINT32_MAX
+    return a + b
+
+def duration(note):
+    scale = note['time_scale']
+    if not scale:
+        return UINT32_MAX
+    if not any(note[name] for name in INSTRUMENT[2:7]):
+        return UINT32_MAX
+    if not (note['peak_amp'] or note['sustain_amp']):
+        return UINT32_MAX
+    samples = 1
+    for phase in ('delay_time', 'attack_time', 'decay_time',
+            'sustain_time', 'release_time'):
+        units = note[phase]
+        if not units:
+            continue
+        if phase in ('delay_time', 'sustain_time'):
+            wait = num_samples(scale, units)
+            if wait == UINT32_MAX:
+                return UINT32_MAX
+            samples = add_samples(add_samples(samples, wait), 1)
+        else:
+            samples = add_samples(samples,
+                    segments_samples(scale, units))
+    return samples
+
+# Notes: everything but the period, with the resolved duration
+notes = []
+note_index = {}
+song = []
+for frame in frames:
+    key = tuple(frame[name] for name in FIELDS[1:])
+    if key not in note_index:
+        note_index[key] = len(notes)
+        notes.append(frame)
+    song.append((frame['period'], note_index[key]))
+
+modes = sorted(set(note['mode'] for note in notes))
+features = []
+for phase in ('delay', 'attack', 'decay', 'sustain', 'release'):
+    if any(note[phase + '_time'] for note in notes):
+        features.append(phase.upper())
+if any(ADSR_INFINITE in (note['delay_time'], note['sustain_time'])
+        for note in notes):
+    features.append('INFINITE')
+
+def wrap(items):
+    return '\n'.join(
+        textwrap.TextWrapper(
+            width=78,
+            initial_indent='\t',
+            subsequent_indent='\t'
+        ).wrap(', '.join(items))
+    )
+
+if args.header:
+    print ("""/* Generated from %(STREAM)s */
+#ifndef _SEQ_SONG_H
+#define _SEQ_SONG_H
+
+/* Sample rate and voices of the song */
+#define SEQ_SONG_FREQ		(%(FREQ)d)
+#define SEQ_SONG_VOICES		(%(VOICES)d)
+
+/* Strip the waveform modes and envelope phases not used */
+#define VOICE_MODES		(%(MODES)s)
+#define ADSR_FEATURES		(%(FEATURES)s)
+
+struct poly_synth_t;
+
+/*! Start playing the song from the beginning */
+void seq_song_start(struct poly_synth_t* synth);
+
+/*! Must be called at every sample, before `poly_synth_next` */
+void seq_song_feed(struct poly_synth_t* synth);
+
+#endif""" % {
+        'STREAM': args.stream,
+        'FREQ': frequency,
+        'VOICES': voices,
+        'MODES': ' | '.join('(1 << VOICE_MODE_%s)' % VOICE_MODES[mode]
+            for mode in modes) or '0',
+        'FEATURES': ' | '.join('ADSR_FEATURE_%s' % feature
+            for feature in features) or '0',
+    })
+    raise SystemExit(0)
+
+# Output C file
+print ("""/* Generated from %(STREAM)s */
+#include "synth.h"
+#include <string.h>
+#ifdef __AVR_ARCH__
+#include <avr/pgmspace.h>
+#define seq_song_load(dst, src)	memcpy_P(dst, src, sizeof(*(dst)))
+#else
+#define PROGMEM
+#define seq_song_load(dst, src)	memcpy(dst, src, sizeof(*(dst)))
+#endif
+
+#if defined(SYNTH_FREQ) && (SYNTH_FREQ != SEQ_SONG_FREQ)
+#error "The song was compiled for another sample rate"
+#endif
+
+#if defined(ADSR_SHARED_DEF) && defined(__AVR_ARCH__) \
+		&& !defined(ADSR_DEF_PROGMEM)
+#error "The envelopes are shared from flash: define ADSR_DEF_PROGMEM"
+#endif
+
+/*! A note: all of a frame except the period, and its duration */
+struct seq_song_note_t {
+	struct adsr_env_def_t adsr_def;
+	int8_t amplitude;
+	uint8_t mode;
+	uint32_t duration;
+};
+
+/*! A frame, in fetch order */
+struct seq_song_frame_t {
+	uint16_t period;
+	%(INDEX_TYPE)s note;
+};
+
+static const struct seq_song_note_t seq_song_notes[%(NOTE_COUNT)d] PROGMEM = {
+%(NOTES)s
+};
+
+static const struct seq_song_frame_t seq_song_frames[%(FRAME_COUNT)d] PROGMEM = {
+%(FRAMES)s
+};
+
+/* Player state, stopped until `seq_song_start` */
+static %(NEXT_TYPE)s seq_song_next;
+static uint32_t seq_song_clock;
+static uint32_t seq_song_next_due = UINT32_MAX;
+static uint32_t seq_song_voice_due[SEQ_SONG_VOICES];
+
+void seq_song_start(struct poly_synth_t* synth) {
+	synth->enable = 0;
+	seq_song_next = 0;
+	seq_song_clock = 0;
+	seq_song_next_due = 0;
+	memset(seq_song_voice_due, 0, sizeof(seq_song_voice_due));
+}
+
+void seq_song_feed(struct poly_synth_t* synth) {
+	/* Same timing as `seq_player_feed`, with the durations resolved */
+	if (seq_song_clock < seq_song_next_due) {
+		seq_song_clock++;
+		return;
+	}
+
+	uint8_t i;
+	for (i = 0; i < SEQ_SONG_VOICES; i++) {
+		if (seq_song_voice_due[i] <= seq_song_clock) {
+			if (seq_song_next == %(FRAME_COUNT)d) {
+				/* End-of-stream */
+				seq_song_next_due = UINT32_MAX;
+				return;
+			}
+
+			struct seq_song_frame_t frame;
+			struct seq_song_note_t note;
+			seq_song_load(&frame, &seq_song_frames[seq_song_next++]);
+			seq_song_load(&note, &seq_song_notes[frame.note]);
+
+			struct voice_wf_def_t wf_def = {
+				.mode = note.mode,
+				.amplitude = note.amplitude,
+				.period = frame.period
+			};
+			voice_wf_set(&synth->voice[i].wf, &wf_def);
+#ifdef ADSR_SHARED_DEF
+			/* The voice reads the envelope from the note table */
+			adsr_config(&synth->voice[i].adsr,
+					&seq_song_notes[frame.note].adsr_def);
+#else
+			adsr_config(&synth->voice[i].adsr, &note.adsr_def);
+#endif
+			synth->enable |= (uintptr_t)1 << i;
+
+			seq_song_voice_due[i] =
+				(note.duration < (UINT32_MAX - seq_song_clock))
+				? (seq_song_clock + note.duration) : UINT32_MAX;
+			break;
+		}
+	}
+
+	seq_song_clock++;
+	seq_song_next_due = UINT32_MAX;
+	for (i = 0; i < SEQ_SONG_VOICES; i++) {
+		if (seq_song_voice_due[i] < seq_song_next_due)
+			seq_song_next_due = seq_song_voice_due[i];
+	}
+}""" % {
+    'STREAM': args.stream,
+    'INDEX_TYPE': 'uint8_t' if len(notes) <= 256 else 'uint16_t',
+    # Version 3 streams and loops can have more than 65535 frames
+    'NEXT_TYPE': 'uint16_t' if len(song) <= 0xffff else 'uint32_t',
+    'NOTE_COUNT': len(notes),
+    'NOTES': '\n'.join(
+        '\t{ { %d, %d, %d, %d, %d, %d, %d, %d }, %d, %d, %dUL },' % (
+            note['time_scale'], note['delay_time'], note['attack_time'],
+            note['decay_time'], note['sustain_time'],
+            note['release_time'], note['peak_amp'], note['sustain_amp'],
+            note['amplitude'], note['mode'], duration(note))
+        for note in notes),
+    'FRAME_COUNT': len(song),
+    'FRAMES': wrap(['{ %d, %d }' % frame for frame in song]),
+})
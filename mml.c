@@ -24,55 +24,81 @@
 #include "debug.h"
 #include <stdlib.h>
 #include <string.h>
-#include <math.h>
+#include <limits.h>
 
 /*!
  * Not optimized for microcontroller usage.
  * Requires dynamic memory allocation support (heap), especially `malloc` and `realloc`.
  */
 
-/*! Manage parser errors */
+/*! Error handler of `mml_compile` */
 static void (*error_handler)(const char* err, int line, int column);
-static int line = 1;
-static int pos = 1;
 
-#define ARTICULATION_STACCATO (3.0 / 4.0)
-#define ARTICULATION_NORMAL (7.0 / 8.0)
-#define ARTICULATION_LEGATO (1.0)
+/*! Played part of the notes, in eighths */
+#define ARTICULATION_STACCATO (6)
+#define ARTICULATION_NORMAL (7)
+#define ARTICULATION_LEGATO (8)
 
-/*! Temporary list of sequencer stream frames, per channel */
-static struct seq_frame_map_t frame_map;
+/*! Frames of a new channel list, doubled when full */
+#define MML_LIST_FRAMES (16)
 
-static void init_stream_channel(int channel) {
-	// Init new channels
-	frame_map.channels[channel].count = 0;
-	frame_map.channels[channel].frames = malloc(sizeof(struct seq_frame_t) * 16);
-}
+/*! Loop count when not given */
+#define MML_LOOP_DEFAULT_COUNT (2)
+
+/*! Error of a loop end without start, also a loop cut by a chunk */
+static const char mml_unmatched_loop[] = "Unmatched loop end";
 
-static void add_channel_frame(int channel, int frequency, int duration, int volume, double articulation, int waveform) {
-	if (channel >= frame_map.channel_count) {
-		int old_count = frame_map.channel_count;
-		frame_map.channel_count = channel + 1;
-		frame_map.channels = realloc(frame_map.channels, sizeof(struct seq_frame_list_t) * frame_map.channel_count);
-		for (int i = old_count; i < frame_map.channel_count; i++) {
+/*! Append a frame to the channel list of a frame map */
+static void add_map_frame(struct mml_parser_t* parser, int channel, const struct seq_frame_t* frame) {
+	struct seq_frame_map_t* frame_map = parser->output;
+	if (channel >= frame_map->channel_count) {
+		int old_count = frame_map->channel_count;
+		frame_map->channel_count = channel + 1;
+		frame_map->channels = realloc(frame_map->channels, sizeof(struct seq_frame_list_t) * frame_map->channel_count);
+		for (int i = old_count; i < frame_map->channel_count; i++) {
 			// Init new channels
-			init_stream_channel(i);
+			frame_map->channels[i].count = 0;
+			frame_map->channels[i].frames = malloc(sizeof(struct seq_frame_t) * MML_LIST_FRAMES);
 		}
 	}
 
-	if (frame_map.channels[channel].count > 0 && (frame_map.channels[channel].count % 16) == 0) {
-		frame_map.channels[channel].frames = realloc(frame_map.channels[channel].frames, sizeof(struct seq_frame_t) * (frame_map.channels[channel].count + 16));
+	struct seq_frame_list_t* list = &frame_map->channels[channel];
+	// The list is full when its count is a power of two
+	if (list->count >= MML_LIST_FRAMES && !(list->count & (list->count - 1))) {
+		list->frames = realloc(list->frames, sizeof(struct seq_frame_t) * list->count * 2);
+	}
+	list->frames[list->count++] = *frame;
+}
+
+/*! Only count the frames of every channel */
+static void count_frame(struct mml_parser_t* parser, int channel,
+		const struct seq_frame_t* frame) {
+	(void)frame;
+	int* counts = parser->output;
+	counts[channel]++;
+}
+
+/*! Keep the frame of the parser channel, used as frame source */
+static void keep_frame(struct mml_parser_t* parser, int channel, const struct seq_frame_t* frame) {
+	if (channel == parser->channel) {
+		parser->frame = *frame;
+		parser->has_frame = 1;
 	}
+}
 
-	struct seq_frame_t* p = &frame_map.channels[channel].frames[frame_map.channels[channel].count++];
+/*! Emit the frame of a note, a pause if `period` is zero */
+static void add_channel_frame(struct mml_parser_t* parser, int channel, uint16_t period, int duration, int volume, int articulation, int waveform) {
+	struct seq_frame_t frame;
+	struct seq_frame_t* p = &frame;
 
-	if (!frequency) {
+	if (!period) {
 		p->waveform_def.mode = VOICE_MODE_DC;
+		p->waveform_def.period = 0;
+		p->waveform_def.amplitude = 0;
 	} else {
-		p->waveform_def.mode = VOICE_MODE_SQUARE;
-		p->waveform_def.period = voice_wf_freq_to_period(frequency);
-		p->waveform_def.amplitude = volume;
 		p->waveform_def.mode = waveform;
+		p->waveform_def.period = period;
+		p->waveform_def.amplitude = volume;
 	}
 
 	// Init voice, simple square without envelope
@@ -85,12 +111,28 @@ static void add_channel_frame(int channel, int frequency, int duration, int volu
 	// Calc duration and scale: TODO better scale algo
 	int scale = duration / 128;
 	p->adsr_def.time_scale = scale;
-	p->adsr_def.release_time = 128 * (1.0 - articulation); 
+	p->adsr_def.release_time = 16 * (ARTICULATION_LEGATO - articulation);
 	p->adsr_def.sustain_time = 128 - (p->adsr_def.delay_time + p->adsr_def.attack_time + p->adsr_def.decay_time + p->adsr_def.release_time);
+
+	parser->emit(parser, channel, &frame);
 }
 
-void mml_set_error_handler(void (*handler)(const char* err, int line, int column)) {
-	error_handler = handler;
+/*! Report a parse error at the current position */
+static void mml_error(struct mml_parser_t* parser, const char* err) {
+	struct mml_chunk_t* chunk = parser->chunk;
+	if (chunk) {
+		// Only the first error, the chunk is parsed no further
+		if (!chunk->error) {
+			chunk->error = err;
+			chunk->error_line = parser->line;
+			chunk->error_column = parser->pos;
+		}
+		return;
+	}
+	struct mml_compiler_t* compiler = parser->compiler;
+	if (compiler && compiler->error_handler) {
+		compiler->error_handler(compiler->user, err, parser->line, parser->pos);
+	}
 }
 
 /*! Read a single digit from the stream and advance */
@@ -105,225 +147,492 @@ static uint8_t read_digit(const char** str, int* pos) {
 	}
 }
 
-/*! Read a number from the stream and advance */
+/*!
+ * Read a number from the stream and advance.  The same as `strtol` in
+ * base 10, leading blanks and sign included, without its locale lookups,
+ * and clamped to the range of int.
+ */
 static int read_number(const char** str, int* pos) {
-	char* end;
-	int ret = strtol(*str, &end, 10);
-	if (!ret || end == *str) {
+	const char* end = *str;
+	while (*end == ' ' || (*end >= '\t' && *end <= '\r')) {
+		end++;
+	}
+	int negative = (*end == '-');
+	if (*end == '-' || *end == '+') {
+		end++;
+	}
+	const char* digits = end;
+	// Saturated at the limit, the digits past it are still read
+	unsigned int limit = negative ? (unsigned int)INT_MAX + 1 : INT_MAX;
+	unsigned int value = 0;
+	for (; *end >= '0' && *end <= '9'; end++) {
+		unsigned int digit = *end - '0';
+		value = (value > (limit - digit) / 10) ? limit : value * 10 + digit;
+	}
+	if (end == digits || !value) {
 		return -1;
 	}
 	*pos += (end - *str);
 	*str = end;
-	return ret;
+	return negative ? -(int)(value - 1) - 1 : (int)value;
 }
 
-/*! Convert a node 0-84 to frequency. 0 is "C" at octave 0, so octave 2 (fourth-octave in scientific pitch) c2 = note 24, and a2 (Helmholtz 440Hz) = note 33 */
-static int get_freq_from_code(int noteCode) {
-	return (int)(440.0 * pow(2, ((noteCode - 33) / 12.0)));
-}
+/*!
+ * Frequency of the note codes, `440 * 2^((code - 33) / 12)` truncated.
+ * 0 is "C" at octave 0, so octave 2 (fourth-octave in scientific pitch)
+ * c2 = note 24, and a2 (Helmholtz 440Hz) = note 33.
+ */
+static const uint16_t note_freqs[MML_NOTE_COUNT] = {
+	65, 69, 73, 77, 82, 87, 92, 97, 103, 110, 116, 123,
+	130, 138, 146, 155, 164, 174, 184, 195, 207, 220, 233, 246,
+	261, 277, 293, 311, 329, 349, 369, 391, 415, 440, 466, 493,
+	523, 554, 587, 622, 659, 698, 739, 783, 830, 880, 932, 987,
+	1046, 1108, 1174, 1244, 1318, 1396, 1479, 1567, 1661, 1760, 1864, 1975,
+	2093, 2217, 2349, 2489, 2637, 2793, 2959, 3135, 3322, 3520, 3729, 3951,
+	4186, 4434, 4698, 4978, 5274, 5587, 5919, 6271, 6644, 7040, 7458, 7902,
+	8372, 8869, 9397, 9956, 10548, 11175, 11839, 12543, 13289, 14080, 14917, 15804,
+	16744, 17739, 18794, 19912, 21096, 22350, 23679, 25087, 26579, 28160, 29834, 31608,
+	33488, 35479, 37589, 39824, 42192, 44701, 47359, 50175, 53159, 56320, 59668, 63217,
+};
 
-/*! Convert a a-g code chromatic scale to frequency. Octave 2 is the fourth-octave in scientific pitch */
-static int get_freq_from_note(char note, int sharp, int octave) {
-	int semitone = ((note - 'a' + 5) % 7) * 2;
-	if (semitone > 4) {
-		semitone--;
+/*! Compute the period of every note at `synth_freq`, once per parser */
+static void init_periods(struct mml_parser_t* parser) {
+	for (int i = 0; i < MML_NOTE_COUNT; i++) {
+		parser->periods[i] = voice_wf_freq_to_period(note_freqs[i]);
 	}
-	if (sharp) {
-		semitone++;
-	}
-	// semitone is 0 for c
-	return get_freq_from_code(semitone + octave * 12);
 }
 
-/*! Get duration in samples. Tempo is in numbers of quartes per minute. Length is fraction of whole note. Dots are number of dots (1 dot = 3/2, 2 dots = 9/4, etc..) */
+/*! Semitone of the notes in their octave, from g below a (a flat) to g */
+static const uint8_t note_semitones['g' - '`' + 1] = { 7, 9, 11, 0, 2, 4, 5, 7 };
+
+/*!
+ * Get duration in samples. Tempo is in numbers of quartes per minute. Length is fraction of whole note. Dots are number of dots (1 dot = 3/2, 2 dots = 9/4, etc..)
+ * Exact in integers: `synth_freq * 60 * 4 * 3^dots / (tempo * length * 2^dots)`, truncated.
+ */
 static int get_duration(int tempo, int length, int dots) {
-	double l = length;
-	for (; dots > 0; dots--) {
-		l /= 1.5;
-	}
-	return (int)(synth_freq * 60.0 * 4 / tempo / l);
-}
-
-/*! Parser state, per channel */
-struct mml_channel_state_t {
-	uint8_t octave;
-	int defaultLength;
-	int defaultLengthDot;
-	int tempo;
-	int volume;
-	double articulation;
-	int waveform;
-	// Active in current MML parsing line
-	int isActive;
-};
-static struct mml_channel_state_t* mml_channel_states;
-static int mml_channel_count;
+	uint64_t samples = (uint64_t)synth_freq * 60 * 4;
+	uint64_t whole = (uint64_t)tempo * length;
+	// Way longer than any time scale before overflowing
+	for (; dots > 0 && samples <= UINT64_MAX / 3 && whole <= UINT64_MAX / 2; dots--) {
+		samples *= 3;
+		whole *= 2;
+	}
+	samples /= whole;
+	return (samples > INT_MAX) ? INT_MAX : (int)samples;
+}
+
+/*! Initial state of a channel */
+static void init_channel(struct mml_channel_state_t* state) {
+	state->octave = 4;
+	state->defaultLength = 4;
+	state->defaultLengthDot = 0;
+	state->tempo = 120;
+	state->volume = 63;
+	state->articulation = ARTICULATION_NORMAL;
+	state->waveform = VOICE_MODE_SQUARE;
+	state->isActive = 0;
+}
 
-static void enable_channel(int channel) {
-	if (channel >= mml_channel_count) {
-		mml_channel_count = channel + 1;
-		mml_channel_states = realloc(mml_channel_states, sizeof(struct mml_channel_state_t) * mml_channel_count);
+/*! State of a channel not known yet, when scanning a chunk */
+static void init_unknown_channel(struct mml_channel_state_t* state) {
+	state->octave = MML_OCTAVE_RELATIVE;
+	state->defaultLength = MML_STATE_UNKNOWN;
+	state->defaultLengthDot = MML_STATE_UNKNOWN;
+	state->tempo = MML_STATE_UNKNOWN;
+	state->volume = MML_STATE_UNKNOWN;
+	state->articulation = MML_STATE_UNKNOWN;
+	state->waveform = MML_STATE_UNKNOWN;
+	state->isActive = 0;
+}
+
+static void enable_channel(struct mml_parser_t* parser, int channel) {
+	while (channel >= parser->channel_count) {
 		// Init new channel
-		mml_channel_states[channel].octave = 4;
-		mml_channel_states[channel].defaultLength = 4;
-		mml_channel_states[channel].defaultLengthDot = 0;
-		mml_channel_states[channel].tempo = 120;
-		mml_channel_states[channel].volume = 63;
-		mml_channel_states[channel].articulation = ARTICULATION_NORMAL;
-		mml_channel_states[channel].waveform = VOICE_MODE_SQUARE;
+		struct mml_channel_state_t* state = &parser->channels[parser->channel_count++];
+		if (parser->compiler || parser->emit) {
+			init_channel(state);
+		} else {
+			// Scanning a chunk
+			init_unknown_channel(state);
+		}
 	}
 
-	mml_channel_states[channel].isActive = 1;
+	parser->channels[channel].isActive = 1;
 }
 
 // By default, if no channel identifier at the beginning of a MML line, it is referring to A channel only
-static void reset_active_state() {
-	for (int i = 1; i < mml_channel_count; i++) {
-		mml_channel_states[i].isActive = 0;
+static void reset_active_state(struct mml_parser_t* parser) {
+	for (int i = 1; i < parser->channel_count; i++) {
+		parser->channels[i].isActive = 0;
 	}
-	enable_channel(0);
+	enable_channel(parser, 0);
 }
 
-/*! 
- * Parse the MML file and produce sequencer stream of frames in `stream_channel` array.
- */
-static int mml_parse(const char* content) {
-	line = 1;
-	pos = 0;
+static void mml_parser_init(struct mml_parser_t* parser, struct mml_compiler_t* compiler) {
+	parser->compiler = compiler;
+	parser->content = compiler->content;
+	parser->end = NULL;
+	parser->chunk = NULL;
+	parser->line = 1;
+	parser->pos = 0;
+	parser->done = 0;
+	parser->has_frame = 0;
+	parser->loop_count = 0;
+	init_periods(parser);
 
 	// Starts with 1 voice
-	mml_channel_states = malloc(0);
-	frame_map.channels = malloc(0);
-	frame_map.channel_count = 0;
+	parser->channel_count = 0;
+	reset_active_state(parser);
+}
 
-	// Read the string until end
-	reset_active_state();
-	while(1) {
-		pos++;
-		char code = content[0];
-		content++;
-		if (!code) {
-			break;
+/*! Commands, by their first character */
+enum mml_token_t {
+	MML_TOKEN_UNKNOWN = 0,
+	MML_TOKEN_BLANK,
+	MML_TOKEN_COMMENT,
+	MML_TOKEN_CHANNEL,
+	MML_TOKEN_LOOP_START,
+	MML_TOKEN_LOOP_END,
+	MML_TOKEN_OCTAVE,
+	MML_TOKEN_OCTAVE_DOWN,
+	MML_TOKEN_OCTAVE_UP,
+	MML_TOKEN_LENGTH,
+	MML_TOKEN_TEMPO,
+	MML_TOKEN_VOLUME,
+	MML_TOKEN_ARTICULATION,
+	MML_TOKEN_WAVEFORM,
+	MML_TOKEN_NOTE,
+	MML_TOKEN_NOTE_CODE,
+	MML_TOKEN_PAUSE,
+};
+
+/*!
+ * Token of the characters up to 127.  The control characters, the space
+ * and the bytes above 127 (e.g. UTF-8 text) are blanks, see `mml_token`.
+ */
+static const uint8_t mml_tokens[128] = {
+	['|'] = MML_TOKEN_BLANK,
+	['#'] = MML_TOKEN_COMMENT,
+	[';'] = MML_TOKEN_COMMENT,
+	['A'] = MML_TOKEN_CHANNEL, ['B'] = MML_TOKEN_CHANNEL, ['C'] = MML_TOKEN_CHANNEL, ['D'] = MML_TOKEN_CHANNEL, ['E'] = MML_TOKEN_CHANNEL, ['F'] = MML_TOKEN_CHANNEL, ['G'] = MML_TOKEN_CHANNEL,
+	['H'] = MML_TOKEN_CHANNEL, ['I'] = MML_TOKEN_CHANNEL, ['J'] = MML_TOKEN_CHANNEL, ['K'] = MML_TOKEN_CHANNEL, ['L'] = MML_TOKEN_CHANNEL, ['M'] = MML_TOKEN_CHANNEL, ['N'] = MML_TOKEN_CHANNEL,
+	['O'] = MML_TOKEN_CHANNEL, ['P'] = MML_TOKEN_CHANNEL, ['Q'] = MML_TOKEN_CHANNEL, ['R'] = MML_TOKEN_CHANNEL, ['S'] = MML_TOKEN_CHANNEL, ['T'] = MML_TOKEN_CHANNEL, ['U'] = MML_TOKEN_CHANNEL,
+	['V'] = MML_TOKEN_CHANNEL, ['W'] = MML_TOKEN_CHANNEL, ['X'] = MML_TOKEN_CHANNEL, ['Y'] = MML_TOKEN_CHANNEL, ['Z'] = MML_TOKEN_CHANNEL,
+	['['] = MML_TOKEN_LOOP_START,
+	[']'] = MML_TOKEN_LOOP_END,
+	['o'] = MML_TOKEN_OCTAVE,
+	['<'] = MML_TOKEN_OCTAVE_DOWN,
+	['>'] = MML_TOKEN_OCTAVE_UP,
+	['l'] = MML_TOKEN_LENGTH,
+	['t'] = MML_TOKEN_TEMPO,
+	['v'] = MML_TOKEN_VOLUME,
+	['m'] = MML_TOKEN_ARTICULATION,
+	['w'] = MML_TOKEN_WAVEFORM,
+	['a'] = MML_TOKEN_NOTE, ['b'] = MML_TOKEN_NOTE, ['c'] = MML_TOKEN_NOTE, ['d'] = MML_TOKEN_NOTE, ['e'] = MML_TOKEN_NOTE, ['f'] = MML_TOKEN_NOTE, ['g'] = MML_TOKEN_NOTE,
+	['n'] = MML_TOKEN_NOTE_CODE,
+	['p'] = MML_TOKEN_PAUSE,
+	['r'] = MML_TOKEN_PAUSE,
+};
+
+/*! Token of a character */
+static inline uint8_t mml_token(uint8_t code) {
+	return (code <= ' ' || code >= 128) ? MML_TOKEN_BLANK : mml_tokens[code];
+}
+
+/*! Parse a note, a note code or a pause, after its first character */
+static int mml_parse_note(struct mml_parser_t* parser, char code, int isPause, int isNoteCode) {
+	int length = -1;
+	int dot = 0;
+	int sharp = 0;
+	int customLength = 0;
+	int noteCode = -1;
+
+	while (1) {
+		char next = parser->content[0];
+		if (!isPause && !isNoteCode) {
+			// Sharp/flat?
+			if (next == '-' || next == '+' || next == '#') {
+				// variation
+				if (next == '-') {
+					code--;
+				}
+				if (code == 'e' || code == 'b' || code < '`') {
+					mml_error(parser, "Invalid sharp");
+					return 1;
+				}
+				sharp = 1;
+				parser->content++;
+				parser->pos++;
+				continue;
+			}
+		}
+		if (next >= '0' && next <= '9') {
+			if (isNoteCode) {
+				if (noteCode != -1) {
+					mml_error(parser, "Invalid note code");
+					return 1;
+				}
+				noteCode = read_number(&parser->content, &parser->pos);
+				if (noteCode < 0 || noteCode > 84) {
+					mml_error(parser, "Invalid note code");
+					return 1;
+				}
+			} else {
+				if (customLength) {
+					mml_error(parser, "Invalid length");
+					return 1;
+				}
+				// Length
+				length = read_number(&parser->content, &parser->pos);
+				if (length < 0) {
+					mml_error(parser, "Invalid length");
+					return 1;
+				}
+				customLength = 1;
+			}
+			continue;
+		}
+		if (next == '.') {
+			// Half length
+			dot++;
+			parser->content++;
+			parser->pos++;
+			continue;
+		}
+		break;
+	}
+
+	if (isNoteCode && noteCode < 0) {
+		mml_error(parser, "Invalid note code");
+		return 1;
+	}
+	if (!parser->emit) {
+		// Scanning a chunk: the states are unknown, and only they matter
+		return 0;
+	}
+
+	// Set note
+	if (isNoteCode && noteCode == 0) {
+		isPause = 1;
+	}
+	int semitone = (isPause || isNoteCode) ? 0 : note_semitones[code - '`'] + sharp;
+	for (int i = 0; i < parser->channel_count; i++) {
+		if (parser->channels[i].isActive) {
+			uint16_t period = isPause ? 0 : parser->periods[isNoteCode ? noteCode : semitone + parser->channels[i].octave * 12];
+			int duration = get_duration(parser->channels[i].tempo, length < 0 ? parser->channels[i].defaultLength : length, (length < 0 && !dot) ? parser->channels[i].defaultLengthDot : dot);
+			add_channel_frame(parser, i, period, duration, parser->channels[i].volume, parser->channels[i].articulation, parser->channels[i].waveform);
 		}
+	}
+	return 0;
+}
 
-		if (code <= 32 || code == '|') {
+/*! 
+ * Parse the next MML command, sending the resulting frames to the `emit` handler.
+ * Returns non-zero in case of parse error, sets `done` at the end of the content.
+ */
+static int mml_parse_command(struct mml_parser_t* parser) {
+	parser->pos++;
+	char code = (parser->content != parser->end) ? parser->content[0] : 0;
+	if (!code) {
+		parser->done = 1;
+		if (parser->loop_count) {
+			mml_error(parser, "Unterminated loop");
+			return 1;
+		}
+		return 0;
+	}
+	parser->content++;
+
+	uint8_t token = mml_token(code);
+	switch (token) {
+		case MML_TOKEN_BLANK:
 			// Skip blanks and partitures
 			if (code == '\n') {
-				line++;
-				reset_active_state();
-				pos = 0;
+				parser->line++;
+				reset_active_state(parser);
+				parser->pos = 0;
 			}
 			if (code == '\r') {
-				pos--;
+				parser->pos--;
 			}
-			continue;
-		}
+			while (parser->content != parser->end && *parser->content == ' ') {
+				// The rest of a run of spaces
+				parser->content++;
+				parser->pos++;
+			}
+			break;
 
-		if (code == '#' || code == ';') {
+		case MML_TOKEN_COMMENT:
 			// Skip line comment
-			while (*content != '\n') {
-				content++;
+			while (*parser->content && *parser->content != '\n') {
+				parser->content++;
 			}
-			content++;
-			line++;
-			reset_active_state();
-			pos = 0;
-			continue;
+			if (*parser->content) {
+				parser->content++;
+			}
+			parser->line++;
+			reset_active_state(parser);
+			parser->pos = 0;
+			break;
+
+		case MML_TOKEN_CHANNEL:
+			if (parser->pos != 1) {
+				mml_error(parser, "Misplaced channel selector");
+				return 1;
+			}
+			// Decode active channels
+			parser->channels[0].isActive = 0;
+			enable_channel(parser, code - 'A');
+			while (*parser->content >= 'A' && *parser->content <= 'Z') {
+				enable_channel(parser, *parser->content - 'A');
+				parser->content++;
+				parser->pos++;
+			}
+			break;
+
+		case MML_TOKEN_LOOP_START: {
+			// Loop start: the body is parsed again at the end
+			if (parser->loop_count == MML_MAX_LOOPS) {
+				mml_error(parser, "Too many nested loops");
+				return 1;
+			}
+			struct mml_loop_t* loop = &parser->loops[parser->loop_count++];
+			loop->content = parser->content;
+			loop->line = parser->line;
+			loop->pos = parser->pos;
+			loop->active = 0;
+			for (int i = 0; i < parser->channel_count; i++) {
+				if (parser->channels[i].isActive) {
+					loop->active |= (uint32_t)1 << i;
+				}
+			}
+			loop->left = -1;
+			break;
 		}
 
-		if (code >= 'A' && code <= 'Z') {
-			if (pos == 1) {
-				// Decode active channels
-				mml_channel_states[0].isActive = 0;
-				enable_channel(code - 'A');
-				while (*content >= 'A' && *content <= 'Z') {
-					enable_channel(*content - 'A');
-					content++;
-					pos++;
+		case MML_TOKEN_LOOP_END: {
+			// Loop end, with an optional count
+			if (!parser->loop_count) {
+				mml_error(parser, mml_unmatched_loop);
+				return 1;
+			}
+			int count = MML_LOOP_DEFAULT_COUNT;
+			if (*parser->content >= '0' && *parser->content <= '9') {
+				count = read_number(&parser->content, &parser->pos);
+				if (count < 0) {
+					mml_error(parser, "Invalid loop count");
+					return 1;
 				}
-				continue;
-			} else {
-				error_handler("Misplaced channel selector", line, pos);
 			}
+			struct mml_loop_t* loop = &parser->loops[parser->loop_count - 1];
+			if (loop->left < 0) {
+				loop->left = count - 1;
+			}
+			if (!loop->left) {
+				parser->loop_count--;
+				break;
+			}
+			loop->left--;
+			parser->content = loop->content;
+			parser->line = loop->line;
+			parser->pos = loop->pos;
+			for (int i = 0; i < parser->channel_count; i++) {
+				parser->channels[i].isActive = (loop->active >> i) & 1;
+			}
+			break;
 		}
 
-		int isPause;
-		int isNoteCode;
-		if (code == 'o') {
-			int octave = read_digit(&content, &pos);
+		case MML_TOKEN_OCTAVE: {
+			int octave = read_digit(&parser->content, &parser->pos);
 			if (octave == 255 || octave > 6) {
-				error_handler("Invalid octave", line, pos);
+				mml_error(parser, "Invalid octave");
 				return 1;
 			}
-			for (int i = 0; i < mml_channel_count; i++) {
-				if (mml_channel_states[i].isActive) {
-					mml_channel_states[i].octave = octave;
+			for (int i = 0; i < parser->channel_count; i++) {
+				if (parser->channels[i].isActive) {
+					parser->channels[i].octave = octave;
 				}
 			}
-		} else if (code == 'l') {
-			int length = read_number(&content, &pos);
+			break;
+		}
+
+		case MML_TOKEN_LENGTH: {
+			int length = read_number(&parser->content, &parser->pos);
 			if (length < 0) {
-				error_handler("Invalid length", line, pos);
+				mml_error(parser, "Invalid length");
 				return 1;
 			}
 			int dot = 0;
-			while (*content == '.') {
+			while (*parser->content == '.') {
 				dot++;
-				content++;
-				pos++;
+				parser->content++;
+				parser->pos++;
 			}
-			for (int i = 0; i < mml_channel_count; i++) {
-				if (mml_channel_states[i].isActive) {
-					mml_channel_states[i].defaultLength = length;
-					mml_channel_states[i].defaultLengthDot = dot;
+			for (int i = 0; i < parser->channel_count; i++) {
+				if (parser->channels[i].isActive) {
+					parser->channels[i].defaultLength = length;
+					parser->channels[i].defaultLengthDot = dot;
 				}
 			}
-		} else if (code == 't') {
-			int tempo = read_number(&content, &pos);
+			break;
+		}
+
+		case MML_TOKEN_TEMPO: {
+			int tempo = read_number(&parser->content, &parser->pos);
 			if (tempo < 0) {
-				error_handler("Invalid tempo", line, pos);
+				mml_error(parser, "Invalid tempo");
 				return 1;
 			}
-			for (int i = 0; i < mml_channel_count; i++) {
-				if (mml_channel_states[i].isActive) {
-					mml_channel_states[i].tempo = tempo;
+			for (int i = 0; i < parser->channel_count; i++) {
+				if (parser->channels[i].isActive) {
+					parser->channels[i].tempo = tempo;
 				}
 			}
-		} else if (code == 'v') {
-			int volume = read_number(&content, &pos);
+			break;
+		}
+
+		case MML_TOKEN_VOLUME: {
+			int volume = read_number(&parser->content, &parser->pos);
 			if (volume < 0 || volume > 128) {
-				error_handler("Invalid volume", line, pos);
+				mml_error(parser, "Invalid volume");
 				return 1;
 			}
-			for (int i = 0; i < mml_channel_count; i++) {
-				if (mml_channel_states[i].isActive) {
-					mml_channel_states[i].volume = volume;
+			for (int i = 0; i < parser->channel_count; i++) {
+				if (parser->channels[i].isActive) {
+					parser->channels[i].volume = volume;
 				}
 			}
-		} else if (code == '<') {
-			for (int i = 0; i < mml_channel_count; i++) {
-				if (mml_channel_states[i].isActive) {
-					if (mml_channel_states[i].octave == 0) {
-						error_handler("Invalid octave step down", line, pos);
+			break;
+		}
+
+		case MML_TOKEN_OCTAVE_DOWN:
+			for (int i = 0; i < parser->channel_count; i++) {
+				if (parser->channels[i].isActive) {
+					if (parser->channels[i].octave == 0) {
+						mml_error(parser, "Invalid octave step down");
 						return 1;
 					}
-					mml_channel_states[i].octave--;
+					parser->channels[i].octave--;
 				}
 			}
-		} else if (code == '>') {
-			for (int i = 0; i < mml_channel_count; i++) {
-				if (mml_channel_states[i].isActive) {
-					if (mml_channel_states[i].octave == 9) {
-						error_handler("Invalid octave step up", line, pos);
+			break;
+
+		case MML_TOKEN_OCTAVE_UP:
+			for (int i = 0; i < parser->channel_count; i++) {
+				if (parser->channels[i].isActive) {
+					if (parser->channels[i].octave == 9) {
+						mml_error(parser, "Invalid octave step up");
 						return 1;
 					}
-					mml_channel_states[i].octave++;
+					parser->channels[i].octave++;
 				}
 			}
-		} else if (code == 'm') {
+			break;
+
+		case MML_TOKEN_ARTICULATION: {
 			// Music articulation
-			double articulation;
-			switch (*content) {
+			int articulation;
+			switch (*parser->content) {
 				case 'l': 
 					articulation = ARTICULATION_LEGATO;
 					break;
@@ -334,20 +643,23 @@ static int mml_parse(const char* content) {
 					articulation = ARTICULATION_STACCATO;
 					break;
 				default:
-					error_handler("Invalid music articulation", line, pos);
+					mml_error(parser, "Invalid music articulation");
 					return 1;
 			}
-			for (int i = 0; i < mml_channel_count; i++) {
-				if (mml_channel_states[i].isActive) {
-					mml_channel_states[i].articulation = articulation;
+			for (int i = 0; i < parser->channel_count; i++) {
+				if (parser->channels[i].isActive) {
+					parser->channels[i].articulation = articulation;
 				}
 			}
-			pos++;
-			content++;
-		} else if (code == 'w') {
+			parser->pos++;
+			parser->content++;
+			break;
+		}
+
+		case MML_TOKEN_WAVEFORM: {
 			// Waveform
 			int waveform;
-			switch (*content) {
+			switch (*parser->content) {
 				case 's': 
 					waveform = VOICE_MODE_SQUARE;
 					break;
@@ -358,109 +670,342 @@ static int mml_parse(const char* content) {
 					waveform = VOICE_MODE_TRIANGLE;
 					break;
 				default:
-					error_handler("Invalid waveform", line, pos);
+					mml_error(parser, "Invalid waveform");
 					return 1;
 			}
-			for (int i = 0; i < mml_channel_count; i++) {
-				if (mml_channel_states[i].isActive) {
-					mml_channel_states[i].waveform = waveform;
-				}
-			}
-			pos++;
-			content++;
-		} else if ((isPause = (code == 'p' || code == 'r')) || (isNoteCode = code == 'n') || (code >= 'a' && code <= 'g')) {
-			// Note or pause
-			int length = -1;
-			int dot = 0;
-			int sharp = 0;
-			int customLength = 0;
-			int noteCode = -1;
-
-			while (1) {
-				char next = content[0];
-				if (!isPause && !isNoteCode) {
-					// Sharp/flat?
-					if (next == '-' || next == '+' || next == '#') {
-						// variation
-						if (next == '-') {
-							code--;
-						}
-						if (code == 'e' || code == 'b') {
-							error_handler("Invalid sharp", line, pos);
-							return 1;
-						}
-						sharp = 1;
-						content++;
-						pos++;
-						continue;
-					}
-				}
-				if (next >= '0' && next <= '9') {
-					if (isNoteCode) {
-						if (noteCode != -1) {
-							error_handler("Invalid note code", line, pos);
-							return 1;
-						}
-						noteCode = read_number(&content, &pos);
-						if (noteCode < 0 || noteCode > 84) {
-							error_handler("Invalid note code", line, pos);
-							return 1;
-						}
-					} else {
-						if (customLength) {
-							error_handler("Invalid length", line, pos);
-							return 1;
-						}
-						// Length
-						length = read_number(&content, &pos);
-						if (length < 0) {
-							error_handler("Invalid length", line, pos);
-							return 1;
-						}
-						customLength = 1;
-					}
-					continue;
+			for (int i = 0; i < parser->channel_count; i++) {
+				if (parser->channels[i].isActive) {
+					parser->channels[i].waveform = waveform;
 				}
-				if (next == '.') {
-					// Half length
-					dot++;
-					content++;
-					pos++;
-					continue;
-				}
-				break;
 			}
+			parser->pos++;
+			parser->content++;
+			break;
+		}
 
-			// Set note
-			for (int i = 0; i < mml_channel_count; i++) {
-				if (mml_channel_states[i].isActive) {
-					if (isNoteCode && noteCode == 0) {
-						isPause = 1;
-					}
-					int frequency = isPause ? 0 : (isNoteCode ? get_freq_from_code(noteCode) : get_freq_from_note(code, sharp, mml_channel_states[i].octave));
-					int duration = get_duration(mml_channel_states[i].tempo, length < 0 ? mml_channel_states[i].defaultLength : length, (length < 0 && !dot) ? mml_channel_states[i].defaultLengthDot : dot);
-					add_channel_frame(i, frequency, duration, mml_channel_states[i].volume, mml_channel_states[i].articulation, mml_channel_states[i].waveform);
-				}
-			}
-		} else {
-			error_handler("Unknown command", line, pos);
+		case MML_TOKEN_NOTE:
+		case MML_TOKEN_NOTE_CODE:
+		case MML_TOKEN_PAUSE:
+			return mml_parse_note(parser, code, token == MML_TOKEN_PAUSE, token == MML_TOKEN_NOTE_CODE);
+
+		default:
+			mml_error(parser, "Unknown command");
+			return 1;
+	}
+	return 0;
+}
+
+/*! 
+ * Parse the whole MML file.
+ */
+static int mml_parse(struct mml_parser_t* parser) {
+	while (!parser->done) {
+		if (mml_parse_command(parser)) {
 			return 1;
 		}
 	}
+	return 0;
+}
 
-	free(mml_channel_states);
+void mml_compiler_init(struct mml_compiler_t* compiler, const char* content, void (*error_handler)(void* user, const char* err, int line, int column), void* user) {
+	compiler->content = content;
+	compiler->error_handler = error_handler;
+	compiler->user = user;
+	compiler->channel_count = 0;
 }
 
 /*! 
  * Parse the MML file and produce sequencer frames map.
  */
-int mml_compile(const char* content, struct seq_frame_map_t* map) {
-	int ret = mml_parse(content);
-	if (ret) {
-		return ret;
+int mml_compiler_compile(struct mml_compiler_t* compiler, struct seq_frame_map_t* map) {
+	struct mml_parser_t* parser = &compiler->parsers[0];
+	mml_parser_init(parser, compiler);
+	map->channels = malloc(0);
+	map->channel_count = 0;
+	parser->emit = add_map_frame;
+	parser->output = map;
+	return mml_parse(parser);
+}
+
+/*! Frame source handler, parses up to the next frame of the channel */
+static uint8_t read_channel_frame(void* user, struct seq_frame_t* frame) {
+	struct mml_parser_t* parser = user;
+	while (!parser->has_frame) {
+		if (parser->done) {
+			return 0;
+		}
+		if (mml_parse_command(parser)) {
+			// Already reported by `mml_compiler_open_channels`
+			parser->done = 1;
+			return 0;
+		}
 	}
-	*map = frame_map;
-	return 0;
+	*frame = parser->frame;
+	parser->has_frame = 0;
+	return 1;
+}
+
+int mml_compiler_open_channels(struct mml_compiler_t* compiler) {
+	// Validate the whole content first, and find the channels in use
+	int counts[MML_MAX_CHANNELS] = { 0 };
+	struct mml_parser_t* parser = &compiler->parsers[0];
+	mml_parser_init(parser, compiler);
+	parser->emit = count_frame;
+	parser->output = counts;
+	compiler->channel_count = 0;
+	if (mml_parse(parser)) {
+		return -1;
+	}
+
+	for (int i = 0; i < MML_MAX_CHANNELS; i++) {
+		if (counts[i] > 0) {
+			parser = &compiler->parsers[compiler->channel_count];
+			mml_parser_init(parser, compiler);
+			parser->emit = keep_frame;
+			parser->channel = i;
+			compiler->channels[compiler->channel_count].read = read_channel_frame;
+			compiler->channels[compiler->channel_count].user = parser;
+			compiler->channel_count++;
+		}
+	}
+	return compiler->channel_count;
+}
+
+/*!
+ * The next line boundary from `pos`.  A line ending with a command that
+ * expects a number would take it from the next line (`strtol` skips the
+ * blanks), so the chunks never start with a blank, a sign or a digit.
+ */
+static const char* mml_line_boundary(const char* pos, const char* end) {
+	while (pos < end) {
+		pos = memchr(pos, '\n', end - pos);
+		if (!pos) {
+			return end;
+		}
+		pos++;
+		if (pos < end && !(*pos <= ' ' || *pos == '+' || *pos == '-' || (*pos >= '0' && *pos <= '9'))) {
+			return pos;
+		}
+	}
+	return end;
+}
+
+/*!
+ * Change of the loop depth from `pos` to `end`, skipping the comments as
+ * the parser does: a `#` is a sharp in the suffix of a note (after `a` to
+ * `g`, among signs, dots and digits), and starts a comment anywhere else.
+ */
+static int mml_loop_depth(const char* pos, const char* end) {
+	int depth = 0;
+	int note = 0;
+	for (; pos < end; pos++) {
+		char code = *pos;
+		if (note && (code == '#' || code == '+' || code == '-' || code == '.' || (code >= '0' && code <= '9'))) {
+			continue;
+		}
+		note = (code >= 'a' && code <= 'g');
+		if (code == ';' || code == '#') {
+			pos = memchr(pos, '\n', end - pos);
+			if (!pos) {
+				break;
+			}
+		} else if (code == '[') {
+			depth++;
+		} else if (code == ']') {
+			depth--;
+		}
+	}
+	return depth;
+}
+
+int mml_split(const char* content, struct mml_chunk_t* chunks, int count) {
+	size_t size = strlen(content);
+	const char* end = content + size;
+	const char* start = content;
+	int n = 0;
+	int depth = 0;
+	for (int i = 1; i <= count && start < end; i++) {
+		const char* cut = (i < count) ? content + (size / count) * i : end;
+		if (cut < start) {
+			cut = start;
+		}
+		struct mml_chunk_t* chunk = &chunks[n++];
+		chunk->start = start;
+		chunk->end = (cut < end) ? mml_line_boundary(cut, end) : end;
+		depth += mml_loop_depth(start, chunk->end);
+		while (depth > 0 && chunk->end < end) {
+			// Not inside a loop
+			const char* next = mml_line_boundary(chunk->end, end);
+			depth += mml_loop_depth(chunk->end, next);
+			chunk->end = next;
+		}
+		if (depth < 0) {
+			// Unmatched, an error of the chunk
+			depth = 0;
+		}
+		start = chunk->end;
+	}
+	if (n) {
+		chunks[0].line = 1;
+		chunks[0].channel_count = 0;
+	}
+	return n;
+}
+
+/*! Prepare a parser for the lines of a chunk */
+static void mml_chunk_parser(struct mml_parser_t* parser, struct mml_chunk_t* chunk, int known) {
+	parser->compiler = NULL;
+	parser->content = chunk->start;
+	parser->end = chunk->end;
+	parser->line = chunk->line;
+	parser->pos = 0;
+	parser->done = 0;
+	parser->has_frame = 0;
+	parser->loop_count = 0;
+	parser->channel_count = 0;
+	if (known) {
+		memcpy(parser->channels, chunk->channels, sizeof(struct mml_channel_state_t) * chunk->channel_count);
+		parser->channel_count = chunk->channel_count;
+	}
+}
+
+void mml_chunk_scan(struct mml_chunk_t* chunk) {
+	struct mml_parser_t parser;
+	mml_chunk_parser(&parser, chunk, 0);
+	parser.line = 1;
+	parser.chunk = chunk;
+	parser.emit = NULL;
+	chunk->error = NULL;
+	reset_active_state(&parser);
+	// An error stops the chunk, and is reported by `mml_chunk_compile`
+	mml_parse(&parser);
+	chunk->loop_cut = parser.loop_count > 0 || chunk->error == mml_unmatched_loop;
+	memcpy(chunk->effect, parser.channels, sizeof(struct mml_channel_state_t) * parser.channel_count);
+	chunk->effect_count = parser.channel_count;
+	chunk->lines = parser.line - 1;
+}
+
+void mml_chunk_follow(const struct mml_chunk_t* chunk, struct mml_chunk_t* next) {
+	next->line = chunk->line + chunk->lines;
+	memcpy(next->channels, chunk->channels, sizeof(struct mml_channel_state_t) * chunk->channel_count);
+	next->channel_count = chunk->channel_count;
+	for (int i = 0; i < chunk->effect_count; i++) {
+		const struct mml_channel_state_t* effect = &chunk->effect[i];
+		struct mml_channel_state_t* state = &next->channels[i];
+		if (i >= next->channel_count) {
+			// Enabled by the chunk
+			init_channel(state);
+			next->channel_count = i + 1;
+		}
+		if (effect->octave > 9) {
+			// Relative, even when stepped down below the marker
+			state->octave += effect->octave - MML_OCTAVE_RELATIVE;
+			if (state->octave > 9) {
+				// Out of range: a chunk up to this one has an
+				// error, and the frames of the next are dropped
+				state->octave = 9;
+			}
+		} else {
+			state->octave = effect->octave;
+		}
+		if (effect->defaultLength != MML_STATE_UNKNOWN) {
+			state->defaultLength = effect->defaultLength;
+			state->defaultLengthDot = effect->defaultLengthDot;
+		}
+		if (effect->tempo != MML_STATE_UNKNOWN) {
+			state->tempo = effect->tempo;
+		}
+		if (effect->volume != MML_STATE_UNKNOWN) {
+			state->volume = effect->volume;
+		}
+		if (effect->articulation != MML_STATE_UNKNOWN) {
+			state->articulation = effect->articulation;
+		}
+		if (effect->waveform != MML_STATE_UNKNOWN) {
+			state->waveform = effect->waveform;
+		}
+	}
+}
+
+int mml_chunk_compile(struct mml_chunk_t* chunk) {
+	struct mml_parser_t parser;
+	mml_chunk_parser(&parser, chunk, 1);
+	init_periods(&parser);
+	parser.chunk = chunk;
+	parser.emit = add_map_frame;
+	parser.output = &chunk->map;
+	chunk->map.channels = NULL;
+	chunk->map.channel_count = 0;
+	chunk->error = NULL;
+	reset_active_state(&parser);
+	return mml_parse(&parser);
+}
+
+int mml_chunks_merge(struct mml_compiler_t* compiler, struct mml_chunk_t* chunks, int count, struct seq_frame_map_t* map) {
+	map->channels = NULL;
+	map->channel_count = 0;
+	int err = 0;
+	for (int i = 0; i < count; i++) {
+		if (chunks[i].error) {
+			// The chunks before are right, so this is the first error of the content
+			if (compiler->error_handler) {
+				compiler->error_handler(compiler->user, chunks[i].error, chunks[i].error_line, chunks[i].error_column);
+			}
+			map->channel_count = 0;
+			err = 1;
+			break;
+		}
+		if (chunks[i].map.channel_count > map->channel_count) {
+			map->channel_count = chunks[i].map.channel_count;
+		}
+	}
+
+	if (!err) {
+		map->channels = malloc(sizeof(struct seq_frame_list_t) * map->channel_count);
+		for (int c = 0; c < map->channel_count; c++) {
+			struct seq_frame_list_t* list = &map->channels[c];
+			list->count = 0;
+			for (int i = 0; i < count; i++) {
+				if (c < chunks[i].map.channel_count) {
+					list->count += chunks[i].map.channels[c].count;
+				}
+			}
+			list->frames = malloc(sizeof(struct seq_frame_t) * list->count);
+			struct seq_frame_t* pos = list->frames;
+			for (int i = 0; i < count; i++) {
+				if (c < chunks[i].map.channel_count) {
+					memcpy(pos, chunks[i].map.channels[c].frames, sizeof(struct seq_frame_t) * chunks[i].map.channels[c].count);
+					pos += chunks[i].map.channels[c].count;
+				}
+			}
+		}
+	}
+
+	for (int i = 0; i < count; i++) {
+		mml_free(&chunks[i].map);
+	}
+	return err;
+}
+
+void mml_set_error_handler(void (*handler)(const char* err, int line, int column)) {
+	error_handler = handler;
+}
+
+/*! Forward the errors of `mml_compile` to the handler without context */
+static void forward_error(void* user, const char* err, int line, int column) {
+	(void)user;
+	if (error_handler) {
+		error_handler(err, line, column);
+	}
+}
+
+int mml_compile(const char* content, struct seq_frame_map_t* map) {
+	// Only the first parser is used
+	struct mml_compiler_t* compiler = malloc(sizeof(struct mml_compiler_t));
+	mml_compiler_init(compiler, content, forward_error, NULL);
+	int err = mml_compiler_compile(compiler, map);
+	free(compiler);
+	return err;
 }
 
 void mml_free(struct seq_frame_map_t* map) {
@@ -24,16 +24,203 @@
 #include "synth.h"
 #include "sequencer.h"
 
-/*! Manage parser errors, used to display it in pc ports */
-void mml_set_error_handler(void (*handler)(const char* err, int line, int column));
+/*! Maximum number of channels, selected by `A` to `Z` */
+#define MML_MAX_CHANNELS	(26)
+
+struct mml_compiler_t;
+
+/*!
+ * Unknown value of a channel state field, while scanning a chunk of the
+ * content on its own (see `mml_chunk_scan`)
+ */
+#define MML_STATE_UNKNOWN	(-1)
+
+/*!
+ * Octave of a channel at the start of a chunk, when scanning it: the
+ * effect of the chunk is relative when above 9, the highest absolute octave.
+ * Far enough from 0..9 that only an erroring chunk can step across.
+ */
+#define MML_OCTAVE_RELATIVE	(128)
+
+/*! Notes of the `a`-`g` commands, up to `b` at octave 9 */
+#define MML_NOTE_COUNT	(120)
+
+/*! Maximum nesting of the `[` ... `]` loops */
+#define MML_MAX_LOOPS	(8)
+
+/*! An open loop: where its body starts, and the repetitions left */
+struct mml_loop_t {
+	const char* content;
+	int line;
+	int pos;
+	/*! Channels active at the start of the body, a bit each */
+	uint32_t active;
+	/*! Repetitions left, negative until the count is read at the end */
+	int left;
+};
+
+/*! Parser state, per channel */
+struct mml_channel_state_t {
+	uint8_t octave;
+	int defaultLength;
+	int defaultLengthDot;
+	int tempo;
+	int volume;
+	// Played part of the notes, in eighths
+	int articulation;
+	int waveform;
+	// Active in current MML parsing line
+	int isActive;
+};
 
 /*! 
- * Parse the MML file (entirely read and passed to `content`) and produce 
- * an offline set of frames by channel (frame map).
+ * Parser state.  Parses the whole content for `mml_compile`, or
+ * lazily the frames of a single channel when used as a frame source.
+ */
+struct mml_parser_t {
+	/*! Next character to parse */
+	const char* content;
+	/*! End of the content, or NULL up to the terminating zero */
+	const char* end;
+	/*! Current line and column, for error reporting */
+	int line;
+	int pos;
+	/*! Set at the end of the content */
+	uint8_t done;
+	/*! The owner compiler, for error reporting */
+	struct mml_compiler_t* compiler;
+	/*! The chunk parsed, that keeps the errors instead */
+	struct mml_chunk_t* chunk;
+	/*! Channel states */
+	struct mml_channel_state_t channels[MML_MAX_CHANNELS];
+	int channel_count;
+	/*! Open loops, innermost last */
+	struct mml_loop_t loops[MML_MAX_LOOPS];
+	int loop_count;
+	/*! Waveform period of every note at `synth_freq`, when producing frames */
+	uint16_t periods[MML_NOTE_COUNT];
+	/*! Handler of the parsed frames, NULL without compiler to scan a chunk */
+	void (*emit)(struct mml_parser_t* parser, int channel, const struct seq_frame_t* frame);
+	/*! Output of the `emit` handler */
+	void* output;
+	/*! Channel produced, when used as frame source */
+	int channel;
+	/*! Last frame of `channel`, when used as frame source */
+	struct seq_frame_t frame;
+	uint8_t has_frame;
+};
+
+/*! 
+ * MML compiler context.  Every compiler has its own error handler and
+ * parsers, so any number of songs can be compiled at the same time.
+ */
+struct mml_compiler_t {
+	/*! The MML content, entirely read in memory */
+	const char* content;
+	/*! Manage parser errors, `user` is passed back to the handler */
+	void (*error_handler)(void* user, const char* err, int line, int column);
+	void* user;
+	/*! Channel parsers and sources, prepared by `mml_compiler_open_channels` */
+	struct mml_parser_t parsers[MML_MAX_CHANNELS];
+	struct seq_frame_source_t channels[MML_MAX_CHANNELS];
+	int channel_count;
+};
+
+/*! 
+ * Prepare a compiler for the MML file (entirely read and passed to `content`).
+ * `content` must stay valid while the compiler is in use.
+ * `error_handler` can be NULL.
+ */
+void mml_compiler_init(struct mml_compiler_t* compiler, const char* content, void (*error_handler)(void* user, const char* err, int line, int column), void* user);
+
+/*! 
+ * Parse the MML content and produce an offline set of frames by 
+ * channel (frame map).
  * The returned set can be transformed in a sequential stream
  * by `seq_compile`.
  * Returns non-zero in case of parse error.
  */
+int mml_compiler_compile(struct mml_compiler_t* compiler, struct seq_frame_map_t* map);
+
+/*! 
+ * Validate the MML content and prepare a frame source for each channel
+ * that produces frames (`compiler->channels`, in channel order), to be
+ * compiled by `seq_compile_stream`.  The sources parse the content
+ * lazily, so the memory used doesn't depend on the song length.
+ * Returns the number of sources, or negative in case of parse error.
+ */
+int mml_compiler_open_channels(struct mml_compiler_t* compiler);
+
+/*!
+ * A range of whole lines of the MML content, parsed on its own.  The
+ * channel states carry over the lines, so the chunks are parsed twice:
+ * `mml_chunk_scan` finds how a chunk changes the states, without knowing
+ * them, then `mml_chunk_follow` gives the states at the start of the
+ * next chunk and `mml_chunk_compile` produces the frames.  Every step
+ * but `mml_chunk_follow` can run on any number of chunks at once.
+ */
+struct mml_chunk_t {
+	/*! Lines from `start`, up to `end` excluded */
+	const char* start;
+	const char* end;
+	/*! Line number of `start` */
+	int line;
+	/*! Channel states at `start` */
+	struct mml_channel_state_t channels[MML_MAX_CHANNELS];
+	int channel_count;
+	/*! Changes of the states, `MML_STATE_UNKNOWN` if unchanged */
+	struct mml_channel_state_t effect[MML_MAX_CHANNELS];
+	int effect_count;
+	/*! Lines in the chunk */
+	int lines;
+	/*! Frames of the chunk, by channel */
+	struct seq_frame_map_t map;
+	/*!
+	 * Set by `mml_chunk_scan` when the chunk cuts a loop: a loop still
+	 * open at its end, or the end of a loop opened before.  `mml_split`
+	 * keeps the loops whole, so only unmatched brackets do: the content
+	 * is then to be compiled whole, for the same errors.
+	 */
+	uint8_t loop_cut;
+	/*! First parse error of the chunk, or NULL */
+	const char* error;
+	int error_line;
+	int error_column;
+};
+
+/*!
+ * Split the content in up to `count` chunks of about the same size, at
+ * line boundaries out of the loops.  The first chunk starts at line 1
+ * with no channel.
+ * Returns the number of chunks.
+ */
+int mml_split(const char* content, struct mml_chunk_t* chunks, int count);
+
+/*! Find the changes of the channel states in a chunk */
+void mml_chunk_scan(struct mml_chunk_t* chunk);
+
+/*! Set the line and the channel states at the start of `next`, after `chunk` */
+void mml_chunk_follow(const struct mml_chunk_t* chunk, struct mml_chunk_t* next);
+
+/*! Parse a chunk from its channel states.  Returns non-zero on error */
+int mml_chunk_compile(struct mml_chunk_t* chunk);
+
+/*!
+ * Join the frames of compiled chunks in a frame map, the same as
+ * `mml_compiler_compile`, or report the first error of the chunks to
+ * the compiler.  The chunks are freed.  Returns non-zero on error.
+ */
+int mml_chunks_merge(struct mml_compiler_t* compiler, struct mml_chunk_t* chunks, int count, struct seq_frame_map_t* map);
+
+/*! Manage parser errors of `mml_compile`, used to display it in pc ports */
+void mml_set_error_handler(void (*handler)(const char* err, int line, int column));
+
+/*! 
+ * Parse the MML file (entirely read and passed to `content`) and produce 
+ * an offline set of frames by channel (frame map), reporting errors to
+ * the handler set by `mml_set_error_handler`.
+ * Returns non-zero in case of parse error.
+ */
 int mml_compile(const char* content, struct seq_frame_map_t* map);
 
 /*!
@@ -0,0 +1,96 @@
+/*!
+ * Polyphonic synthesizer for microcontrollers.  Parallel MML compiler.
+ * (C) 2026 The atinysynth contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#include "mmlsplit.h"
+#include "debug.h"
+#include <stdlib.h>
+
+static void mml_scan_job(void* chunk) {
+	mml_chunk_scan(chunk);
+}
+
+static void mml_compile_job(void* chunk) {
+	mml_chunk_compile(chunk);
+}
+
+/*! Run `job` on every chunk, on the workers, and wait for all of them */
+static void mml_split_run(struct sched_t* sched, void (*job)(void* chunk), struct mml_chunk_t* chunks, int count, struct sched_task_t* tasks) {
+	for (int i = 0; i < count; i++) {
+		sched_task_init_job(&tasks[i], job, &chunks[i]);
+		sched_submit(sched, &tasks[i]);
+	}
+	for (int i = 0; i < count; i++) {
+		sched_task_wait(&tasks[i]);
+		sched_task_destroy(&tasks[i]);
+	}
+}
+
+int mml_compiler_compile_split(struct mml_compiler_t* compiler, struct seq_frame_map_t* map, struct sched_t* sched, int chunk_count) {
+	struct sched_t own;
+	if (!sched) {
+		// Only for this content
+		if (sched_init(&own, chunk_count)) {
+			return mml_compiler_compile(compiler, map);
+		}
+		sched = &own;
+	}
+	if (chunk_count <= 0) {
+		chunk_count = sched->worker_count;
+	}
+	struct mml_chunk_t* chunks = malloc(sizeof(struct mml_chunk_t) * chunk_count);
+	struct sched_task_t* tasks = malloc(sizeof(struct sched_task_t) * chunk_count);
+	int count = mml_split(compiler->content, chunks, chunk_count);
+	_DPRINTF("MML split in %d chunks\n", count);
+
+	int err;
+	if (!count) {
+		// Nothing to parse
+		err = mml_compiler_compile(compiler, map);
+	} else {
+		mml_split_run(sched, mml_scan_job, chunks, count, tasks);
+		int loop_cut = 0;
+		for (int i = 0; i < count; i++) {
+			loop_cut |= chunks[i].loop_cut;
+		}
+		if (loop_cut) {
+			// Unmatched brackets: the error is reported by the serial parse
+			_DPRINTF("MML loop cut by the chunks\n");
+			err = mml_compiler_compile(compiler, map);
+			if (err) {
+				mml_free(map);
+				map->channels = NULL;
+				map->channel_count = 0;
+			}
+		} else {
+			for (int i = 1; i < count; i++) {
+				mml_chunk_follow(&chunks[i - 1], &chunks[i]);
+			}
+			mml_split_run(sched, mml_compile_job, chunks, count, tasks);
+			err = mml_chunks_merge(compiler, chunks, count, map);
+		}
+	}
+
+	free(tasks);
+	free(chunks);
+	if (sched == &own) {
+		sched_destroy(&own);
+	}
+	return err;
+}
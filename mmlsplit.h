@@ -0,0 +1,51 @@
+/*!
+ * Polyphonic synthesizer for microcontrollers.  Parallel MML compiler.
+ * (C) 2026 The atinysynth contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+#ifndef _MMLSPLIT_H
+#define _MMLSPLIT_H
+
+#include "mml.h"
+#include "scheduler.h"
+
+/*!
+ * Not meant for microcontrollers: requires POSIX threads.
+ *
+ * Large MML files are split in chunks of whole lines, see `mml_chunk_t`,
+ * parsed as jobs of the render scheduler: once to find how they change
+ * the channel states, then again from the states at their start.  The
+ * chunks never cut a loop, unless its brackets are unmatched: the content
+ * is then parsed whole, to report the error as `mml_compiler_compile`.
+ */
+
+#ifndef MML_SPLIT_MIN_SIZE
+/*! Smaller contents are not worth the threads */
+#define MML_SPLIT_MIN_SIZE	(256 * 1024)
+#endif
+
+/*!
+ * Same as `mml_compiler_compile`, with the content split in up to
+ * `chunk_count` chunks parsed at the same time by the workers of `sched`
+ * (a chunk per worker if zero).  Without a scheduler (NULL) one is
+ * started for the call, with a worker per chunk.  The frame map and the
+ * errors reported are the same, but on error the map is left empty:
+ * `mml_free` it in any case.
+ */
+int mml_compiler_compile_split(struct mml_compiler_t* compiler, struct seq_frame_map_t* map, struct sched_t* sched, int chunk_count);
+
+#endif
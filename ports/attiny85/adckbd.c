@@ -70,8 +70,35 @@ void adckbd_init() {
 	;
 }
 
+/*!
+ * Scan the keys at each Timer 0 compare match A.  The conversions then
+ * follow the timer, that can be slowed down, and no longer wake the CPU
+ * every 104µs as in free running mode.
+ */
+void adckbd_slow() {
+	/* Re-armed by the interrupt, start with the next match */
+	TIFR = (1 << OCF0A);
+	ADCSRB = (3 << ADTS0);
+}
+
+/*!
+ * Scan the keys free running again.
+ */
+void adckbd_fast() {
+	ADCSRB = 0;
+	/* The last conversion was timer-triggered, start the next one */
+	ADCSRA |= (1 << ADSC);
+}
+
 ISR(ADC_vect) {
 	uint8_t adc = ADCH;
+
+	/*
+	 * The flag of the compare match is the trigger, it is only set again
+	 * (and starts a conversion) once cleared.
+	 */
+	if (ADCSRB)
+		TIFR = (1 << OCF0A);
 	adckbd_last = adckbd_now;
 
 	if (adc > B0_THRESHOLD)
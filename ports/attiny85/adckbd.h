@@ -38,6 +38,12 @@
 /*! Initialisation routine */
 void adckbd_init();
 
+/*! Scan the keys at each Timer 0 compare match A, instead of free running */
+void adckbd_slow();
+
+/*! Scan the keys free running again */
+void adckbd_fast();
+
 /*!
  * Last known keyboard state
  */
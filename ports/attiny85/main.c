@@ -20,15 +20,202 @@
 
 #include "synth.h"
 #include "adckbd.h"
+#if defined(SEQ_SONG) && !defined(SEQ_SONG_COMPILED)
+#include "seqpack.h"
+#endif
+#ifdef SYNTH_FIFO
+#include "fifo.h"
+#endif
 
 #include <string.h>
 #include <avr/io.h>
 #include <util/delay.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#ifdef SYNTH_SLEEP
+#include <avr/sleep.h>
+#endif
 
+#if defined(SEQ_SONG_COMPILED)
+/* Only the voices of the song, compiled to code by gensong.py */
+struct voice_ch_t poly_voice[SEQ_SONG_VOICES];
+#elif defined(SEQ_SONG)
+/* The voices given to the player of a streamed song */
+struct voice_ch_t poly_voice[SEQ_MAX_VOICES];
+#else
 struct voice_ch_t poly_voice[16];
+#endif
 struct poly_synth_t synth;
 
+#ifndef SEQ_SONG
+/*! Envelope of all the voices */
+static const struct adsr_env_def_t voice_def ADSR_DEF_MEM = {
+	.time_scale = 100,
+	.delay_time = 0,
+	.attack_time = 10,
+	.decay_time = 10,
+	.sustain_time = 10,
+	.release_time = 10,
+	.peak_amp = 255,
+	.sustain_amp = 192
+};
+#endif
+
+#ifdef SYNTH_FIFO
+/*! Samples rendered by the main loop, output by the interrupt */
+static struct synth_fifo_t fifo;
+#endif
+
+#ifdef SEQ_SONG
+/*! Set while the song is playing */
+static volatile uint8_t song_playing = 0;
+
+#ifdef SEQ_SONG_COMPILED
+/*! (Re)start the song, compiled to code by gensong.py */
+static void start_song(void) {
+	cli();
+	seq_song_start(&synth);
+	song_playing = 1;
+	sei();
+}
+
+/*! Feed the voices, at every sample */
+#define feed_song()	seq_song_feed(&synth)
+
+/*! Non-zero once every frame has been fed */
+#define song_ended()	(1)
+#else
+/*! Song linked in flash by the SONG make rule, see genseq.py */
+extern const uint8_t seq_song[] PROGMEM;
+
+/*! Song decoder, reads the frames straight from flash */
+static struct seq_pack_decoder_t song_decoder;
+
+/*! Song player, fed at every sample */
+static struct seq_player_t song_player;
+
+/*! Read position of the decoder in flash */
+static const uint8_t* song_pos;
+
+/*! (Re)start the song from the beginning */
+static void start_song(void) {
+	struct seq_stream_header_t header;
+	const struct seq_frame_source_t source = {
+		.read = seq_pack_read_frame,
+		.user = &song_decoder
+	};
+
+	cli();
+	memset(poly_voice, 0, sizeof(poly_voice));
+	synth.enable = 0;
+	song_playing = 0;
+	song_pos = seq_song;
+	if (!seq_pack_decoder_init(&song_decoder, seq_pack_read_rom,
+				&song_pos, &header)) {
+		/* Loops read the flash again */
+		seq_pack_decoder_set_rewind(&song_decoder,
+				seq_pack_rewind_rom);
+		if (!seq_player_init(&song_player, &header,
+					SEQ_MAX_VOICES, &synth, &source)) {
+			/* Decode the frames ahead, from the main loop */
+			seq_player_prepare(&song_player);
+			song_playing = 1;
+		}
+	}
+	sei();
+}
+
+/*! Feed the voices, at every sample */
+#define feed_song()	seq_player_feed(&song_player)
+
+/*! Non-zero once every frame has been fed, not just late */
+#define song_ended()	(song_player.stage == SEQ_STAGE_END)
+
+/*! Decode and configure the next frame before it is due */
+#define stage_song()	do { \
+		if (song_playing) \
+			seq_player_prepare(&song_player); \
+	} while (0)
+#endif
+#endif
+
+#if !defined(SEQ_SONG) || defined(SEQ_SONG_COMPILED)
+/* Nothing to prepare ahead */
+#define stage_song()
+#endif
+
+/*! Compute the next sample */
+static inline int8_t next_sample(void) {
+#ifdef SEQ_SONG
+	if (song_playing) {
+		feed_song();
+		if (!synth.enable && song_ended())
+			song_playing = 0;
+	}
+#endif
+	return poly_synth_next(&synth);
+}
+
+/*! Render the samples the interrupt will need next */
+static inline void render(void) {
+#ifdef SYNTH_FIFO
+	while (synth_fifo_space(&fifo)) {
+		stage_song();
+		synth_fifo_push(&fifo, next_sample());
+	}
+#else
+	/* Keep the next frame ready for the interrupt */
+	stage_song();
+#endif
+}
+
+#ifdef SYNTH_SLEEP
+/*!
+ * With nothing to play, stop the sample rate interrupt and sleep until the
+ * next key scan of the ADC keyboard.  Timer 0 is slowed down 128 times and
+ * triggers the scan, so the CPU only wakes up about 62 times a second
+ * instead of at every free running conversion (9.6kHz).  The sample rate
+ * and the free running scan are back as soon as a voice is enabled.
+ */
+static void idle_sleep(void) {
+	if (synth.enable
+#ifdef SEQ_SONG
+			|| song_playing
+#endif
+			) {
+		if (!(TIMSK & (1 << OCIE0A))) {
+			cli();
+			TCCR0B = (1 << CS01);		/* 1/8 prescaling */
+			adckbd_fast();
+			TIMSK |= (1 << OCIE0A);
+			sei();
+		}
+		return;
+	}
+
+	if (TIMSK & (1 << OCIE0A)) {
+#ifdef SYNTH_FIFO
+		/* Let the interrupt output the end of the last notes */
+		while (synth_fifo_space(&fifo) != SYNTH_FIFO)
+			;
+#endif
+		cli();
+		TIMSK &= ~(1 << OCIE0A);
+		/* 1/1024 prescaling */
+		TCCR0B = (1 << CS02) | (1 << CS00);
+		adckbd_slow();
+		sei();
+	}
+
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	cli();
+	sleep_enable();
+	sei();
+	sleep_cpu();
+	sleep_disable();
+}
+#endif
+
 int main(void) {
 	/* Initialise configuration */
 	memset(poly_voice, 0, sizeof(poly_voice));
@@ -56,23 +243,29 @@ int main(void) {
 	OCR0A = (uint8_t)((uint32_t)F_CPU / (8*(uint32_t)SYNTH_FREQ));
 	TIMSK |= (1 << OCIE0A);		/* Enable interrupts */
 
+#ifdef SEQ_SONG
+	sei();
+	while(1) {
+		render();
+
+		/* Any key (re)starts the song */
+		if (adckbd_now & ADCKBD_CHANGED) {
+			if (adckbd_now & ADCKBD_ALL)
+				start_song();
+			adckbd_now &= ~(ADCKBD_CHANGED | ADCKBD_ALL);
+		}
+
+#ifdef SYNTH_SLEEP
+		idle_sleep();
+#endif
+	}
+#else
 	/* Configure the synthesizer */
 	voice_wf_set_triangle(&poly_voice[0].wf, 523, 63);
 	voice_wf_set_triangle(&poly_voice[1].wf, 659, 63);
 	voice_wf_set_triangle(&poly_voice[2].wf, 784, 63);
 	voice_wf_set_triangle(&poly_voice[3].wf, 880, 63);
 
-	struct adsr_env_def_t voice_def = {
-		.time_scale = 100,
-		.delay_time = 0,
-		.attack_time = 10,
-		.decay_time = 10,
-		.sustain_time = 10,
-		.release_time = 10,
-		.peak_amp = 255,
-		.sustain_amp = 192
-	};
-
 	adsr_config(&poly_voice[0].adsr, &voice_def);
 	adsr_config(&poly_voice[1].adsr, &voice_def);
 	adsr_config(&poly_voice[2].adsr, &voice_def);
@@ -81,6 +274,8 @@ int main(void) {
 
 	sei();
 	while(1) {
+		render();
+
 		PORTB ^= (1 << 0);
 		if (adckbd_now & ADCKBD_CHANGED) {
 			uint8_t btn = 0;
@@ -108,11 +303,23 @@ int main(void) {
 			adckbd_now &= ~ADCKBD_CHANGED;
 			PORTB ^= (1 << 1);
 		}
+
+#ifdef SYNTH_SLEEP
+		idle_sleep();
+#endif
 	}
+#endif
 	return 0;
 }
 
 ISR(TIM0_COMPA_vect) {
-	int8_t s = poly_synth_next(&synth);
+#ifdef SYNTH_FIFO
+	/* Output the next rendered sample, or hold the last one */
+	int8_t s;
+	if (synth_fifo_pop(&fifo, &s))
+		OCR1B = s + 128;
+#else
+	int8_t s = next_sample();
 	OCR1B = s + 128;
+#endif
 }
@@ -23,4 +23,35 @@
 
 #define SYNTH_FREQ		8000
 
+#if !defined(SEQ_SONG) || defined(SEQ_SONG_COMPILED)
+/*
+ * Render the samples in the main loop, the interrupt only outputs them:
+ * define to enable, at the cost of the FIFO in RAM.
+ */
+/* #define SYNTH_FIFO		(16) */
+
+/* The voices reference the envelope definitions in flash */
+#define ADSR_SHARED_DEF
+#define ADSR_DEF_PROGMEM
+#else
+/*
+ * A streamed song keeps the envelopes, the decoder and the player state in
+ * RAM: 4 voices and no FIFO, as on the ATTiny861.
+ */
+#define SEQ_MAX_VOICES		(4)
+#endif
+
+/*
+ * Stop the sample rate interrupt and sleep while nothing plays, the ADC
+ * keyboard wakes the CPU up: define to enable.
+ */
+/* #define SYNTH_SLEEP */
+
+/* Sequencer state of the embedded song (SONG=...), in RAM */
+#define SEQ_PACK_MAX_INSTRUMENTS	(8)
+/* One level of loops: deeper streams stop at their first nested loop */
+#define SEQ_PACK_MAX_LOOPS		(1)
+/* The song is compiled for SYNTH_FREQ, no 64-bit retiming */
+#define SEQ_RETIME		(0)
+
 #endif
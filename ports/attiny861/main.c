@@ -19,12 +19,21 @@
  */
 
 #include "synth.h"
+#if defined(SEQ_SONG) && !defined(SEQ_SONG_COMPILED)
+#include "seqpack.h"
+#endif
+#ifdef SYNTH_FIFO
+#include "fifo.h"
+#endif
 
 #include <string.h>
 #include <avr/io.h>
 #include <util/delay.h>
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
+#ifdef SYNTH_SLEEP
+#include <avr/sleep.h>
+#endif
 
 /* Pin allocations: port B */
 #define SDA		(1 << 0) /*! I²C Serial Data		[I/O] */
@@ -38,8 +47,8 @@
 /*! Button debounce delay in sample rate ticks. */
 #define DEBOUNCE_DELAY	(10)
 
-/*! Number of voices */
-#define VOICES		(8)
+/*! Number of voices: one per button, or the voices of the song */
+#define VOICES		(SEQ_MAX_VOICES)
 
 /*! Voice states */
 struct voice_ch_t poly_voice[VOICES];
@@ -59,13 +68,29 @@ static volatile uint16_t amp_powerdown = 0;
  */
 #define AMP_POWERDOWN_DELAY	(60000)
 
+#ifdef SYNTH_SLEEP
+/*!
+ * Timer 0 prescaling while idle: the interrupt only scans the buttons,
+ * IDLE_SLOWDOWN times slower than the sample rate.
+ */
+#define IDLE_PRESCALE	(3 << CS00)	/* 1/64 */
+#define IDLE_SLOWDOWN	(8)
+
+/*! Set while the sample rate interrupt is slowed down */
+static uint8_t idle = 0;
+#endif
+
 /*! Number of I/O channels */
 #define CHANNELS	(8)
 
+#if !defined(SEQ_SONG) && (VOICES < CHANNELS)
+#error "Every button needs a voice"
+#endif
+
 /*!
  * Voice definitions for all the channels.
  */
-const struct adsr_env_def_t voice_def = {
+const struct adsr_env_def_t voice_def ADSR_DEF_MEM = {
 	.time_scale = 100,
 	.delay_time = 0,
 	.attack_time = 10,
@@ -105,6 +130,111 @@ static volatile uint8_t
 static uint8_t light_output[CHANNELS] = {0, 0, 0, 0, 0, 0, 0, 0};
 
 
+#ifdef SEQ_SONG
+/*! Set while the song is playing */
+static volatile uint8_t song_playing = 0;
+
+#ifdef SEQ_SONG_COMPILED
+#if SEQ_SONG_VOICES > VOICES
+#error "The song uses too many voices"
+#endif
+
+/*!
+ * Start playing the song, compiled to code by gensong.py.
+ */
+static void start_song(void) {
+	cli();
+	memset(poly_voice, 0, sizeof(poly_voice));
+	seq_song_start(&synth);
+	song_playing = 1;
+	sei();
+}
+
+/*! Feed the voices, at every sample */
+#define feed_song()	seq_song_feed(&synth)
+
+/*! Non-zero once every frame has been fed */
+#define song_ended()	(1)
+#else
+/*! Song linked in flash by the SONG make rule, see genseq.py */
+extern const uint8_t seq_song[] PROGMEM;
+
+/*! Song decoder, reads the frames straight from flash */
+static struct seq_pack_decoder_t song_decoder;
+
+/*! Song player, fed at every sample */
+static struct seq_player_t song_player;
+
+/*! Read position of the decoder in flash */
+static const uint8_t* song_pos;
+
+/*!
+ * Start playing the song from the beginning.
+ */
+static void start_song(void) {
+	struct seq_stream_header_t header;
+	const struct seq_frame_source_t source = {
+		.read = seq_pack_read_frame,
+		.user = &song_decoder
+	};
+
+	cli();
+	memset(poly_voice, 0, sizeof(poly_voice));
+	song_pos = seq_song;
+	if (!seq_pack_decoder_init(&song_decoder, seq_pack_read_rom,
+				&song_pos, &header)) {
+		/* Loops read the flash again */
+		seq_pack_decoder_set_rewind(&song_decoder,
+				seq_pack_rewind_rom);
+		if (!seq_player_init(&song_player, &header,
+					VOICES, &synth, &source)) {
+			/* Decode the frames ahead, from the main loop */
+			seq_player_prepare(&song_player);
+			song_playing = 1;
+		}
+	}
+	sei();
+}
+
+/*! Feed the voices, at every sample */
+#define feed_song()	seq_player_feed(&song_player)
+
+/*! Non-zero once every frame has been fed, not just late */
+#define song_ended()	(song_player.stage == SEQ_STAGE_END)
+
+/*! Decode and configure the next frame before it is due */
+#define stage_song()	do { \
+		if (song_playing) \
+			seq_player_prepare(&song_player); \
+	} while (0)
+#endif
+#endif
+
+#if !defined(SEQ_SONG) || defined(SEQ_SONG_COMPILED)
+/* Nothing to prepare ahead */
+#define stage_song()
+#endif
+
+/*!
+ * Compute the next sample, feeding the song if playing.
+ */
+static inline int8_t next_sample(void) {
+#ifdef SEQ_SONG
+	if (song_playing) {
+		/* Load the frames of the voices that became free */
+		feed_song();
+		if (!synth.enable && song_ended())
+			song_playing = 0;
+	}
+#endif
+	return poly_synth_next(&synth);
+}
+
+#ifdef SYNTH_FIFO
+/*! Samples rendered by the main loop, output by the interrupt */
+static struct synth_fifo_t fifo;
+#endif
+
 /*!
  * Trigger playback of a tone for a button.
  *
@@ -123,6 +253,40 @@ static void trigger_button(uint8_t b) {
 }
 
 
+#ifdef SYNTH_SLEEP
+/*!
+ * With nothing to play, slow the sample rate interrupt down to a button
+ * scan and sleep between its ticks.  The full rate is back as soon as a
+ * button is pressed or a voice is enabled.
+ */
+static void idle_sleep(void) {
+	if (synth.enable || button_state
+#ifdef SEQ_SONG
+			|| song_playing
+#endif
+			) {
+		if (idle) {
+			TCCR0B = (2 << CS00);	/* 1/8 prescaling */
+			idle = 0;
+		}
+		return;
+	}
+
+	if (!idle) {
+		TCCR0B = IDLE_PRESCALE;
+		idle = 1;
+	}
+
+	/* Woken up by the next tick */
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	cli();
+	sleep_enable();
+	sei();
+	sleep_cpu();
+	sleep_disable();
+}
+#endif
+
 int main(void) {
 	/* Initialise configuration */
 	memset(poly_voice, 0, sizeof(poly_voice));
@@ -186,16 +350,43 @@ int main(void) {
 
 	/* Enter main loop */
 	while(1) {
+#ifdef SYNTH_FIFO
+		/* Render the samples the interrupt will need next */
+		while (synth_fifo_space(&fifo)) {
+			stage_song();
+			synth_fifo_push(&fifo, next_sample());
+		}
+#else
+		/* Keep the next frame ready for the interrupt */
+		stage_song();
+#endif
+
 		/* Count down millisecond timer */
 		if (!ms_timer) {
 			/* One millisecond has passed */
+#ifdef SYNTH_SLEEP
+			ms_timer = idle ? (SYNTH_FREQ/(10*IDLE_SLOWDOWN))
+				: (SYNTH_FREQ/10);
+#else
 			ms_timer = SYNTH_FREQ/10;
+#endif
 
 			/* Tick down the amplifier power-down timer */
 			if ((!synth.enable) && amp_powerdown)
 				amp_powerdown--;
 		}
 
+#ifdef SEQ_SONG
+		/* Any button starts the song */
+		if (button_state && !song_playing)
+			start_song();
+
+		/* The lights follow the voices */
+		uint8_t b = 0;
+		for (b = 0; b < CHANNELS; b++)
+			light_output[b] = (b < VOICES)
+				? poly_voice[b].adsr.amplitude : 0;
+#else
 		/* Check the button states */
 		uint8_t b = 0;
 		uint8_t bm = 1;
@@ -222,6 +413,7 @@ int main(void) {
 				light_output[b] = voice->adsr.amplitude;
 			}
 		}
+#endif
 
 		/* If there are channels enabled, turn on the amplifier */
 		if (synth.enable) {
@@ -232,6 +424,11 @@ int main(void) {
 		} else if (!amp_powerdown) {
 			PORTB &= ~AUDIO_EN;
 		}
+
+#ifdef SYNTH_SLEEP
+		/* Don't spin while there is nothing to play */
+		idle_sleep();
+#endif
 	}
 	return 0;
 }
@@ -297,7 +494,14 @@ ISR(TIMER0_COMPA_vect) {
 	if (ms_timer)
 		ms_timer--;
 
+#ifdef SYNTH_FIFO
+	/* Output the next rendered sample, or hold the last one */
+	int8_t s;
+	if (synth_fifo_pop(&fifo, &s))
+		OCR1B = s + 128;
+#else
 	/* Compute and output the next sample */
-	int8_t s = poly_synth_next(&synth);
+	int8_t s = next_sample();
 	OCR1B = s + 128;
+#endif
 }
@@ -23,4 +23,39 @@
 
 #define SYNTH_FREQ		(8000)
 
+#if !defined(SEQ_SONG) || defined(SEQ_SONG_COMPILED)
+/*
+ * The voices reference the envelope definitions in flash, instead of
+ * keeping a copy.  Streamed songs decode them in RAM.
+ */
+#define ADSR_SHARED_DEF
+#define ADSR_DEF_PROGMEM
+
+/* Samples are rendered by the main loop, the interrupt only outputs them */
+#define SYNTH_FIFO		(32)
+
+/* One voice per button, or the voices of the compiled song */
+#define SEQ_MAX_VOICES		(8)
+#else
+/*
+ * A streamed song keeps the envelopes, the decoder and the player state in
+ * RAM: 4 voices and no FIFO, so the state leaves about 120 of the 512
+ * bytes to the stack.
+ */
+#define SEQ_MAX_VOICES		(4)
+#endif
+
+/*
+ * Slow the sample rate interrupt down to a button scan and sleep while
+ * nothing plays: define to enable.
+ */
+/* #define SYNTH_SLEEP */
+
+/* Sequencer state of the embedded song (SONG=...), in RAM */
+#define SEQ_PACK_MAX_INSTRUMENTS	(8)
+/* One level of loops: deeper streams stop at their first nested loop */
+#define SEQ_PACK_MAX_LOOPS		(1)
+/* The song is compiled for SYNTH_FREQ, no 64-bit retiming */
+#define SEQ_RETIME		(0)
+
 #endif
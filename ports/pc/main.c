@@ -22,11 +22,20 @@
 #include "debug.h"
 #include "sequencer.h"
 #include "mml.h"
+#include "seqpack.h"
+#include "scheduler.h"
+#include "mmlsplit.h"
+#include "seqcache.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <dirent.h>
+#include <time.h>
 #include <ao/ao.h>
 
+#ifndef SYNTH_FREQ
 const uint16_t synth_freq = 32000;
+#endif
 static struct voice_ch_t poly_voice[16];
 static struct poly_synth_t synth;
 static int16_t samples[8192];
@@ -34,6 +43,28 @@ static uint16_t samples_sz = 0;
 static void (*feed_channels)(struct poly_synth_t* synth) = NULL;
 static FILE* seq_stream;
 static struct seq_stream_header_t seq_stream_header;
+static struct seq_pack_decoder_t seq_decoder;
+static uint16_t seq_tempo = SEQ_TEMPO_NORMAL;
+static uint16_t seq_chunk_frames = 0;
+static uint8_t seq_loop_depth = 0;
+static int seq_repeat = 0;
+static uint32_t seq_seek_ms = 0;
+static int seq_packed;
+static int batch_jobs = 0;
+static const char* seq_cache_dir = NULL;
+static struct seq_cache_entry_t seq_cache_entry;
+/* Workers parsing the large MML files, started for each file if NULL */
+static struct sched_t* mml_sched = NULL;
+
+/*! Frames per chunk of the compact streams too long for a 16-bit count */
+#define SEQ_CHUNK_FRAMES	(4096)
+
+/*! Header of the raw streams, the native layout of the original 16-bit struct */
+struct seq_raw_header_t {
+	uint16_t synth_frequency;
+	uint8_t voices;
+	uint16_t frames;
+};
 
 /*! Read a script instead of command-line tokens */
 static int read_script(const char* name, int* argc, char*** argv) {
@@ -60,55 +91,364 @@ static int read_script(const char* name, int* argc, char*** argv) {
 }
 
 /* Read and play a MML file */
-static void mml_error(const char* err, int line, int column) {
-	fprintf(stderr, "Error reading MML file: %s at line %d, pos %d\n", err, line, column);
+static void mml_error(void* user, const char* err, int line, int column) {
+	fprintf(stderr, "Error reading MML file %s: %s at line %d, pos %d\n", (const char*)user, err, line, column);
+}
+
+static int seq_write_frame(void* user, const struct seq_frame_t* frame) {
+	return fwrite(frame, 1, sizeof(struct seq_frame_t), user) != sizeof(struct seq_frame_t);
+}
+
+static int seq_write_bytes(void* user, const uint8_t* data, uint8_t len) {
+	return fwrite(data, 1, len, user) != len;
+}
+
+static uint8_t seq_read_byte(void* user) {
+	return fgetc(user);
+}
+
+static int seq_rewind_bytes(void* user, uint32_t bytes) {
+	return fseek(user, -(long)bytes, SEEK_CUR);
+}
+
+/* Compact stream decoder of a file, with its loops */
+static int seq_decoder_open(struct seq_pack_decoder_t* decoder, FILE* fp, struct seq_stream_header_t* header) {
+	if (seq_pack_decoder_init(decoder, seq_read_byte, fp, header)) {
+		return 1;
+	}
+	seq_pack_decoder_set_rewind(decoder, seq_rewind_bytes);
+	return 0;
+}
+
+/* The whole stream in memory, to find its loops */
+struct seq_frame_buffer_t {
+	struct seq_frame_t* frames;
+	uint32_t count;
+	uint32_t size;
+};
+
+static int seq_collect_frame(void* user, const struct seq_frame_t* frame) {
+	struct seq_frame_buffer_t* buffer = user;
+	if (buffer->count == buffer->size) {
+		buffer->size += 4096;
+		buffer->frames = realloc(buffer->frames, buffer->size * sizeof(struct seq_frame_t));
+		if (!buffer->frames) {
+			return 1;
+		}
+	}
+	buffer->frames[buffer->count++] = *frame;
+	return 0;
+}
+
+/* First pass: collect the instruments, and count the frames even if they overflow */
+struct seq_first_pass_t {
+	struct seq_instrument_table_t instruments;
+	int overflow;
+};
+
+static int seq_collect_instrument(void* user, const struct seq_frame_t* frame) {
+	struct seq_first_pass_t* pass = user;
+	if (!pass->overflow && seq_pack_add_instrument(&pass->instruments, frame)) {
+		pass->overflow = 1;
+	}
+	return 0;
+}
+
+/* The chunk index, written at the end of the stream */
+struct seq_chunk_index_t {
+	struct seq_pack_chunk_t* chunks;
+	uint32_t count;
+	uint32_t size;
+};
+
+static int seq_add_chunk(void* user, const struct seq_pack_chunk_t* chunk) {
+	struct seq_chunk_index_t* index = user;
+	if (index->count == index->size) {
+		index->size += 64;
+		index->chunks = realloc(index->chunks, index->size * sizeof(struct seq_pack_chunk_t));
+		if (!index->chunks) {
+			return 1;
+		}
+	}
+	index->chunks[index->count++] = *chunk;
+	return 0;
 }
 
-static int open_mml(const char* name) {
+/* Read a whole MML file, NULL on error */
+static char* read_mml(const char* name, long* size) {
 	FILE *fp = fopen(name, "r");
 	if (!fp) {
-		fprintf(stderr, "Error reading MML file: %s", name);
-		return 1;
+		fprintf(stderr, "Error reading MML file: %s\n", name);
+		return NULL;
 	}
-	fseek(fp, 0, SEEK_END);
-	long size = ftell(fp);
-   	char* content = malloc(size + 1);
-	fseek(fp, 0, SEEK_SET);
-	fread(content, 1, size, fp);
-	content[size] = 0;
+	// A batch goes on with the next file, whatever happens to this one
+	char* content = NULL;
+	if (fseek(fp, 0, SEEK_END) || (*size = ftell(fp)) < 0
+			|| fseek(fp, 0, SEEK_SET)
+			|| !(content = malloc(*size + 1))
+			|| fread(content, 1, *size, fp) != (size_t)*size) {
+		fprintf(stderr, "Error reading MML file: %s\n", name);
+		free(content);
+		fclose(fp);
+		return NULL;
+	}
+	content[*size] = 0;
+	fclose(fp);
+	return content;
+}
 
-	mml_set_error_handler(mml_error);
-	int err;
+/* Cache key of a MML content compiled with the current options */
+static uint64_t mml_cache_key(const char* content, long size, int raw) {
+	// The chunks and loops change the compact format only
+	return seq_cache_key(content, size, raw ? 1 : (((uint32_t)seq_chunk_frames << 1)
+			| ((uint32_t)seq_loop_depth << 17) | ((uint32_t)seq_repeat << 25)));
+}
+
+/* Copy a cached stream to `out_name`, reading its header back */
+static int copy_cached(const struct seq_cache_entry_t* entry, const char* out_name, int raw, struct seq_stream_header_t* stream_header) {
+	int err = 1;
+	if (raw && entry->size >= sizeof(struct seq_raw_header_t)) {
+		struct seq_raw_header_t header;
+		memcpy(&header, entry->data, sizeof(struct seq_raw_header_t));
+		stream_header->synth_frequency = header.synth_frequency;
+		stream_header->voices = header.voices;
+		stream_header->frames = header.frames;
+		err = 0;
+	} else if (!raw) {
+		FILE* in = fmemopen((void*)entry->data, entry->size, "rb");
+		struct seq_pack_decoder_t* decoder = malloc(sizeof(struct seq_pack_decoder_t));
+		err = !in || seq_pack_decoder_init(decoder, seq_read_byte, in, stream_header);
+		free(decoder);
+		if (in) {
+			fclose(in);
+		}
+	}
 
-	struct seq_frame_map_t map;
-	err = mml_compile(content, &map);
+	FILE* out = err ? NULL : fopen(out_name, "wb");
+	err = !out || fwrite(entry->data, 1, entry->size, out) != entry->size;
+	if (out && fclose(out)) {
+		err = 1;
+	}
 	if (err) {
-		return err;
+		fprintf(stderr, "Cannot write the %s file\n", out_name);
+	} else {
+		_DPRINTF("File %s written from the cache\n", out_name);
+	}
+	return err;
+}
+
+/* Compile a MML file to `out_name`, in compact or raw format */
+static int compile_mml(const char* name, const char* out_name, int raw, struct seq_stream_header_t* stream_header) {
+	long size;
+	char* content = read_mml(name, &size);
+	if (!content) {
+		return 1;
 	}
-	free(content);
 
-	// Sort frames in stream
-	struct seq_frame_t* frame_stream;
+	// Unchanged files are compiled only once
+	uint64_t key = 0;
+	if (seq_cache_dir) {
+		struct seq_cache_entry_t entry;
+		key = mml_cache_key(content, size, raw);
+		if (!seq_cache_open(seq_cache_dir, key, &entry)) {
+			free(content);
+			int err = copy_cached(&entry, out_name, raw, stream_header);
+			seq_cache_close(&entry);
+			return err;
+		}
+	}
+
+	// Every channel is parsed lazily while compiling, but large files are
+	// parsed upfront on all cores, and a repeated song is checked whole
+	int whole = !raw && (seq_loop_depth || seq_repeat);
+	// The loop search keeps all the sorted frames in memory, the only step
+	// that doesn't stream: it is done only when asked with `loops`
+	int loops = !raw && seq_loop_depth;
+	struct mml_compiler_t* compiler = malloc(sizeof(struct mml_compiler_t));
+	mml_compiler_init(compiler, content, mml_error, (void*)name);
+	struct seq_frame_map_t map = { 0, NULL };
+	struct seq_frame_list_t lists[MML_MAX_CHANNELS];
+	struct seq_frame_source_t sources[MML_MAX_CHANNELS];
+	struct seq_frame_source_t* channels = compiler->channels;
+	int channel_count;
+	if (size >= MML_SPLIT_MIN_SIZE) {
+		channel_count = mml_compiler_compile_split(compiler, &map, mml_sched, 0) ? -1 : map.channel_count;
+		seq_frame_map_open(&map, lists, sources);
+		channels = sources;
+	} else if (whole) {
+		channel_count = mml_compiler_compile(compiler, &map) ? -1 : map.channel_count;
+		seq_frame_map_open(&map, lists, sources);
+		channels = sources;
+	} else {
+		channel_count = mml_compiler_open_channels(compiler);
+	}
+	if (channel_count >= 0 && !raw && seq_repeat && !seq_frame_map_repeats(&map)) {
+		fprintf(stderr, "The song %s cannot repeat without a gap\n", name);
+		channel_count = -1;
+	}
+	if (channel_count < 0) {
+		mml_free(&map);
+		free(compiler);
+		free(content);
+		return 1;
+	}
+
+	// Save the compiled output
+	FILE *out = fopen(out_name, "wb");
+	if (!out) {
+		fprintf(stderr, "Cannot write the %s file\n", out_name);
+		mml_free(&map);
+		free(compiler);
+		free(content);
+		return 1;
+	}
+
+	// Sort frames in stream, writing them as soon as they are sorted
 	int frame_count;
 	int voice_count;
-	seq_compile(&map, &frame_stream, &frame_count, &voice_count);
+	int err = 0;
+	struct seq_frame_sink_t sink;
+	struct seq_pack_encoder_t encoder;
+	struct seq_first_pass_t pass;
+	struct seq_chunk_index_t index = { NULL, 0, 0 };
+	struct seq_pack_chunking_t chunking = { 0, 0, 0 };
+	struct seq_frame_buffer_t buffer = { NULL, 0, 0 };
+	uint8_t version = SEQ_PACK_VERSION_INSTRUMENTS;
+	if (raw) {
+		sink.write = seq_write_frame;
+		sink.user = out;
+		fseek(out, sizeof(struct seq_raw_header_t), SEEK_SET);
+	} else {
+		// A first pass collects the instruments, to be written upfront
+		pass.instruments.count = 0;
+		pass.overflow = 0;
+		sink.write = seq_collect_instrument;
+		sink.user = &pass;
+		seq_compile_stream(channels, channel_count, &sink, &frame_count, &voice_count);
+		if (pass.overflow) {
+			// Too many instruments, only field masks
+			version = SEQ_PACK_VERSION;
+		}
+		if (channels == sources) {
+			seq_frame_map_open(&map, lists, sources);
+		} else {
+			mml_compiler_open_channels(compiler);
+		}
+
+		// Long streams need the 32-bit count, in chunks, as the loops
+		chunking.chunk_frames = seq_chunk_frames;
+		if (!chunking.chunk_frames && (frame_count > UINT16_MAX || whole)) {
+			chunking.chunk_frames = SEQ_CHUNK_FRAMES;
+		}
+		const struct seq_instrument_table_t* instruments = (version == SEQ_PACK_VERSION_INSTRUMENTS) ? &pass.instruments : NULL;
+		if (chunking.chunk_frames) {
+			fseek(out, SEQ_PACK_HEADER_CHUNKED_SIZE, SEEK_SET);
+			err = seq_pack_encoder_init_chunked(&encoder, seq_write_bytes, out, instruments, chunking.chunk_frames, seq_add_chunk, &index);
+		} else {
+			fseek(out, SEQ_PACK_HEADER_SIZE, SEEK_SET);
+			err = seq_pack_encoder_init(&encoder, seq_write_bytes, out, instruments);
+		}
+		sink.write = seq_pack_write_frame;
+		sink.user = &encoder;
+		if (loops) {
+			// Encoded once all sorted
+			sink.write = seq_collect_frame;
+			sink.user = &buffer;
+		}
+	}
+	err = err || seq_compile_stream(channels, channel_count, &sink, &frame_count, &voice_count);
+	if (loops) {
+		err = err || seq_pack_write_frames(&encoder, buffer.frames, buffer.count, seq_loop_depth);
+		free(buffer.frames);
+	}
+	if (!raw && chunking.chunk_frames) {
+		err = err || seq_pack_encoder_finish(&encoder);
+		chunking.chunks = index.count;
+		chunking.index_offset = encoder.offset;
+		for (uint32_t i = 0; !err && i < index.count; i++) {
+			uint8_t entry[SEQ_PACK_CHUNK_SIZE];
+			seq_pack_chunk_encode(entry, &index.chunks[i]);
+			err = fwrite(entry, 1, SEQ_PACK_CHUNK_SIZE, out) != SEQ_PACK_CHUNK_SIZE;
+		}
+	}
+	free(index.chunks);
 	mml_free(&map);
+	free(compiler);
+	free(content);
+	if (!err && raw && frame_count > UINT16_MAX) {
+		fprintf(stderr, "Too many frames for the raw format\n");
+		err = 1;
+	}
+	if (err) {
+		fprintf(stderr, "Cannot write the %s file\n", out_name);
+		fclose(out);
+		return err;
+	}
 
-	// Save the compiled output to out.seq
-	FILE *out = fopen("sequencer.bin", "wb");
-	if (!out) {
-		fprintf(stderr, "Cannot write the sequencer.bin file\n");
-		return 1;
+	// Now the header can be written
+	stream_header->synth_frequency = synth_freq;
+	stream_header->frames = frame_count;
+	stream_header->voices = voice_count;
+	fseek(out, 0, SEEK_SET);
+	if (raw) {
+		struct seq_raw_header_t header;
+		memset(&header, 0, sizeof(header));
+		header.synth_frequency = synth_freq;
+		header.voices = voice_count;
+		header.frames = frame_count;
+		fwrite(&header, 1, sizeof(struct seq_raw_header_t), out);
+	} else if (chunking.chunk_frames) {
+		uint8_t header[SEQ_PACK_HEADER_CHUNKED_SIZE];
+		uint8_t flags = (version == SEQ_PACK_VERSION_INSTRUMENTS) ? SEQ_PACK_FLAG_INSTRUMENTS : 0;
+		if (encoder.loops) {
+			flags |= SEQ_PACK_FLAG_LOOPS;
+		}
+		if (seq_repeat) {
+			flags |= SEQ_PACK_FLAG_REPEAT;
+		}
+		seq_pack_header_chunked(header, stream_header, flags, &chunking);
+		fwrite(header, 1, SEQ_PACK_HEADER_CHUNKED_SIZE, out);
+	} else {
+		uint8_t header[SEQ_PACK_HEADER_SIZE];
+		seq_pack_header(header, stream_header, version);
+		fwrite(header, 1, SEQ_PACK_HEADER_SIZE, out);
 	}
-	seq_stream_header.synth_frequency = synth_freq;
-	seq_stream_header.frames = frame_count;
-	seq_stream_header.voices = voice_count;
-	fwrite(&seq_stream_header, 1, sizeof(struct seq_stream_header_t), out);
-	fwrite(frame_stream, frame_count, sizeof(struct seq_frame_t), out);
-	_DPRINTF("File sequencer.bin written\n");
+	_DPRINTF("File %s written\n", out_name);
 	fclose(out);
 
-	seq_free(frame_stream);
+	// A cache that cannot be written only costs the next compilations
+	if (seq_cache_dir && seq_cache_store(seq_cache_dir, key, out_name)) {
+		fprintf(stderr, "Cannot store %s in the cache %s\n", name, seq_cache_dir);
+	}
+	return 0;
+}
+
+/* Check the chunks of a version 3 stream against the index, before playing */
+static int check_chunks(FILE* fp) {
+	long start = ftell(fp);
+	int err = 0;
+	for (uint32_t i = 0; !err && i < seq_decoder.chunking.chunks; i++) {
+		uint8_t entry[SEQ_PACK_CHUNK_SIZE];
+		struct seq_pack_chunk_t chunk;
+		fseek(fp, seq_decoder.chunking.index_offset + i * SEQ_PACK_CHUNK_SIZE, SEEK_SET);
+		if (fread(entry, 1, SEQ_PACK_CHUNK_SIZE, fp) != SEQ_PACK_CHUNK_SIZE) {
+			err = 1;
+			break;
+		}
+		seq_pack_chunk_decode(&chunk, entry);
+		fseek(fp, chunk.offset, SEEK_SET);
+		uint32_t hash = SEQ_PACK_HASH_INIT;
+		uint8_t data[256];
+		uint32_t left = chunk.size;
+		while (!err && left) {
+			uint32_t len = (left < sizeof(data)) ? left : sizeof(data);
+			err = fread(data, 1, len, fp) != len;
+			hash = seq_pack_hash(hash, data, len);
+			left -= len;
+		}
+		err = err || (hash != chunk.hash);
+	}
+	fseek(fp, start, SEEK_SET);
 	return err;
 }
 
@@ -116,30 +456,409 @@ static uint8_t seq_read_frame(struct seq_frame_t* frame) {
 	return fread(frame, 1, sizeof(struct seq_frame_t), seq_stream) == sizeof(struct seq_frame_t);
 }
 
+static uint8_t seq_read_packed_frame(struct seq_frame_t* frame) {
+	return seq_pack_read_frame(&seq_decoder, frame);
+}
+
+/* The current format handler, as a frame source */
+static uint8_t seq_read_source(void* user, struct seq_frame_t* frame) {
+	(void)user;
+	return seq_packed ? seq_read_packed_frame(frame) : seq_read_frame(frame);
+}
+
+/* Move the sequencer file to a frame, for the keyframes */
+static int seq_rewind(void* user, uint32_t frame) {
+	(void)user;
+	if (!seq_packed) {
+		return fseek(seq_stream, sizeof(struct seq_raw_header_t) + (long)frame * sizeof(struct seq_frame_t), SEEK_SET);
+	}
+
+	uint32_t first = 0;
+	struct seq_pack_chunking_t* chunking = &seq_decoder.chunking;
+	if (chunking->chunk_frames) {
+		// Version 3: from the chunk of the frame
+		if (!chunking->chunks) {
+			return 0;
+		}
+		uint32_t chunk = frame / chunking->chunk_frames;
+		if (chunk >= chunking->chunks) {
+			chunk = chunking->chunks - 1;
+		}
+		uint8_t entry[SEQ_PACK_CHUNK_SIZE];
+		struct seq_pack_chunk_t index;
+		fseek(seq_stream, chunking->index_offset + chunk * SEQ_PACK_CHUNK_SIZE, SEEK_SET);
+		if (fread(entry, 1, SEQ_PACK_CHUNK_SIZE, seq_stream) != SEQ_PACK_CHUNK_SIZE) {
+			return 1;
+		}
+		seq_pack_chunk_decode(&index, entry);
+		fseek(seq_stream, index.offset, SEEK_SET);
+		seq_pack_decoder_seek_chunk(&seq_decoder, chunk, index.offset);
+		first = chunk * chunking->chunk_frames;
+	} else {
+		// Older versions: from the start
+		struct seq_stream_header_t header;
+		fseek(seq_stream, 0, SEEK_SET);
+		if (seq_decoder_open(&seq_decoder, seq_stream, &header)) {
+			return 1;
+		}
+	}
+
+	// Each frame is coded against the previous one
+	struct seq_frame_t skipped;
+	for (; first < frame; first++) {
+		seq_pack_read_frame(&seq_decoder, &skipped);
+	}
+	return 0;
+}
+
+/* Start the sequencer file at `seq_seek_ms`, from the keyframe before it */
+static int seek_seq(void) {
+	struct seq_frame_source_t source = { seq_read_source, NULL };
+	struct seq_keyframe_list_t keyframes;
+	// The keyframes of a repeated stream cover a single play
+	uint8_t repeat = seq_decoder.repeat;
+	seq_decoder.repeat = 0;
+	int err = seq_rewind(NULL, 0) || seq_compile_keyframes(&seq_stream_header, &source, seq_tempo, synth_freq, &keyframes);
+	seq_decoder.repeat = repeat;
+	if (err) {
+		return 1;
+	}
+	err = seq_seek_stream(&keyframes, (uint64_t)seq_seek_ms * synth_freq / 1000, seq_rewind, NULL);
+	seq_keyframes_free(&keyframes);
+	return err;
+}
+
+/* Play the sequencer stream `seq_stream`, read from `name` */
+static int play_seq(const char* name) {
+	// Compact streams start with a magic, raw streams with the header struct
+	char magic[3];
+	seq_packed = (fread(magic, 1, 3, seq_stream) == 3) && !memcmp(magic, "SEQ", 3);
+	fseek(seq_stream, 0, SEEK_SET);
+	if (seq_packed) {
+		if (seq_decoder_open(&seq_decoder, seq_stream, &seq_stream_header)) {
+			fprintf(stderr, "Unsupported sequencer file: %s", name);
+			return 1;
+		}
+		if (check_chunks(seq_stream)) {
+			fprintf(stderr, "Corrupted sequencer file: %s", name);
+			return 1;
+		}
+	} else {
+		struct seq_raw_header_t header;
+		fread(&header, 1, sizeof(struct seq_raw_header_t), seq_stream);
+		seq_stream_header.synth_frequency = header.synth_frequency;
+		seq_stream_header.voices = header.voices;
+		seq_stream_header.frames = header.frames;
+	}
+
+	int err = seq_play_stream(&seq_stream_header, sizeof(poly_voice) / sizeof(struct voice_ch_t), &synth);
+	seq_set_stream_tempo(seq_tempo);
+	feed_channels = seq_feed_synth;
+	seq_set_stream_require_handler(seq_packed ? seq_read_packed_frame : seq_read_frame);
+	if (!err && seq_seek_ms && seek_seq()) {
+		fprintf(stderr, "Cannot seek the sequencer file: %s", name);
+		err = 1;
+	}
+	return err;
+}
+
 static int open_seq(const char* name) {
 	seq_stream = fopen(name, "rb");
 	if (!seq_stream) {
 		fprintf(stderr, "Error reading sequencer file: %s", name);
 		return 1;
 	}
+	return play_seq(name);
+}
 
-	fread(&seq_stream_header, 1, sizeof(struct seq_stream_header_t), seq_stream);
+/* Compile and play a MML file, straight from the cache if set */
+static int play_mml(const char* name) {
+	if (!seq_cache_dir) {
+		return compile_mml(name, "sequencer.bin", 0, &seq_stream_header) || open_seq("sequencer.bin");
+	}
 
-	int err = seq_play_stream(&seq_stream_header, sizeof(poly_voice) / sizeof(struct voice_ch_t), &synth);
-	feed_channels = seq_feed_synth;
-	seq_set_stream_require_handler(seq_read_frame);
+	long size;
+	char* content = read_mml(name, &size);
+	if (!content) {
+		return 1;
+	}
+	uint64_t key = mml_cache_key(content, size, 0);
+	free(content);
+	if (seq_cache_open(seq_cache_dir, key, &seq_cache_entry)) {
+		// Compiled once, stored in the cache
+		if (compile_mml(name, "sequencer.bin", 0, &seq_stream_header)) {
+			return 1;
+		}
+		if (seq_cache_open(seq_cache_dir, key, &seq_cache_entry)) {
+			return open_seq("sequencer.bin");
+		}
+	}
+
+	// The stream is read from the mapped entry
+	seq_stream = fmemopen((void*)seq_cache_entry.data, seq_cache_entry.size, "rb");
+	if (!seq_stream) {
+		fprintf(stderr, "Error reading the cached stream of %s", name);
+		return 1;
+	}
+	return play_seq(name);
+}
+
+/* Batch mode: many MML files compiled and rendered at once */
+struct batch_t {
+	char** names;
+	int count;
+	/* Next file to take, and the results so far */
+	int next;
+	int failures;
+	uint64_t samples;
+	pthread_mutex_t lock;
+	/* Renders the songs of all the jobs */
+	struct sched_t sched;
+};
+
+static void wav_u16(uint8_t* data, uint16_t value) {
+	data[0] = value;
+	data[1] = value >> 8;
+}
+
+static void wav_u32(uint8_t* data, uint32_t value) {
+	wav_u16(data, value);
+	wav_u16(data + 2, value >> 16);
+}
+
+/* Header of a 16-bit mono PCM WAV file, the same samples as out.wav */
+static int wav_header(FILE* fp, uint32_t samples) {
+	uint8_t header[44];
+	uint32_t size = samples * 2;
+	memcpy(header, "RIFF", 4);
+	wav_u32(header + 4, 36 + size);
+	memcpy(header + 8, "WAVEfmt ", 8);
+	wav_u32(header + 16, 16);
+	wav_u16(header + 20, 1);
+	wav_u16(header + 22, 1);
+	wav_u32(header + 24, synth_freq);
+	wav_u32(header + 28, synth_freq * 2);
+	wav_u16(header + 32, 2);
+	wav_u16(header + 34, 16);
+	memcpy(header + 36, "data", 4);
+	wav_u32(header + 40, size);
+	fseek(fp, 0, SEEK_SET);
+	return fwrite(header, 1, sizeof(header), fp) != sizeof(header);
+}
+
+/* Replace the extension of `name`, the result must be freed */
+static char* batch_output(const char* name, const char* ext) {
+	const char* dot = strrchr(name, '.');
+	const char* slash = strrchr(name, '/');
+	size_t len = (dot && (!slash || dot > slash)) ? (size_t)(dot - name) : strlen(name);
+	char* out = malloc(len + strlen(ext) + 1);
+	memcpy(out, name, len);
+	strcpy(out + len, ext);
+	return out;
+}
+
+/* Compile a MML file next to it, then render the compact stream to a WAV file */
+static int batch_file(struct batch_t* batch, const char* name, uint32_t* rendered) {
+	char* bin_name = batch_output(name, ".bin");
+	char* wav_name = batch_output(name, ".wav");
+	struct seq_stream_header_t header;
+	struct seq_pack_decoder_t* decoder = malloc(sizeof(struct seq_pack_decoder_t));
+	struct voice_ch_t voice[16];
+	struct poly_synth_t song;
+	struct seq_player_t player;
+	struct sched_task_t* task = NULL;
+	FILE* in = NULL;
+	FILE* out = NULL;
+	int err = compile_mml(name, bin_name, 0, &header);
+
+	if (!err) {
+		in = fopen(bin_name, "rb");
+		err = !in || seq_decoder_open(decoder, in, &header);
+		// Rendered once, even if repeated
+		decoder->repeat = 0;
+	}
+	if (!err) {
+		memset(voice, 0, sizeof(voice));
+		song.voice = voice;
+		song.enable = 0;
+		song.mute = 0;
+		struct seq_frame_source_t source = { seq_pack_read_frame, decoder };
+		err = seq_player_init(&player, &header, sizeof(voice) / sizeof(struct voice_ch_t), &song, &source);
+	}
+	if (!err) {
+		seq_player_set_tempo(&player, seq_tempo);
+		out = fopen(wav_name, "wb");
+		err = !out || wav_header(out, 0);
+	}
+	if (!err) {
+		task = malloc(sizeof(struct sched_task_t));
+		sched_task_init(task, &song, &player);
+		sched_submit(&batch->sched, task);
+
+		int8_t block[SCHED_BLOCK_SAMPLES];
+		uint8_t data[SCHED_BLOCK_SAMPLES * 2];
+		uint16_t len;
+		while ((len = sched_task_read(task, block)) > 0) {
+			for (uint16_t i = 0; i < len; i++) {
+				wav_u16(data + 2 * i, (uint16_t)block[i] << 8);
+			}
+			if (!err && fwrite(data, 2, len, out) != len) {
+				// Keep reading until the task is done
+				sched_task_cancel(task);
+				err = 1;
+			}
+			*rendered += len;
+		}
+		sched_task_destroy(task);
+		free(task);
+		err = err || wav_header(out, *rendered);
+	}
+	if (out && fclose(out)) {
+		err = 1;
+	}
+	if (in) {
+		fclose(in);
+	}
+	if (err) {
+		fprintf(stderr, "Cannot render %s to %s\n", name, wav_name);
+	}
+	free(decoder);
+	free(bin_name);
+	free(wav_name);
 	return err;
 }
 
-int main(int argc, char** argv) {
-	int voice = 0;
+/* A job takes the next file until all are done */
+static void* batch_job(void* arg) {
+	struct batch_t* batch = arg;
+	while (1) {
+		pthread_mutex_lock(&batch->lock);
+		int idx = batch->next++;
+		pthread_mutex_unlock(&batch->lock);
+		if (idx >= batch->count) {
+			break;
+		}
 
-	synth.voice = poly_voice;
-	synth.enable = 0;
-	synth.mute = 0;
+		uint32_t rendered = 0;
+		int err = batch_file(batch, batch->names[idx], &rendered);
+		pthread_mutex_lock(&batch->lock);
+		batch->failures += err;
+		batch->samples += rendered;
+		pthread_mutex_unlock(&batch->lock);
+	}
+	return NULL;
+}
 
-	memset(poly_voice, 0, sizeof(poly_voice));
+static int batch_compare(const void* a, const void* b) {
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static void batch_add(struct batch_t* batch, char* name, int* size) {
+	if (batch->count == *size) {
+		*size += 64;
+		batch->names = realloc(batch->names, *size * sizeof(char*));
+	}
+	batch->names[batch->count++] = name;
+}
+
+/* The MML files of a directory, in name order, or the files listed in a text file */
+static int batch_collect(struct batch_t* batch, const char* path) {
+	int size = 0;
+	DIR* dir = opendir(path);
+	if (dir) {
+		struct dirent* entry;
+		while ((entry = readdir(dir))) {
+			size_t len = strlen(entry->d_name);
+			if (len > 4 && !strcmp(entry->d_name + len - 4, ".mml")) {
+				char* name = malloc(strlen(path) + len + 2);
+				sprintf(name, "%s/%s", path, entry->d_name);
+				batch_add(batch, name, &size);
+			}
+		}
+		closedir(dir);
+		qsort(batch->names, batch->count, sizeof(char*), batch_compare);
+		return 0;
+	}
+
+	FILE* fp = fopen(path, "r");
+	if (!fp) {
+		fprintf(stderr, "Cannot read the batch list: %s\n", path);
+		return 1;
+	}
+	char line[1024];
+	while (fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\r\n")] = 0;
+		if (line[0]) {
+			batch_add(batch, strdup(line), &size);
+		}
+	}
+	fclose(fp);
+	return 0;
+}
+
+/* Compile and render all the files of `path` on `batch_jobs` threads */
+static int run_batch(const char* path) {
+	struct batch_t batch;
+	batch.names = NULL;
+	batch.count = 0;
+	batch.next = 0;
+	batch.failures = 0;
+	batch.samples = 0;
+	if (batch_collect(&batch, path)) {
+		return 1;
+	}
+	if (sched_init(&batch.sched, batch_jobs)) {
+		fprintf(stderr, "Cannot start the render scheduler\n");
+		return 1;
+	}
+	pthread_mutex_init(&batch.lock, NULL);
+	mml_sched = &batch.sched;
 
+	struct timespec start;
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	// A job per worker: each one compiles a file while the others render
+	int job_count = batch.sched.worker_count;
+	pthread_t* jobs = malloc(sizeof(pthread_t) * job_count);
+	int started = 0;
+	while (started < job_count && !pthread_create(&jobs[started], NULL, batch_job, &batch)) {
+		started++;
+	}
+	if (!started) {
+		// Run in this thread
+		batch_job(&batch);
+	}
+	for (int i = 0; i < started; i++) {
+		pthread_join(jobs[i], NULL);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	double audio = (double)batch.samples / synth_freq;
+	printf("%d files (%d failed) on %d threads: %.1f s of audio in %.2f s, "
+			"%.1f files/s, %.1fx realtime\n",
+			batch.count, batch.failures, job_count, audio, elapsed,
+			elapsed > 0 ? batch.count / elapsed : 0.0,
+			elapsed > 0 ? audio / elapsed : 0.0);
+
+	free(jobs);
+	mml_sched = NULL;
+	sched_destroy(&batch.sched);
+	pthread_mutex_destroy(&batch.lock);
+	for (int i = 0; i < batch.count; i++) {
+		free(batch.names[i]);
+	}
+	free(batch.names);
+	return batch.failures ? 1 : 0;
+}
+
+/* Output devices, opened when the first samples are played */
+static ao_device* wav_device = NULL;
+static ao_device* live_device = NULL;
+
+/* Open out.wav, and the live output if available */
+static int open_devices(void) {
 	ao_sample_format format;
 	memset(&format, 0, sizeof(format));
 	format.bits = 16;
@@ -149,21 +868,32 @@ int main(int argc, char** argv) {
 
 	ao_initialize();
 	int wav_driver = ao_driver_id("wav");
-	ao_device* wav_device = ao_open_file(
+	wav_device = ao_open_file(
 		wav_driver, "out.wav", 1, &format, NULL
 	);
 
 	if (!wav_device) {
 		fprintf(stderr, "Failed to open WAV device\n");
+		ao_shutdown();
 		return 1;
 	}
 
-	ao_device* live_device = NULL;
 	int live_driver = ao_default_driver_id();
 	live_device = ao_open_live(live_driver, &format, NULL);
 	if (!live_device) {
 		printf("Live driver not available\n");
 	}
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	int voice = 0;
+
+	synth.voice = poly_voice;
+	synth.enable = 0;
+	synth.mute = 0;
+
+	memset(poly_voice, 0, sizeof(poly_voice));
 
 	argc--;
 	argv++;
@@ -187,7 +917,86 @@ int main(int argc, char** argv) {
 			const char* name = argv[1];
 			_DPRINTF("compiling MML %s\n", name);
 			
-			return open_mml(name);
+			return compile_mml(name, "sequencer.bin", 0, &seq_stream_header);
+
+		/* Check for MML compilation to the raw frame format */
+		} else if (!strcmp(argv[0], "compile-mml-raw")) {
+			const char* name = argv[1];
+			_DPRINTF("compiling MML %s\n", name);
+
+			return compile_mml(name, "sequencer.bin", 1, &seq_stream_header);
+
+		/* Compile and play a MML file */
+		} else if (!strcmp(argv[0], "mml")) {
+			const char* name = argv[1];
+			_DPRINTF("playing MML file %s\n", name);
+
+			int err = play_mml(name);
+			if (err) {
+				return err;
+			}
+
+			argv++;
+			argc--;
+
+		/* Directory of the compiled streams cache */
+		} else if (!strcmp(argv[0], "cache")) {
+			seq_cache_dir = argv[1];
+			_DPRINTF("stream cache %s\n", seq_cache_dir);
+			argv++;
+			argc--;
+
+		/* Batch compilation and rendering of MML files */
+		} else if (!strcmp(argv[0], "batch")) {
+			const char* path = argv[1];
+			_DPRINTF("batch %s\n", path);
+
+			return run_batch(path);
+
+		/* Threads of the batch mode */
+		} else if (!strcmp(argv[0], "jobs")) {
+			batch_jobs = atoi(argv[1]);
+			_DPRINTF("%d batch jobs\n", batch_jobs);
+			argv++;
+			argc--;
+
+		/* Frames per chunk of the compiled compact streams */
+		} else if (!strcmp(argv[0], "chunk")) {
+			seq_chunk_frames = atoi(argv[1]);
+			_DPRINTF("chunks of %d frames\n", seq_chunk_frames);
+			argv++;
+			argc--;
+
+		/* Nesting of the loops of the compiled compact streams */
+		} else if (!strcmp(argv[0], "loops")) {
+			seq_loop_depth = atoi(argv[1]);
+			if (seq_loop_depth > SEQ_PACK_MAX_LOOPS) {
+				seq_loop_depth = SEQ_PACK_MAX_LOOPS;
+			}
+			_DPRINTF("loops of %d levels\n", seq_loop_depth);
+			argv++;
+			argc--;
+
+		/* Compile compact streams that play forever */
+		} else if (!strcmp(argv[0], "repeat")) {
+			seq_repeat = 1;
+			_DPRINTF("repeated streams\n");
+
+		/* Tempo of the sequencer files, in percent */
+		} else if (!strcmp(argv[0], "tempo")) {
+			int tempo = atoi(argv[1]);
+			_DPRINTF("sequencer tempo %d%%\n", tempo);
+			if (tempo > 0)
+				seq_tempo = (tempo * SEQ_TEMPO_NORMAL + 50) / 100;
+			argv++;
+			argc--;
+
+		/* Start of the sequencer files, in milliseconds */
+		} else if (!strcmp(argv[0], "seek")) {
+			seq_seek_ms = atoi(argv[1]);
+			_DPRINTF("sequencer seek %u ms\n", seq_seek_ms);
+			argv++;
+			argc--;
 
 		/* Check for sequencer file play */
 		} else if (!strcmp(argv[0], "sequencer")) {
@@ -342,6 +1151,11 @@ int main(int argc, char** argv) {
 			_DPRINTF("----- Start playback (0x%lx) -----\n",
 					synth.enable);
 
+		/* Only the commands that play need the devices */
+		if (synth.enable && !wav_device && open_devices()) {
+			return 1;
+		}
+
 		while (synth.enable) {
 			int16_t* sample_ptr = samples;
 			uint16_t samples_remain = sizeof(samples)
@@ -371,10 +1185,28 @@ int main(int argc, char** argv) {
 		}
 	}
 
-	ao_close(wav_device);
-	if (live_device) {
-		ao_close(live_device);
+	if (feed_channels == seq_feed_synth && seq_stream_retime_error()) {
+		/* The rate, the tempo or both were changed */
+		fprintf(stderr, "Sequencer file retimed");
+		if (seq_stream_header.synth_frequency != synth_freq) {
+			fprintf(stderr, " from %d Hz",
+					seq_stream_header.synth_frequency);
+		}
+		if (seq_tempo != SEQ_TEMPO_NORMAL) {
+			fprintf(stderr, " at %d%% tempo", (seq_tempo * 100
+					+ SEQ_TEMPO_NORMAL / 2)
+					/ SEQ_TEMPO_NORMAL);
+		}
+		fprintf(stderr, ", timing error up to %u ppm\n",
+				seq_stream_retime_error());
+	}
+
+	if (wav_device) {
+		ao_close(wav_device);
+		if (live_device) {
+			ao_close(live_device);
+		}
+		ao_shutdown();
 	}
-	ao_shutdown();
 	return 0;
 }
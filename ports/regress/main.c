@@ -0,0 +1,2144 @@
+/*!
+ * Polyphonic synthesizer for microcontrollers.  Regression harness.
+ * (C) 2026 The atinysynth contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#include "synth.h"
+#include "debug.h"
+#include "sequencer.h"
+#include "mml.h"
+#include "scheduler.h"
+#include "mmlsplit.h"
+#include "seqcache.h"
+#include "seqpack.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*!
+ * Renders every MML song passed on the command line and a matrix of
+ * synthetic voice configurations through each engine variant, and
+ * compares the output sample by sample with the scalar reference
+ * (`poly_synth_next` fed by `seq_player_feed`).  The reference output is
+ * in turn checked against the golden hashes.
+ */
+
+const uint16_t synth_freq = 32000;
+
+/*! Maximum number of voices used by a case */
+#define REGRESS_VOICES		(16)
+
+/*! Safety limit: no case should render longer than this */
+#define REGRESS_MAX_SAMPLES	(1UL << 24)
+
+/*! Safety limit for the compiled songs */
+#define REGRESS_MAX_FRAMES	(1 << 20)
+
+/*! Golden hashes are taken every 2^n samples */
+#define REGRESS_BLOCK_BITS	(15)
+
+/*! Maximum length of a golden file line */
+#define REGRESS_LINE_SZ		(4096)
+
+/*! Growable buffer of rendered samples */
+struct regress_buf_t {
+	int8_t* data;
+	uint32_t len;
+	uint32_t size;
+};
+
+/*! Configuration of a single voice of a synthetic case */
+struct regress_voice_t {
+	struct voice_wf_def_t wf;
+	struct adsr_env_def_t adsr;
+};
+
+/*! A rendering case: a MML song or a synthetic voice configuration */
+struct regress_case_t {
+	/*! Name, as reported and stored in the golden file */
+	char name[64];
+	/*! Number of voices used */
+	uint8_t voices;
+	/*! Song only: compiled frame stream, in fetch order */
+	struct seq_frame_t* frames;
+	/*! Song only: number of frames in `frames` */
+	int frame_count;
+	/*! Synthetic only: voice configurations */
+	struct regress_voice_t voice[REGRESS_VOICES];
+};
+
+/*!
+ * Render a case with the given mute mask.  Returns non-zero if the
+ * case is not supported by the engine.
+ */
+typedef int (*regress_render_t)(const struct regress_case_t* rcase,
+		uintptr_t mute, struct regress_buf_t* out);
+
+/*! Engine variant */
+struct regress_engine_t {
+	/*! Engine name, as reported */
+	const char* name;
+	/*! Rendering function */
+	regress_render_t render;
+};
+
+static struct regress_case_t* cases;
+static int case_count;
+static int failures;
+
+static void buf_push(struct regress_buf_t* buf, int8_t sample) {
+	if (buf->len == buf->size) {
+		buf->size = buf->size ? buf->size * 2 : 65536;
+		buf->data = realloc(buf->data, buf->size);
+	}
+	buf->data[buf->len++] = sample;
+}
+
+static void buf_free(struct regress_buf_t* buf) {
+	free(buf->data);
+	memset(buf, 0, sizeof(struct regress_buf_t));
+}
+
+/*! Mute mask that leaves only `voice` audible, or everything if negative */
+static uintptr_t solo_mask(int voice) {
+	return (voice < 0) ? 0 : ~((uintptr_t)1 << voice);
+}
+
+/*! Same starting conditions for every render, noise included */
+static void regress_synth_init(struct poly_synth_t* synth,
+		struct voice_ch_t* voice, uintptr_t mute) {
+	memset(voice, 0, sizeof(struct voice_ch_t) * REGRESS_VOICES);
+	synth->voice = voice;
+	synth->enable = 0;
+	synth->mute = mute;
+	srand(1);
+}
+
+/*! Frame cursor over the frames of a case */
+struct regress_cursor_t {
+	const struct seq_frame_t* pos;
+	const struct seq_frame_t* end;
+};
+
+static uint8_t regress_read_cursor(void* user, struct seq_frame_t* frame) {
+	struct regress_cursor_t* cursor = user;
+	if (cursor->pos == cursor->end)
+		return 0;
+	*frame = *(cursor->pos++);
+	return 1;
+}
+
+/*! Configure a case without sequencer, all the voices start together */
+static void config_voices(const struct regress_case_t* rcase,
+		struct poly_synth_t* synth) {
+	for (uint8_t i = 0; i < rcase->voices; i++) {
+		struct voice_wf_def_t wf = rcase->voice[i].wf;
+		voice_wf_set(&synth->voice[i].wf, &wf);
+		adsr_config(&synth->voice[i].adsr, &rcase->voice[i].adsr);
+		synth->enable |= (uintptr_t)1 << i;
+	}
+}
+
+static void render_voices(const struct regress_case_t* rcase,
+		struct poly_synth_t* synth, struct regress_buf_t* out) {
+	config_voices(rcase, synth);
+	while (synth->enable && (out->len < REGRESS_MAX_SAMPLES))
+		buf_push(out, poly_synth_next(synth));
+}
+
+/*! Prepare a player for the frames of a case */
+static int regress_player_init(const struct regress_case_t* rcase,
+		struct seq_player_t* player, struct regress_cursor_t* cursor,
+		struct poly_synth_t* synth) {
+	struct seq_stream_header_t header;
+	header.synth_frequency = synth_freq;
+	header.voices = rcase->voices;
+	header.frames = rcase->frame_count;
+
+	cursor->pos = rcase->frames;
+	cursor->end = rcase->frames + rcase->frame_count;
+	struct seq_frame_source_t source = { regress_read_cursor, cursor };
+	return seq_player_init(player, &header, REGRESS_VOICES, synth,
+			&source);
+}
+
+/*! Scalar reference: one `poly_synth_next` per sample */
+static int render_scalar(const struct regress_case_t* rcase,
+		uintptr_t mute, struct regress_buf_t* out) {
+	struct voice_ch_t voice[REGRESS_VOICES];
+	struct poly_synth_t synth;
+	regress_synth_init(&synth, voice, mute);
+
+	if (!rcase->frames) {
+		render_voices(rcase, &synth, out);
+		return 0;
+	}
+
+	struct regress_cursor_t cursor;
+	struct seq_player_t player;
+	if (regress_player_init(rcase, &player, &cursor, &synth))
+		return 1;
+
+	seq_player_feed(&player);
+	while (synth.enable && (out->len < REGRESS_MAX_SAMPLES)) {
+		buf_push(out, poly_synth_next(&synth));
+		seq_player_feed(&player);
+	}
+	return 0;
+}
+
+/*! The player with lookahead, the next frame is staged before it is due */
+static int render_lookahead(const struct regress_case_t* rcase,
+		uintptr_t mute, struct regress_buf_t* out) {
+	if (!rcase->frames)
+		return 1;
+
+	struct voice_ch_t voice[REGRESS_VOICES];
+	struct poly_synth_t synth;
+	regress_synth_init(&synth, voice, mute);
+
+	struct regress_cursor_t cursor;
+	struct seq_player_t player;
+	if (regress_player_init(rcase, &player, &cursor, &synth))
+		return 1;
+
+	seq_player_prepare(&player);
+	seq_player_feed(&player);
+	while (synth.enable && (out->len < REGRESS_MAX_SAMPLES)) {
+		seq_player_prepare(&player);
+		buf_push(out, poly_synth_next(&synth));
+		seq_player_feed(&player);
+	}
+	return 0;
+}
+
+/*!
+ * The player as a layer from the second voice, under a layer of sound
+ * effects that plays nothing: the first voice stays muted.
+ */
+static int render_layered(const struct regress_case_t* rcase,
+		uintptr_t mute, struct regress_buf_t* out) {
+	if (!rcase->frames || rcase->voices >= REGRESS_VOICES)
+		return 1;
+
+	struct voice_ch_t voice[REGRESS_VOICES];
+	struct poly_synth_t synth;
+	regress_synth_init(&synth, voice, (mute << 1) | 1);
+
+	struct seq_stream_header_t header;
+	header.synth_frequency = synth_freq;
+	header.voices = 1;
+	header.frames = 0;
+	struct regress_cursor_t none = { rcase->frames, rcase->frames };
+	struct seq_frame_source_t source = { regress_read_cursor, &none };
+	struct seq_player_t effects;
+	seq_player_init_layer(&effects, &header, REGRESS_VOICES, &synth,
+			&source, 1, NULL);
+
+	struct regress_cursor_t cursor = {
+		rcase->frames, rcase->frames + rcase->frame_count
+	};
+	header.voices = rcase->voices;
+	header.frames = rcase->frame_count;
+	source.user = &cursor;
+	struct seq_player_t music;
+	if (seq_player_init_layer(&music, &header, REGRESS_VOICES, &synth,
+				&source, 1, &effects))
+		return 1;
+
+	seq_player_feed(&effects);
+	seq_player_feed(&music);
+	while (synth.enable && (out->len < REGRESS_MAX_SAMPLES)) {
+		buf_push(out, poly_synth_next(&synth));
+		seq_player_feed(&effects);
+		seq_player_feed(&music);
+	}
+	return 0;
+}
+
+/*! Frame cursor of the legacy engine, the handler has no context */
+static struct regress_cursor_t legacy_cursor;
+
+static uint8_t regress_read_legacy(struct seq_frame_t* frame) {
+	return regress_read_cursor(&legacy_cursor, frame);
+}
+
+/*! The global player of `seq_play_stream` and `seq_feed_synth` */
+static int render_legacy(const struct regress_case_t* rcase,
+		uintptr_t mute, struct regress_buf_t* out) {
+	struct voice_ch_t voice[REGRESS_VOICES];
+	struct poly_synth_t synth;
+	regress_synth_init(&synth, voice, mute);
+
+	if (!rcase->frames) {
+		render_voices(rcase, &synth, out);
+		return 0;
+	}
+
+	struct seq_stream_header_t header;
+	header.synth_frequency = synth_freq;
+	header.voices = rcase->voices;
+	header.frames = rcase->frame_count;
+	if (seq_play_stream(&header, REGRESS_VOICES, &synth))
+		return 1;
+
+	legacy_cursor.pos = rcase->frames;
+	legacy_cursor.end = rcase->frames + rcase->frame_count;
+	seq_set_stream_require_handler(regress_read_legacy);
+	seq_feed_synth(&synth);
+	while (synth.enable && (out->len < REGRESS_MAX_SAMPLES)) {
+		buf_push(out, poly_synth_next(&synth));
+		seq_feed_synth(&synth);
+	}
+	return 0;
+}
+
+/*! Byte writer of the compact stream encoder */
+static int regress_write_bytes(void* user, const uint8_t* data, uint8_t len) {
+	while (len--)
+		buf_push(user, *(data++));
+	return 0;
+}
+
+/*! Frames per chunk of the `chunked` engine, chunks end mid-song */
+#define REGRESS_CHUNK_FRAMES	(7)
+
+/*! Frames per chunk of the `looped` engine, long enough for the loops */
+#define REGRESS_LOOP_CHUNK_FRAMES	(96)
+
+/*! Index writer of the chunked encoder, entries go to a separate buffer */
+static int regress_write_chunk(void* user, const struct seq_pack_chunk_t* chunk) {
+	uint8_t data[SEQ_PACK_CHUNK_SIZE];
+	seq_pack_chunk_encode(data, chunk);
+	return regress_write_bytes(user, data, SEQ_PACK_CHUNK_SIZE);
+}
+
+/*!
+ * Encode frames in version 3, with the instruments if not NULL, in
+ * chunks of `chunk_frames` frames and the index at the end.  The loops
+ * are up to `depth` levels, `flags` are added to the header.
+ */
+static void regress_pack_frames(const struct seq_frame_t* frames,
+		uint32_t count, uint8_t voices,
+		const struct seq_instrument_table_t* instruments,
+		uint16_t chunk_frames, uint8_t depth, uint8_t flags,
+		struct regress_buf_t* out) {
+	struct seq_stream_header_t header;
+	header.synth_frequency = synth_freq;
+	header.voices = voices;
+	header.frames = count;
+	struct seq_pack_chunking_t chunking;
+	uint8_t data[SEQ_PACK_HEADER_CHUNKED_SIZE] = { 0 };
+	regress_write_bytes(out, data, SEQ_PACK_HEADER_CHUNKED_SIZE);
+
+	struct regress_buf_t index = { 0 };
+	struct seq_pack_encoder_t encoder;
+	seq_pack_encoder_init_chunked(&encoder, regress_write_bytes, out,
+			instruments, chunk_frames,
+			regress_write_chunk, &index);
+	seq_pack_write_frames(&encoder, frames, count, depth);
+	seq_pack_encoder_finish(&encoder);
+
+	/* The header is only known at the end */
+	chunking.chunk_frames = chunk_frames;
+	chunking.chunks = index.len / SEQ_PACK_CHUNK_SIZE;
+	chunking.index_offset = encoder.offset;
+	if (instruments)
+		flags |= SEQ_PACK_FLAG_INSTRUMENTS;
+	if (encoder.loops)
+		flags |= SEQ_PACK_FLAG_LOOPS;
+	seq_pack_header_chunked((uint8_t*)out->data, &header, flags,
+			&chunking);
+	for (uint32_t i = 0; i < index.len; i++)
+		buf_push(out, index.data[i]);
+	buf_free(&index);
+}
+
+/*!
+ * Encode the frames of a case in the compact format, header included,
+ * with the given version, and loops up to `depth` levels in version 3.
+ * Returns non-zero if there are too many instruments.
+ */
+static int regress_pack_loops(const struct regress_case_t* rcase,
+		uint8_t version, uint8_t depth, struct regress_buf_t* out) {
+	struct seq_instrument_table_t instruments;
+	instruments.count = 0;
+	if (version != SEQ_PACK_VERSION) {
+		for (int i = 0; i < rcase->frame_count; i++) {
+			if (seq_pack_add_instrument(&instruments,
+						&rcase->frames[i]))
+				return 1;
+		}
+	}
+	if (version == SEQ_PACK_VERSION_CHUNKED) {
+		regress_pack_frames(rcase->frames, rcase->frame_count,
+				rcase->voices, &instruments, depth
+				? REGRESS_LOOP_CHUNK_FRAMES
+				: REGRESS_CHUNK_FRAMES, depth, 0, out);
+		return 0;
+	}
+
+	struct seq_stream_header_t header;
+	header.synth_frequency = synth_freq;
+	header.voices = rcase->voices;
+	header.frames = rcase->frame_count;
+	uint8_t data[SEQ_PACK_HEADER_SIZE];
+	seq_pack_header(data, &header, version);
+	regress_write_bytes(out, data, SEQ_PACK_HEADER_SIZE);
+
+	struct seq_pack_encoder_t encoder;
+	seq_pack_encoder_init(&encoder, regress_write_bytes, out,
+			(version == SEQ_PACK_VERSION_INSTRUMENTS)
+			? &instruments : NULL);
+	for (int i = 0; i < rcase->frame_count; i++)
+		seq_pack_write_frame(&encoder, &rcase->frames[i]);
+	return 0;
+}
+
+static int regress_pack(const struct regress_case_t* rcase,
+		uint8_t version, struct regress_buf_t* out) {
+	return regress_pack_loops(rcase, version, 0, out);
+}
+
+/*! The player fed by the compact stream decoder */
+static int render_unpack(const struct regress_case_t* rcase,
+		uint8_t version, uint8_t depth, uintptr_t mute,
+		struct regress_buf_t* out) {
+	struct regress_buf_t packed = { 0 };
+	if (!rcase->frames
+			|| regress_pack_loops(rcase, version, depth, &packed)) {
+		buf_free(&packed);
+		return 1;
+	}
+
+	struct voice_ch_t voice[REGRESS_VOICES];
+	struct poly_synth_t synth;
+	regress_synth_init(&synth, voice, mute);
+
+	const uint8_t* pos = (const uint8_t*)packed.data;
+	struct seq_stream_header_t header;
+	struct seq_pack_decoder_t decoder;
+	struct seq_player_t player;
+	struct seq_frame_source_t source = { seq_pack_read_frame, &decoder };
+	if (seq_pack_decoder_init(&decoder, seq_pack_read_rom, &pos, &header)
+			|| seq_player_init(&player, &header, REGRESS_VOICES,
+				&synth, &source)) {
+		printf("FAIL packed %s: invalid header\n", rcase->name);
+		failures++;
+		buf_free(&packed);
+		return 1;
+	}
+	seq_pack_decoder_set_rewind(&decoder, seq_pack_rewind_rom);
+
+	seq_player_feed(&player);
+	while (synth.enable && (out->len < REGRESS_MAX_SAMPLES)) {
+		buf_push(out, poly_synth_next(&synth));
+		seq_player_feed(&player);
+	}
+	/*
+	 * The chunk index follows the frames, and the loop ends after the
+	 * last frame are not read
+	 */
+	uint32_t len = decoder.chunking.chunk_frames
+		? decoder.chunking.index_offset : packed.len;
+	if ((decoder.flags & SEQ_PACK_FLAG_LOOPS)
+			? (pos > (const uint8_t*)packed.data + len)
+			: (pos != (const uint8_t*)packed.data + len)) {
+		printf("FAIL packed %s: %d bytes not decoded\n", rcase->name,
+				(int)((const uint8_t*)packed.data + len - pos));
+		failures++;
+	}
+	buf_free(&packed);
+	return 0;
+}
+
+static int render_packed(const struct regress_case_t* rcase,
+		uintptr_t mute, struct regress_buf_t* out) {
+	return render_unpack(rcase, SEQ_PACK_VERSION, 0, mute, out);
+}
+
+static int render_instruments(const struct regress_case_t* rcase,
+		uintptr_t mute, struct regress_buf_t* out) {
+	return render_unpack(rcase, SEQ_PACK_VERSION_INSTRUMENTS, 0, mute,
+			out);
+}
+
+static int render_chunked(const struct regress_case_t* rcase,
+		uintptr_t mute, struct regress_buf_t* out) {
+	return render_unpack(rcase, SEQ_PACK_VERSION_CHUNKED, 0, mute, out);
+}
+
+static int render_looped(const struct regress_case_t* rcase,
+		uintptr_t mute, struct regress_buf_t* out) {
+	return render_unpack(rcase, SEQ_PACK_VERSION_CHUNKED,
+			SEQ_PACK_MAX_LOOPS, mute, out);
+}
+
+/*! Scheduler shared by the `sched` engine and the concurrency check */
+static struct sched_t sched;
+
+/*! Read a task to the end, dropping what exceeds the safety limit */
+static void sched_read_all(struct sched_task_t* task,
+		struct regress_buf_t* out) {
+	int8_t samples[SCHED_BLOCK_SAMPLES];
+	uint16_t len;
+	while ((len = sched_task_read(task, samples)) > 0) {
+		for (uint16_t i = 0; i < len; i++) {
+			if (out->len == REGRESS_MAX_SAMPLES) {
+				sched_task_cancel(task);
+				break;
+			}
+			buf_push(out, samples[i]);
+		}
+	}
+}
+
+/*! A single task on the scheduler, its blocks hop between the workers */
+static int render_sched(const struct regress_case_t* rcase,
+		uintptr_t mute, struct regress_buf_t* out) {
+	struct voice_ch_t voice[REGRESS_VOICES];
+	struct poly_synth_t synth;
+	struct regress_cursor_t cursor;
+	struct seq_player_t player;
+	regress_synth_init(&synth, voice, mute);
+
+	struct sched_task_t* task = malloc(sizeof(struct sched_task_t));
+	if (rcase->frames) {
+		if (regress_player_init(rcase, &player, &cursor, &synth)) {
+			free(task);
+			return 1;
+		}
+		sched_task_init(task, &synth, &player);
+	} else {
+		config_voices(rcase, &synth);
+		sched_task_init(task, &synth, NULL);
+	}
+
+	sched_submit(&sched, task);
+	sched_read_all(task, out);
+	sched_task_destroy(task);
+	free(task);
+	return 0;
+}
+
+/*! Samples between the segments of the `split` engine */
+#define REGRESS_SPLIT_INTERVAL	(3000)
+
+/*! Non-zero if the frames of a case play noise, that is not replayed */
+static int regress_has_noise(const struct regress_case_t* rcase) {
+	for (int f = 0; f < rcase->frame_count; f++) {
+		if (rcase->frames[f].waveform_def.mode == VOICE_MODE_NOISE)
+			return 1;
+	}
+	return 0;
+}
+
+/*! Case of the `split` engine */
+static const struct regress_case_t* split_case;
+
+/*! Each segment reads from its own cursor */
+static int regress_split_open(void* user, uint32_t frame,
+		struct seq_frame_source_t* source) {
+	const struct regress_case_t* rcase = split_case;
+	(void)user;
+	if (frame > (uint32_t)rcase->frame_count)
+		return 1;
+	struct regress_cursor_t* cursor =
+		malloc(sizeof(struct regress_cursor_t));
+	cursor->pos = rcase->frames + frame;
+	cursor->end = rcase->frames + rcase->frame_count;
+	source->read = regress_read_cursor;
+	source->user = cursor;
+	return 0;
+}
+
+static void regress_split_close(void* user,
+		struct seq_frame_source_t* source) {
+	(void)user;
+	free(source->user);
+}
+
+static int regress_split_write(void* user, const int8_t* samples,
+		uint16_t len) {
+	struct regress_buf_t* out = user;
+	while (len--) {
+		if (out->len == REGRESS_MAX_SAMPLES)
+			return 1;
+		buf_push(out, *(samples++));
+	}
+	return 0;
+}
+
+/*!
+ * The song cut at its keyframes, the segments rendered at the same time
+ * by the scheduler and joined.
+ */
+static int render_split(const struct regress_case_t* rcase,
+		uintptr_t mute, struct regress_buf_t* out) {
+	if (!rcase->frames || regress_has_noise(rcase))
+		return 1;
+	split_case = rcase;
+
+	struct seq_stream_header_t header;
+	header.synth_frequency = synth_freq;
+	header.voices = rcase->voices;
+	header.frames = rcase->frame_count;
+	struct regress_cursor_t cursor = { rcase->frames,
+		rcase->frames + rcase->frame_count };
+	struct seq_frame_source_t source = { regress_read_cursor, &cursor };
+	struct seq_keyframe_list_t keyframes;
+	if (seq_compile_keyframes(&header, &source, SEQ_TEMPO_NORMAL,
+				REGRESS_SPLIT_INTERVAL, &keyframes))
+		return 1;
+
+	struct sched_split_t split = { regress_split_open,
+		regress_split_close, regress_split_write, out };
+	sched_render_split(&sched, &header, SEQ_TEMPO_NORMAL, &keyframes,
+			mute, &split);
+	seq_keyframes_free(&keyframes);
+	return 0;
+}
+
+/*! Engine variants, the first one is the reference */
+static const struct regress_engine_t engines[] = {
+	{ "scalar", render_scalar },
+	{ "legacy", render_legacy },
+	{ "lookahead", render_lookahead },
+	{ "layered", render_layered },
+	{ "sched", render_sched },
+	{ "packed", render_packed },
+	{ "instruments", render_instruments },
+	{ "chunked", render_chunked },
+	{ "looped", render_looped },
+	{ "split", render_split },
+};
+
+#define ENGINE_COUNT	(sizeof(engines) / sizeof(struct regress_engine_t))
+
+/*! 32-bit FNV-1a hash */
+static uint32_t regress_hash(const int8_t* data, uint32_t len) {
+	uint32_t hash = 2166136261UL;
+	while (len--) {
+		hash ^= (uint8_t)*(data++);
+		hash *= 16777619UL;
+	}
+	return hash;
+}
+
+/*! Golden file line for a rendered track: name, samples, block hashes */
+static void golden_line(char* line, const char* name, const char* track,
+		const struct regress_buf_t* buf) {
+	const uint32_t block = 1UL << REGRESS_BLOCK_BITS;
+	int n = snprintf(line, REGRESS_LINE_SZ, "%s %s %u",
+			name, track, buf->len);
+	for (uint32_t i = 0; i < buf->len; i += block) {
+		uint32_t len = buf->len - i;
+		if (len > block)
+			len = block;
+		n += snprintf(line + n, REGRESS_LINE_SZ - n, " %08x",
+				regress_hash(buf->data + i, len));
+	}
+}
+
+/*! Golden file content, one line per track */
+static char** golden;
+static int golden_count;
+static int golden_loaded;
+static FILE* golden_out;
+
+static int golden_load(const char* name) {
+	FILE* fp = fopen(name, "r");
+	if (!fp) {
+		fprintf(stderr, "Cannot read golden file %s\n", name);
+		return 1;
+	}
+	char line[REGRESS_LINE_SZ];
+	while (fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\r\n")] = 0;
+		if (!line[0] || line[0] == '#')
+			continue;
+		golden = realloc(golden, sizeof(char*) * (golden_count + 1));
+		golden[golden_count++] = strdup(line);
+	}
+	fclose(fp);
+	golden_loaded = 1;
+	return 0;
+}
+
+/*! Find the golden line starting with "name track " */
+static const char* golden_find(const char* name, const char* track) {
+	size_t name_len = strlen(name);
+	size_t track_len = strlen(track);
+	for (int i = 0; i < golden_count; i++) {
+		const char* l = golden[i];
+		if (!strncmp(l, name, name_len) && l[name_len] == ' '
+				&& !strncmp(l + name_len + 1, track, track_len)
+				&& l[name_len + 1 + track_len] == ' ')
+			return l;
+	}
+	return NULL;
+}
+
+/*!
+ * Check a reference track against the golden hashes.  Reports the
+ * first diverging block, the exact sample requires a raw comparison
+ * between two engines.
+ */
+static void golden_check(const char* name, const char* track,
+		const struct regress_buf_t* buf) {
+	char line[REGRESS_LINE_SZ];
+	golden_line(line, name, track, buf);
+
+	if (golden_out) {
+		fprintf(golden_out, "%s\n", line);
+		return;
+	}
+	if (!golden_loaded)
+		return;
+
+	const char* expected = golden_find(name, track);
+	if (!expected) {
+		printf("FAIL golden %s %s: missing\n", name, track);
+		failures++;
+		return;
+	}
+	if (!strcmp(expected, line))
+		return;
+
+	/* Skip name, track and samples, then compare block by block */
+	const char* a = expected;
+	const char* b = line;
+	for (int field = 0; *a && *b; field++) {
+		size_t la = strcspn(a, " ");
+		size_t lb = strcspn(b, " ");
+		if (field >= 2 && (la != lb || strncmp(a, b, la))) {
+			if (field == 2) {
+				printf("FAIL golden %s %s: %u samples, "
+						"expected %.*s\n", name, track,
+						buf->len, (int)la, a);
+			} else {
+				uint32_t first = (uint32_t)(field - 3)
+					<< REGRESS_BLOCK_BITS;
+				printf("FAIL golden %s %s: diverges in "
+						"samples %u-%u\n", name, track,
+						first, first + (1U
+						<< REGRESS_BLOCK_BITS) - 1);
+			}
+			failures++;
+			return;
+		}
+		a += la + (a[la] ? 1 : 0);
+		b += lb + (b[lb] ? 1 : 0);
+	}
+	printf("FAIL golden %s %s: length mismatch\n", name, track);
+	failures++;
+}
+
+/*! First index where the buffers differ, or UINT32_MAX if identical */
+static uint32_t first_divergence(const struct regress_buf_t* a,
+		const struct regress_buf_t* b) {
+	uint32_t len = (a->len < b->len) ? a->len : b->len;
+	for (uint32_t i = 0; i < len; i++)
+		if (a->data[i] != b->data[i])
+			return i;
+	return (a->len == b->len) ? UINT32_MAX : len;
+}
+
+/*!
+ * Locate the voice responsible of a divergence, rendering every voice
+ * solo through both engines.  Returns -1 if every voice matches on its
+ * own (e.g. mixing or clipping issue).
+ */
+static int locate_voice(const struct regress_case_t* rcase,
+		const struct regress_engine_t* engine, uint32_t* sample) {
+	int voice = -1;
+	for (int i = 0; i < rcase->voices; i++) {
+		struct regress_buf_t ref = { 0 };
+		struct regress_buf_t out = { 0 };
+		engines[0].render(rcase, solo_mask(i), &ref);
+		engine->render(rcase, solo_mask(i), &out);
+		uint32_t at = first_divergence(&ref, &out);
+		if (at < *sample || (voice < 0 && at != UINT32_MAX)) {
+			*sample = at;
+			voice = i;
+		}
+		buf_free(&ref);
+		buf_free(&out);
+	}
+	return voice;
+}
+
+static void run_case(const struct regress_case_t* rcase) {
+	struct regress_buf_t ref = { 0 };
+	engines[0].render(rcase, solo_mask(-1), &ref);
+	if (ref.len >= REGRESS_MAX_SAMPLES) {
+		printf("FAIL %s: never ends\n", rcase->name);
+		failures++;
+	}
+	golden_check(rcase->name, "mix", &ref);
+
+	/* All the synthetic voices start together */
+	if (!rcase->frames) {
+		uint32_t duration = 0;
+		for (int i = 0; i < rcase->voices; i++) {
+			uint32_t d = adsr_duration(&rcase->voice[i].adsr);
+			if (d > duration)
+				duration = d;
+		}
+		if (duration != ref.len) {
+			printf("FAIL %s: adsr_duration %u, rendered %u\n",
+					rcase->name, duration, ref.len);
+			failures++;
+		}
+	}
+
+	/* Per voice tracks, so a golden failure points at a voice */
+	for (int i = 0; i < rcase->voices; i++) {
+		char track[8];
+		struct regress_buf_t solo = { 0 };
+		snprintf(track, sizeof(track), "v%d", i);
+		engines[0].render(rcase, solo_mask(i), &solo);
+		golden_check(rcase->name, track, &solo);
+		buf_free(&solo);
+	}
+
+	for (int e = 1; e < (int)ENGINE_COUNT; e++) {
+		struct regress_buf_t out = { 0 };
+		if (engines[e].render(rcase, solo_mask(-1), &out)) {
+			buf_free(&out);
+			continue;
+		}
+		uint32_t at = first_divergence(&ref, &out);
+		if (at != UINT32_MAX) {
+			printf("FAIL %s %s: diverges at sample %u "
+					"(%u vs %u samples)", engines[e].name,
+					rcase->name, at, ref.len, out.len);
+			if (at < ref.len && at < out.len)
+				printf(", expected %d got %d",
+						ref.data[at], out.data[at]);
+			int voice = locate_voice(rcase, &engines[e], &at);
+			if (voice < 0)
+				printf(", in the mix\n");
+			else
+				printf(", voice %d from sample %u\n",
+						voice, at);
+			failures++;
+		}
+		buf_free(&out);
+	}
+	buf_free(&ref);
+}
+
+/*!
+ * Reference sequencer compiler: finds the fetch order by running the
+ * synth sample by sample, the way `seq_compile` originally did.
+ */
+static int ref_seq_compile(const struct seq_frame_map_t* map,
+		struct seq_frame_t* out, int max_count) {
+	struct voice_ch_t voice[REGRESS_VOICES];
+	struct poly_synth_t synth;
+	int position[REGRESS_VOICES] = { 0 };
+	int count = 0;
+	regress_synth_init(&synth, voice, 0);
+
+	do {
+		if (count)
+			poly_synth_next(&synth);
+
+		/* Feed the first free voice, one frame per sample */
+		uintptr_t mask = 1;
+		int voice_idx = 0;
+		for (int i = 0; i < map->channel_count; i++) {
+			const struct seq_frame_list_t* channel = &map->channels[i];
+			if (channel->count <= 0)
+				continue;
+			if (position[voice_idx] < channel->count
+					&& !(synth.enable & mask)) {
+				struct seq_frame_t* frame = &channel->frames[
+					position[voice_idx]++];
+				voice_wf_set(&voice[voice_idx].wf,
+						&frame->waveform_def);
+				adsr_config(&voice[voice_idx].adsr,
+						&frame->adsr_def);
+				synth.enable |= mask;
+				if (count < max_count)
+					out[count] = *frame;
+				count++;
+				break;
+			}
+			mask <<= 1;
+			voice_idx++;
+		}
+	} while (synth.enable);
+	return count;
+}
+
+/*! Compare two frames, field by field: padding is undefined */
+static int frame_equal(const struct seq_frame_t* a, const struct seq_frame_t* b) {
+	return a->adsr_def.time_scale == b->adsr_def.time_scale
+		&& a->adsr_def.delay_time == b->adsr_def.delay_time
+		&& a->adsr_def.attack_time == b->adsr_def.attack_time
+		&& a->adsr_def.decay_time == b->adsr_def.decay_time
+		&& a->adsr_def.sustain_time == b->adsr_def.sustain_time
+		&& a->adsr_def.release_time == b->adsr_def.release_time
+		&& a->adsr_def.peak_amp == b->adsr_def.peak_amp
+		&& a->adsr_def.sustain_amp == b->adsr_def.sustain_amp
+		&& a->waveform_def.mode == b->waveform_def.mode
+		&& a->waveform_def.amplitude == b->waveform_def.amplitude
+		&& a->waveform_def.period == b->waveform_def.period;
+}
+
+/*! Compare a compiled frame stream with the case one */
+static void compare_frames(const struct regress_case_t* rcase,
+		const char* compiler, const struct seq_frame_t* frames,
+		int count) {
+	int len = (count < rcase->frame_count) ? count : rcase->frame_count;
+	for (int i = 0; i < len; i++) {
+		if (!frame_equal(&frames[i], &rcase->frames[i])) {
+			printf("FAIL %s %s: diverges at frame %d\n",
+					compiler, rcase->name, i);
+			failures++;
+			return;
+		}
+	}
+	if (count != rcase->frame_count) {
+		printf("FAIL %s %s: %d frames, expected %d\n", compiler,
+				rcase->name, count, rcase->frame_count);
+		failures++;
+	}
+}
+
+/*! Frame sink handler, checking the output size */
+static int regress_write_frame(void* user, const struct seq_frame_t* frame) {
+	struct regress_case_t* rcase = user;
+	if (rcase->frame_count >= REGRESS_MAX_FRAMES)
+		return 1;
+	rcase->frames[rcase->frame_count++] = *frame;
+	return 0;
+}
+
+/*!
+ * Check `seq_compile` against the reference compiler, and the streaming
+ * compiler fed by the MML channel sources.
+ */
+static void check_compile(const struct regress_case_t* rcase,
+		const struct seq_frame_map_t* map, const char* content) {
+	struct regress_case_t* out = malloc(sizeof(struct regress_case_t));
+	out->frames = malloc(sizeof(struct seq_frame_t) * REGRESS_MAX_FRAMES);
+	out->frame_count = ref_seq_compile(map, out->frames,
+			REGRESS_MAX_FRAMES);
+	compare_frames(rcase, "compile", out->frames, out->frame_count);
+
+	struct mml_compiler_t* compiler = malloc(sizeof(struct mml_compiler_t));
+	struct seq_frame_sink_t sink = { regress_write_frame, out };
+	int frame_count;
+	int voice_count;
+	mml_compiler_init(compiler, content, NULL, NULL);
+	int channels = mml_compiler_open_channels(compiler);
+	out->frame_count = 0;
+	if (channels < 0 || seq_compile_stream(compiler->channels, channels,
+				&sink, &frame_count, &voice_count)) {
+		printf("FAIL stream %s: compilation failed\n", rcase->name);
+		failures++;
+	} else {
+		compare_frames(rcase, "stream", out->frames, frame_count);
+		if (voice_count != rcase->voices) {
+			printf("FAIL stream %s: %d voices, expected %d\n",
+					rcase->name, voice_count, rcase->voices);
+			failures++;
+		}
+	}
+	free(compiler);
+	free(out->frames);
+	free(out);
+}
+
+/*! First error reported by a MML compiler */
+struct regress_mml_error_t {
+	const char* err;
+	int line;
+	int column;
+	/* Errors reported */
+	int count;
+};
+
+static void regress_keep_error(void* user, const char* err, int line,
+		int column) {
+	struct regress_mml_error_t* error = user;
+	error->count++;
+	if (!error->err) {
+		error->err = err;
+		error->line = line;
+		error->column = column;
+	}
+}
+
+/*! Compare two frame maps, channel by channel */
+static int map_equal(const struct seq_frame_map_t* a,
+		const struct seq_frame_map_t* b) {
+	int same = (a->channel_count == b->channel_count);
+	for (int c = 0; same && c < a->channel_count; c++) {
+		same = (a->channels[c].count == b->channels[c].count);
+		for (int f = 0; same && f < a->channels[c].count; f++)
+			same = frame_equal(&a->channels[c].frames[f],
+					&b->channels[c].frames[f]);
+	}
+	return same;
+}
+
+/*! Compile a MML content, serially if `chunks` is zero, keeping its error */
+static int regress_mml_compile(const char* content, int chunks,
+		struct seq_frame_map_t* map, struct regress_mml_error_t* error) {
+	struct mml_compiler_t* compiler = malloc(sizeof(struct mml_compiler_t));
+	memset(error, 0, sizeof(struct regress_mml_error_t));
+	mml_compiler_init(compiler, content, regress_keep_error, error);
+	int err = chunks ? mml_compiler_compile_split(compiler, map, &sched, chunks)
+		: mml_compiler_compile(compiler, map);
+	free(compiler);
+	return err;
+}
+
+/*!
+ * Compile a MML content split in `chunks`, the frame map (or the error)
+ * must be the same as the serial one.
+ */
+static void check_split_content(const char* name, const char* content,
+		int chunks) {
+	struct seq_frame_map_t ref;
+	struct seq_frame_map_t out;
+	struct regress_mml_error_t ref_error;
+	struct regress_mml_error_t out_error;
+	int ref_err = regress_mml_compile(content, 0, &ref, &ref_error);
+	int out_err = regress_mml_compile(content, chunks, &out, &out_error);
+
+	int same = (ref_err == out_err);
+	if (same && ref_err) {
+		same = (ref_error.err == out_error.err)
+			&& (ref_error.line == out_error.line)
+			&& (ref_error.column == out_error.column);
+	} else if (same) {
+		same = map_equal(&ref, &out);
+	}
+	if (!same) {
+		printf("FAIL split %s: %d chunks differ from the serial "
+				"parse\n", name, chunks);
+		failures++;
+	}
+
+	/* A valid content is never parsed serially: no chunk cuts a loop */
+	struct mml_chunk_t* split = malloc(sizeof(struct mml_chunk_t) * chunks);
+	int count = ref_err ? 0 : mml_split(content, split, chunks);
+	for (int i = 0; i < count; i++) {
+		mml_chunk_scan(&split[i]);
+		if (split[i].loop_cut) {
+			printf("FAIL split %s: %d chunks cut a loop\n", name,
+					chunks);
+			failures++;
+			break;
+		}
+	}
+	free(split);
+	/* The frames parsed before an error are kept too */
+	mml_free(&ref);
+	mml_free(&out);
+}
+
+/*! Contents whose channel states carry over many lines, or with errors */
+static const char* const split_contents[] = {
+	"t150 l8 o5\nc d e\n<c>c\nBC v40 ms\nB wt l4. c\nC > d\n"
+		"# comment\nA r2\nABC c+ d- n33\n; another\nC mn ww e8.\n",
+	"A o3 c\r\nB o2 d\r\nAB e\r\n\r\nB < c\r\nA > c\r\n",
+	"l\n8 c\nd e\nt\n 90 f\ng\n",
+	"c d e\nf g\na b\no7 c\nd\n",
+	"o0\nc\nd\n<c\ne\n",
+	"D c\nA d\nD o2 e\nc\nD f\n",
+	"o6 c\n<c\n<< d\n> e\n<<< f\nB < c\nA >> g\n",
+	"t150 [c d\ne > f]3\ng\nAB [a\n[b <\nB c]2\n]2 d\n; [\nc# [e]\n",
+	"c\nd [e\nf]\n]\ng\n",
+	"c\n[d\ne\n",
+	"c4# [d\ne\nf]2\ng\n[a\nb]\n",
+	"c8.# [d\ne]2\nr# [\nn40# ]\nf+4# [g\n]\n",
+	"c\nd A e\nf\n",
+	"c \xc3\xa9 d\na- e\nt +90 f\nc n\ng\n",
+	"",
+};
+
+static void check_split(void) {
+	for (int i = 0; i < (int)(sizeof(split_contents)
+				/ sizeof(split_contents[0])); i++) {
+		char name[16];
+		snprintf(name, sizeof(name), "content%d", i);
+		for (int chunks = 1; chunks <= 12; chunks++)
+			check_split_content(name, split_contents[i], chunks);
+	}
+}
+
+static struct regress_case_t* add_case(void) {
+	cases = realloc(cases, sizeof(struct regress_case_t) * (case_count + 1));
+	struct regress_case_t* rcase = &cases[case_count++];
+	memset(rcase, 0, sizeof(struct regress_case_t));
+	return rcase;
+}
+
+static void mml_error(void* user, const char* err, int line, int column) {
+	fprintf(stderr, "Error reading MML file %s: %s at line %d, pos %d\n",
+			(const char*)user, err, line, column);
+}
+
+static int add_song(const char* path) {
+	FILE* fp = fopen(path, "r");
+	if (!fp) {
+		fprintf(stderr, "Cannot read MML file %s\n", path);
+		return 1;
+	}
+	fseek(fp, 0, SEEK_END);
+	long size = ftell(fp);
+	char* content = malloc(size + 1);
+	fseek(fp, 0, SEEK_SET);
+	content[fread(content, 1, size, fp)] = 0;
+	fclose(fp);
+
+	struct seq_frame_map_t map;
+	struct mml_compiler_t* compiler = malloc(sizeof(struct mml_compiler_t));
+	mml_compiler_init(compiler, content, mml_error, (void*)path);
+	int err = mml_compiler_compile(compiler, &map);
+	free(compiler);
+	if (err) {
+		fprintf(stderr, "Cannot compile MML file %s\n", path);
+		free(content);
+		return err;
+	}
+
+	struct regress_case_t* rcase = add_case();
+	const char* base = strrchr(path, '/');
+	snprintf(rcase->name, sizeof(rcase->name), "song/%s",
+			base ? base + 1 : path);
+
+	int voice_count;
+	seq_compile(&map, &rcase->frames, &rcase->frame_count, &voice_count);
+	rcase->voices = voice_count;
+	check_compile(rcase, &map, content);
+	mml_free(&map);
+
+	/* Split in a few chunks, or in about a line each */
+	const int split_chunks[] = { 2, 3, 8, 1000 };
+	for (int i = 0; i < (int)(sizeof(split_chunks)
+				/ sizeof(split_chunks[0])); i++)
+		check_split_content(rcase->name, content, split_chunks[i]);
+	free(content);
+	return 0;
+}
+
+/*! Envelopes for the synthetic cases, covering every ADSR phase */
+static const struct adsr_env_def_t synthetic_env[] = {
+	/* Full envelope */
+	{ .time_scale = 40, .delay_time = 0, .attack_time = 8,
+		.decay_time = 8, .sustain_time = 32, .release_time = 8,
+		.peak_amp = 255, .sustain_amp = 192 },
+	/* Delayed, no decay */
+	{ .time_scale = 25, .delay_time = 10, .attack_time = 4,
+		.decay_time = 0, .sustain_time = 20, .release_time = 16,
+		.peak_amp = 127, .sustain_amp = 100 },
+	/* Percussive: decay to silence, no sustain nor release */
+	{ .time_scale = 64, .delay_time = 0, .attack_time = 0,
+		.decay_time = 16, .sustain_time = 0, .release_time = 0,
+		.peak_amp = 200, .sustain_amp = 0 },
+	/* As generated by the MML compiler */
+	{ .time_scale = 125, .delay_time = 0, .attack_time = 12,
+		.decay_time = 12, .sustain_time = 88, .release_time = 16,
+		.peak_amp = 63, .sustain_amp = 40 },
+	/* Time steps shorter than a sample */
+	{ .time_scale = 1, .delay_time = 3, .attack_time = 15,
+		.decay_time = 17, .sustain_time = 200, .release_time = 31,
+		.peak_amp = 255, .sustain_amp = 255 },
+};
+
+#define SYNTHETIC_ENV_COUNT \
+	(sizeof(synthetic_env) / sizeof(struct adsr_env_def_t))
+
+static const uint16_t synthetic_freq[] = { 55, 440, 7000 };
+
+#define SYNTHETIC_FREQ_COUNT	(sizeof(synthetic_freq) / sizeof(uint16_t))
+
+static const char* const mode_name[] = {
+	"dc", "square", "sawtooth", "triangle", "noise"
+};
+
+#define MODE_COUNT	(sizeof(mode_name) / sizeof(const char*))
+
+static void set_voice(struct regress_voice_t* voice, uint8_t mode,
+		uint16_t freq, int8_t amplitude, uint8_t env) {
+	voice->wf.mode = mode;
+	voice->wf.amplitude = amplitude;
+	voice->wf.period = voice_wf_freq_to_period(freq);
+	voice->adsr = synthetic_env[env];
+}
+
+static void add_synthetic(void) {
+	/* Every mode, envelope and frequency on a single voice */
+	for (uint8_t m = 0; m < MODE_COUNT; m++) {
+		for (uint8_t e = 0; e < SYNTHETIC_ENV_COUNT; e++) {
+			for (uint8_t f = 0; f < SYNTHETIC_FREQ_COUNT; f++) {
+				struct regress_case_t* rcase = add_case();
+				snprintf(rcase->name, sizeof(rcase->name),
+						"syn/%s-%u-env%u", mode_name[m],
+						synthetic_freq[f], e);
+				rcase->voices = 1;
+				set_voice(&rcase->voice[0], m,
+						synthetic_freq[f], 127, e);
+			}
+		}
+	}
+
+	/* Every mode at once, with clipping on the loud envelopes */
+	for (uint8_t e = 0; e < SYNTHETIC_ENV_COUNT; e++) {
+		struct regress_case_t* rcase = add_case();
+		snprintf(rcase->name, sizeof(rcase->name), "syn/chord-env%u", e);
+		rcase->voices = MODE_COUNT;
+		for (uint8_t m = 0; m < MODE_COUNT; m++)
+			set_voice(&rcase->voice[m], m, 220 + 110 * m, 127, e);
+	}
+
+	/* All the voices, with staggered envelopes */
+	struct regress_case_t* rcase = add_case();
+	snprintf(rcase->name, sizeof(rcase->name), "syn/all-voices");
+	rcase->voices = REGRESS_VOICES;
+	for (uint8_t i = 0; i < REGRESS_VOICES; i++) {
+		set_voice(&rcase->voice[i], 1 + (i % 3), 110 + 55 * i,
+				31 + 6 * i, i % SYNTHETIC_ENV_COUNT);
+		rcase->voice[i].adsr.delay_time += i;
+	}
+}
+
+/*! A song rendered by the concurrency check */
+struct regress_job_t {
+	struct voice_ch_t voice[REGRESS_VOICES];
+	struct poly_synth_t synth;
+	struct regress_cursor_t cursor;
+	struct seq_player_t player;
+	struct sched_task_t task;
+	struct regress_buf_t out;
+	uint8_t done;
+};
+
+/*!
+ * Render all the songs at once on the scheduler, reading the tasks in
+ * turn, and compare them with the reference.  The songs don't use the
+ * noise waveform, so the shared `rand()` state doesn't matter.
+ */
+static void check_sched_concurrent(void) {
+	struct regress_job_t* jobs = calloc(case_count,
+			sizeof(struct regress_job_t));
+	int running = 0;
+	for (int i = 0; i < case_count; i++) {
+		struct regress_job_t* job = &jobs[i];
+		job->done = 1;
+		if (!cases[i].frames)
+			continue;
+		job->synth.voice = job->voice;
+		if (regress_player_init(&cases[i], &job->player, &job->cursor,
+					&job->synth))
+			continue;
+		sched_task_init(&job->task, &job->synth, &job->player);
+		sched_submit(&sched, &job->task);
+		job->done = 0;
+		running++;
+	}
+
+	int8_t samples[SCHED_BLOCK_SAMPLES];
+	while (running) {
+		for (int i = 0; i < case_count; i++) {
+			struct regress_job_t* job = &jobs[i];
+			if (job->done)
+				continue;
+			uint16_t len = sched_task_read(&job->task, samples);
+			for (uint16_t j = 0; j < len; j++)
+				buf_push(&job->out, samples[j]);
+			if (!len) {
+				job->done = 1;
+				running--;
+			}
+		}
+	}
+
+	for (int i = 0; i < case_count; i++) {
+		struct regress_job_t* job = &jobs[i];
+		if (!cases[i].frames)
+			continue;
+		struct regress_buf_t ref = { 0 };
+		engines[0].render(&cases[i], solo_mask(-1), &ref);
+		uint32_t at = first_divergence(&ref, &job->out);
+		if (at != UINT32_MAX) {
+			printf("FAIL sched concurrent %s: diverges at "
+					"sample %u\n", cases[i].name, at);
+			failures++;
+		}
+		sched_task_destroy(&job->task);
+		buf_free(&job->out);
+		buf_free(&ref);
+	}
+	free(jobs);
+}
+
+/*! Sound effect of the layer check: a single note */
+static const struct seq_frame_t layer_effect = {
+	.adsr_def = { .time_scale = 40, .delay_time = 0, .attack_time = 4,
+		.decay_time = 4, .sustain_time = 64, .release_time = 8,
+		.peak_amp = 255, .sustain_amp = 200 },
+	.waveform_def = { .mode = VOICE_MODE_SQUARE, .amplitude = 100,
+		.period = 1000 },
+};
+
+/*!
+ * Render a song with `layer_effect` over its first voice, from sample
+ * `start`.
+ */
+static void render_with_effect(const struct regress_case_t* rcase,
+		uintptr_t mute, uint32_t start, struct regress_buf_t* out) {
+	struct voice_ch_t voice[REGRESS_VOICES];
+	struct poly_synth_t synth;
+	struct regress_cursor_t cursor;
+	struct seq_player_t music;
+	struct seq_player_t effects;
+	regress_synth_init(&synth, voice, mute);
+	regress_player_init(rcase, &music, &cursor, &synth);
+	music.above = &effects;
+
+	/* Nothing to play until the start of the effect */
+	struct seq_stream_header_t header;
+	header.synth_frequency = synth_freq;
+	header.voices = 1;
+	header.frames = 1;
+	struct regress_cursor_t effect = { &layer_effect, &layer_effect };
+	struct seq_frame_source_t source = { regress_read_cursor, &effect };
+	seq_player_init_layer(&effects, &header, REGRESS_VOICES, &synth,
+			&source, 0, NULL);
+
+	/* Skipped frames can leave the synth idle for a while */
+	seq_player_feed(&music);
+	while ((synth.enable || music.next_due != UINT32_MAX)
+			&& (out->len < REGRESS_MAX_SAMPLES)) {
+		buf_push(out, poly_synth_next(&synth));
+		if (out->len == start) {
+			effect.end = &layer_effect + 1;
+			seq_player_init_layer(&effects, &header,
+					REGRESS_VOICES, &synth, &source,
+					0, NULL);
+		}
+		seq_player_feed(&effects);
+		seq_player_feed(&music);
+	}
+}
+
+/*!
+ * Play a sound effect over every song, on its first voice, a quarter of
+ * the way in.  The song must be untouched before, the voice must play
+ * only the effect during it, and the song must play on that voice again,
+ * with the same timing, after it.
+ */
+static void check_layers(void) {
+	struct regress_case_t effect_case;
+	memset(&effect_case, 0, sizeof(effect_case));
+	effect_case.voices = 1;
+	effect_case.voice[0].wf = layer_effect.waveform_def;
+	effect_case.voice[0].adsr = layer_effect.adsr_def;
+	struct regress_buf_t effect = { 0 };
+	engines[0].render(&effect_case, solo_mask(-1), &effect);
+
+	for (int i = 0; i < case_count; i++) {
+		const struct regress_case_t* rcase = &cases[i];
+		if (!rcase->frames)
+			continue;
+
+		/* The longest note of the song */
+		uint32_t note_len = 0;
+		for (int f = 0; f < rcase->frame_count; f++) {
+			uint32_t d = adsr_duration(&rcase->frames[f].adsr_def);
+			if (d > note_len)
+				note_len = d;
+		}
+
+		struct regress_buf_t ref = { 0 };
+		struct regress_buf_t out = { 0 };
+		struct regress_buf_t solo = { 0 };
+		engines[0].render(rcase, solo_mask(-1), &ref);
+		uint32_t start = ref.len / 4;
+		render_with_effect(rcase, solo_mask(-1), start, &out);
+		render_with_effect(rcase, solo_mask(0), start, &solo);
+
+		uint32_t at = first_divergence(&ref, &out);
+		uint32_t last = 0;
+		uint32_t len = (ref.len < out.len) ? ref.len : out.len;
+		for (uint32_t s = at; s < len; s++)
+			if (ref.data[s] != out.data[s])
+				last = s;
+		if (out.len != ref.len || at < start || at == UINT32_MAX
+				|| last >= start + effect.len + note_len) {
+			printf("FAIL layers %s: diverges in samples %u-%u "
+					"(%u vs %u samples)\n", rcase->name,
+					at, last, ref.len, out.len);
+			failures++;
+		} else if (solo.len < start + effect.len
+				|| memcmp(solo.data + start, effect.data,
+					effect.len)) {
+			printf("FAIL layers %s: the effect is not alone on "
+					"its voice\n", rcase->name);
+			failures++;
+		}
+		buf_free(&ref);
+		buf_free(&out);
+		buf_free(&solo);
+	}
+	buf_free(&effect);
+}
+
+/*!
+ * Render frames with a player told that they were compiled for
+ * `stream_freq`, at the given tempo.  Returns the retiming error.
+ */
+static uint32_t render_retimed(const struct regress_case_t* rcase,
+		const struct seq_frame_t* frames, uint16_t stream_freq,
+		uint16_t tempo, struct regress_buf_t* out) {
+	struct voice_ch_t voice[REGRESS_VOICES];
+	struct poly_synth_t synth;
+	regress_synth_init(&synth, voice, 0);
+
+	struct seq_stream_header_t header;
+	header.synth_frequency = stream_freq;
+	header.voices = rcase->voices;
+	header.frames = rcase->frame_count;
+	struct regress_cursor_t cursor = {
+		frames, frames + rcase->frame_count
+	};
+	struct seq_frame_source_t source = { regress_read_cursor, &cursor };
+	struct seq_player_t player;
+	seq_player_init(&player, &header, REGRESS_VOICES, &synth, &source);
+	seq_player_set_tempo(&player, tempo);
+
+	seq_player_feed(&player);
+	while (synth.enable && (out->len < REGRESS_MAX_SAMPLES)) {
+		buf_push(out, poly_synth_next(&synth));
+		seq_player_feed(&player);
+	}
+	return player.retime_error;
+}
+
+/*! Samples between two keyframes of the seek check, a few per song */
+#define REGRESS_KEYFRAME_INTERVAL	(5000)
+
+/*! Case of the seek check, the cursor only knows its position */
+static const struct regress_case_t* seek_case;
+
+/*! Rewind handler of the seek check, the cursor moves to any frame */
+static int regress_seek_cursor(void* user, uint32_t frame) {
+	const struct regress_case_t* rcase = seek_case;
+	struct regress_cursor_t* cursor = user;
+	if (frame > (uint32_t)rcase->frame_count)
+		return 1;
+	cursor->pos = rcase->frames + frame;
+	return 0;
+}
+
+/*!
+ * Seek every song to a few samples, on a keyframe and in between: the
+ * rest of the song must be the same as when played from the start.
+ * Songs with noise are skipped, the noise is not replayed.
+ */
+static void check_seek(void) {
+	for (int i = 0; i < case_count; i++) {
+		const struct regress_case_t* rcase = &cases[i];
+		if (!rcase->frames || regress_has_noise(rcase))
+			continue;
+		seek_case = rcase;
+
+		struct regress_buf_t ref = { 0 };
+		engines[0].render(rcase, solo_mask(-1), &ref);
+
+		struct seq_stream_header_t header;
+		header.synth_frequency = synth_freq;
+		header.voices = rcase->voices;
+		header.frames = rcase->frame_count;
+		struct regress_cursor_t cursor = { rcase->frames,
+			rcase->frames + rcase->frame_count };
+		struct seq_frame_source_t source = { regress_read_cursor,
+			&cursor };
+		struct seq_keyframe_list_t keyframes;
+		if (seq_compile_keyframes(&header, &source, SEQ_TEMPO_NORMAL,
+					REGRESS_KEYFRAME_INTERVAL,
+					&keyframes)) {
+			printf("FAIL seek %s: no keyframes\n", rcase->name);
+			failures++;
+			buf_free(&ref);
+			continue;
+		}
+
+		uint32_t targets[] = { 0, REGRESS_KEYFRAME_INTERVAL,
+			ref.len / 3, ref.len / 2 + 17, ref.len - 1 };
+		for (int t = 0; t < (int)(sizeof(targets) / sizeof(targets[0]));
+				t++) {
+			uint32_t target = targets[t];
+			if (target >= ref.len)
+				continue;
+
+			struct voice_ch_t voice[REGRESS_VOICES];
+			struct poly_synth_t synth;
+			struct seq_player_t player;
+			struct regress_buf_t out = { 0 };
+			regress_synth_init(&synth, voice, 0);
+			regress_player_init(rcase, &player, &cursor, &synth);
+			seq_player_seek(&player, &keyframes, target,
+					regress_seek_cursor, &cursor);
+
+			/* Same safety limit as the reference */
+			seq_player_feed(&player);
+			while (synth.enable && (out.len
+						< REGRESS_MAX_SAMPLES - target)) {
+				buf_push(&out, poly_synth_next(&synth));
+				seq_player_feed(&player);
+			}
+			if ((out.len != ref.len - target)
+					|| memcmp(out.data, ref.data + target,
+						out.len)) {
+				printf("FAIL seek %s: from sample %u\n",
+						rcase->name, target);
+				failures++;
+			}
+			buf_free(&out);
+		}
+		seq_keyframes_free(&keyframes);
+		buf_free(&ref);
+	}
+}
+
+/*!
+ * Every chunk of a version 3 stream must match its index entry, and
+ * decoding from it must give the same frames as decoding from the start.
+ */
+static void check_chunks(void) {
+	for (int i = 0; i < case_count; i++) {
+		const struct regress_case_t* rcase = &cases[i];
+		struct regress_buf_t packed = { 0 };
+		if (!rcase->frames || regress_pack(rcase,
+					SEQ_PACK_VERSION_CHUNKED, &packed)) {
+			buf_free(&packed);
+			continue;
+		}
+
+		const uint8_t* data = (const uint8_t*)packed.data;
+		const uint8_t* pos = data;
+		struct seq_stream_header_t header;
+		struct seq_pack_decoder_t decoder;
+		seq_pack_decoder_init(&decoder, seq_pack_read_rom, &pos,
+				&header);
+		uint32_t chunks = decoder.chunking.chunks;
+		for (uint32_t c = 0; c < chunks; c++) {
+			struct seq_pack_chunk_t chunk;
+			seq_pack_chunk_decode(&chunk, data
+					+ decoder.chunking.index_offset
+					+ c * SEQ_PACK_CHUNK_SIZE);
+			if (seq_pack_hash(SEQ_PACK_HASH_INIT,
+						data + chunk.offset,
+						chunk.size) != chunk.hash) {
+				printf("FAIL chunks %s: chunk %u hash\n",
+						rcase->name, c);
+				failures++;
+				break;
+			}
+
+			/* Seek backwards, the last chunk first */
+			uint32_t seek = chunks - 1 - c;
+			seq_pack_chunk_decode(&chunk, data
+					+ decoder.chunking.index_offset
+					+ seek * SEQ_PACK_CHUNK_SIZE);
+			pos = data + chunk.offset;
+			seq_pack_decoder_seek_chunk(&decoder, seek,
+					chunk.offset);
+			int f = seek * REGRESS_CHUNK_FRAMES;
+			struct seq_frame_t frame;
+			while (seq_pack_read_frame(&decoder, &frame)) {
+				if (!frame_equal(&frame, &rcase->frames[f++])) {
+					printf("FAIL chunks %s: frame %d from "
+							"chunk %u\n",
+							rcase->name, f - 1,
+							seek);
+					failures++;
+					c = chunks;
+					break;
+				}
+			}
+		}
+		if (chunks != (uint32_t)(rcase->frame_count
+					+ REGRESS_CHUNK_FRAMES - 1)
+				/ REGRESS_CHUNK_FRAMES
+				|| seq_pack_decoder_seek_chunk(&decoder, chunks, 0) == 0) {
+			printf("FAIL chunks %s: %u chunks\n", rcase->name,
+					chunks);
+			failures++;
+		}
+		buf_free(&packed);
+	}
+}
+
+/*!
+ * Store the compact stream of every song in a cache directory, keyed on
+ * its name, and map it back.  The keys must change with the options.
+ */
+static void check_cache(void) {
+	char dir[] = "/tmp/regress-cacheXXXXXX";
+	if (!mkdtemp(dir)) {
+		printf("FAIL cache: cannot create %s\n", dir);
+		failures++;
+		return;
+	}
+	char* name = malloc(strlen(dir) + 8);
+	sprintf(name, "%s/stream", dir);
+
+	for (int i = 0; i < case_count; i++) {
+		const struct regress_case_t* rcase = &cases[i];
+		struct regress_buf_t packed = { 0 };
+		if (!rcase->frames || regress_pack(rcase,
+					SEQ_PACK_VERSION_CHUNKED, &packed)) {
+			buf_free(&packed);
+			continue;
+		}
+
+		size_t len = strlen(rcase->name);
+		uint64_t key = seq_cache_key(rcase->name, len, 0);
+		struct seq_cache_entry_t entry;
+		if (key == seq_cache_key(rcase->name, len, 1)
+				|| key == seq_cache_key(rcase->name, len - 1, 0)) {
+			printf("FAIL cache %s: same key\n", rcase->name);
+			failures++;
+		} else if (!seq_cache_open(dir, key, &entry)) {
+			printf("FAIL cache %s: found before stored\n",
+					rcase->name);
+			failures++;
+			seq_cache_close(&entry);
+		} else {
+			FILE* fp = fopen(name, "wb");
+			int err = !fp || fwrite(packed.data, 1, packed.len, fp)
+				!= packed.len;
+			if (fp && fclose(fp))
+				err = 1;
+			err = err || seq_cache_store(dir, key, name)
+				|| seq_cache_open(dir, key, &entry);
+			if (err || entry.size != packed.len
+					|| memcmp(entry.data, packed.data,
+						packed.len)) {
+				printf("FAIL cache %s: stream not stored\n",
+						rcase->name);
+				failures++;
+			}
+			if (!err)
+				seq_cache_close(&entry);
+			unlink(name);
+		}
+
+		char* path = seq_cache_path(dir, key);
+		unlink(path);
+		free(path);
+		buf_free(&packed);
+	}
+	free(name);
+	rmdir(dir);
+}
+
+/*!
+ * Decode a version 3 stream from the start, then from every chunk: the
+ * frames must be `frames`.  Returns non-zero if not.
+ */
+static int regress_unpack_all(const struct regress_buf_t* packed,
+		const struct seq_frame_t* frames, uint32_t count) {
+	const uint8_t* data = (const uint8_t*)packed->data;
+	const uint8_t* pos = data;
+	struct seq_stream_header_t header;
+	struct seq_pack_decoder_t decoder;
+	if (seq_pack_decoder_init(&decoder, seq_pack_read_rom, &pos, &header)
+			|| header.frames != count)
+		return 1;
+	seq_pack_decoder_set_rewind(&decoder, seq_pack_rewind_rom);
+
+	for (uint32_t c = 0; c <= decoder.chunking.chunks; c++) {
+		uint32_t f = 0;
+		if (c) {
+			struct seq_pack_chunk_t chunk;
+			seq_pack_chunk_decode(&chunk, data
+					+ decoder.chunking.index_offset
+					+ (c - 1) * SEQ_PACK_CHUNK_SIZE);
+			pos = data + chunk.offset;
+			seq_pack_decoder_seek_chunk(&decoder, c - 1,
+					chunk.offset);
+			f = (c - 1) * decoder.chunking.chunk_frames;
+		}
+		struct seq_frame_t frame;
+		while (seq_pack_read_frame(&decoder, &frame)) {
+			if (f >= count || !frame_equal(&frame, &frames[f++]))
+				return 1;
+		}
+		if (f != count)
+			return 1;
+	}
+	return 0;
+}
+
+/*! Nested repeats: ((a b) x4, c) x4, then d and e */
+#define REGRESS_LOOP_FRAMES	(38)
+
+static void loop_frames(struct seq_frame_t* frames) {
+	memset(frames, 0, sizeof(struct seq_frame_t) * REGRESS_LOOP_FRAMES);
+	for (int i = 0; i < REGRESS_LOOP_FRAMES; i++) {
+		int note = (i < 36) ? ((i % 9 == 8) ? 2 : (i % 9) % 2)
+			: (i - 33);
+		frames[i].waveform_def.mode = VOICE_MODE_SQUARE;
+		frames[i].waveform_def.amplitude = 63;
+		frames[i].waveform_def.period = 40 + 7 * note;
+		frames[i].adsr_def.time_scale = 100 + note;
+		frames[i].adsr_def.attack_time = 4;
+		frames[i].adsr_def.sustain_time = 20;
+		frames[i].adsr_def.peak_amp = 63;
+	}
+}
+
+/*!
+ * Streams with loops must decode to the same frames, from the start and
+ * from any chunk, with both frame codings.  Without rewind a stream ends
+ * at its first loop end, and a repeated stream starts again.
+ */
+static void check_loops(void) {
+	struct seq_frame_t frames[REGRESS_LOOP_FRAMES];
+	struct seq_instrument_table_t instruments;
+	loop_frames(frames);
+	instruments.count = 0;
+	for (int i = 0; i < REGRESS_LOOP_FRAMES; i++)
+		seq_pack_add_instrument(&instruments, &frames[i]);
+
+	static const uint16_t chunk_frames[] = { 5, 7, 14, 64 };
+	uint32_t plain_len = 0;
+	for (int c = 0; c < (int)(sizeof(chunk_frames) / sizeof(uint16_t));
+			c++) {
+		for (uint8_t depth = 0; depth <= SEQ_PACK_MAX_LOOPS; depth++) {
+			for (int coding = 0; coding < 2; coding++) {
+				struct regress_buf_t packed = { 0 };
+				regress_pack_frames(frames, REGRESS_LOOP_FRAMES,
+						1, coding ? &instruments : NULL,
+						chunk_frames[c], depth, 0,
+						&packed);
+				if (!depth && chunk_frames[c] == 64 && coding)
+					plain_len = packed.len;
+				if (depth && chunk_frames[c] == 64 && coding
+						&& packed.len >= plain_len) {
+					printf("FAIL loops: %u bytes with %d "
+							"levels, %u without\n",
+							packed.len, depth,
+							plain_len);
+					failures++;
+				}
+				if (regress_unpack_all(&packed, frames,
+							REGRESS_LOOP_FRAMES)) {
+					printf("FAIL loops: chunks of %d, %d "
+							"levels, coding %d\n",
+							chunk_frames[c], depth,
+							coding + 1);
+					failures++;
+				}
+				buf_free(&packed);
+			}
+		}
+	}
+
+	/* No rewind: the first loop end is the end */
+	struct regress_buf_t packed = { 0 };
+	regress_pack_frames(frames, REGRESS_LOOP_FRAMES, 1, &instruments, 64,
+			SEQ_PACK_MAX_LOOPS, 0, &packed);
+	const uint8_t* pos = (const uint8_t*)packed.data;
+	struct seq_stream_header_t header;
+	struct seq_pack_decoder_t decoder;
+	struct seq_frame_t frame;
+	int count = 0;
+	seq_pack_decoder_init(&decoder, seq_pack_read_rom, &pos, &header);
+	while (seq_pack_read_frame(&decoder, &frame)
+			&& frame_equal(&frame, &frames[count]))
+		count++;
+	if (count != 2) {
+		printf("FAIL loops: %d frames without rewind\n", count);
+		failures++;
+	}
+	buf_free(&packed);
+
+	/* Repeated, three times over */
+	packed = (struct regress_buf_t){ 0 };
+	regress_pack_frames(frames, REGRESS_LOOP_FRAMES, 1, &instruments, 14,
+			SEQ_PACK_MAX_LOOPS, SEQ_PACK_FLAG_REPEAT, &packed);
+	pos = (const uint8_t*)packed.data;
+	seq_pack_decoder_init(&decoder, seq_pack_read_rom, &pos, &header);
+	seq_pack_decoder_set_rewind(&decoder, seq_pack_rewind_rom);
+	for (count = 0; count < 3 * REGRESS_LOOP_FRAMES; count++) {
+		if (!seq_pack_read_frame(&decoder, &frame) || !frame_equal(
+					&frame, &frames[count
+					% REGRESS_LOOP_FRAMES]))
+			break;
+	}
+	if (count != 3 * REGRESS_LOOP_FRAMES) {
+		printf("FAIL loops: repeated stream ends at frame %d\n",
+				count);
+		failures++;
+	}
+	buf_free(&packed);
+
+	/* Every song, from any chunk */
+	for (int i = 0; i < case_count; i++) {
+		const struct regress_case_t* rcase = &cases[i];
+		for (int coding = 0; rcase->frames && coding < 2; coding++) {
+			packed = (struct regress_buf_t){ 0 };
+			if (!regress_pack_loops(rcase, coding
+						? SEQ_PACK_VERSION_CHUNKED
+						: SEQ_PACK_VERSION, 0, &packed)
+					&& !coding) {
+				/* Version 1 coding in version 3 */
+				buf_free(&packed);
+				regress_pack_frames(rcase->frames,
+						rcase->frame_count,
+						rcase->voices, NULL,
+						REGRESS_LOOP_CHUNK_FRAMES,
+						SEQ_PACK_MAX_LOOPS, 0,
+						&packed);
+			} else if (coding) {
+				buf_free(&packed);
+				if (regress_pack_loops(rcase,
+							SEQ_PACK_VERSION_CHUNKED,
+							SEQ_PACK_MAX_LOOPS,
+							&packed)) {
+					buf_free(&packed);
+					continue;
+				}
+			}
+			if (regress_unpack_all(&packed, rcase->frames,
+						rcase->frame_count)) {
+				printf("FAIL loops %s: coding %d\n",
+						rcase->name, coding + 1);
+				failures++;
+			}
+			buf_free(&packed);
+		}
+	}
+}
+
+/*! MML loops, and their unrolled content */
+static const char* const mml_loops[][2] = {
+	{ "l8 [c d]3 e", "l8 c d c d c d e" },
+	{ "[c [d e]2 f]2 g", "c d e d e f c d e d e f g" },
+	{ "[c]", "c c" },
+	{ "o2 [c >]3 c", "o2 c > c > c > c" },
+	{ "AB [c\nB d]3\n", "AB c\nB d\nAB c\nB d\nAB c\nB d\n" },
+	{ "[c ]12 d", "c c c c c c c c c c c c d" },
+};
+
+/*! Contents with loop errors, and the error expected */
+static const char* const mml_loop_errors[][2] = {
+	{ "c [d e", "Unterminated loop" },
+	{ "c d] e", "Unmatched loop end" },
+	{ "[c]0", "Invalid loop count" },
+	{ "[[[[[[[[[c]]]]]]]]]", "Too many nested loops" },
+};
+
+/*! MML loops against their unrolled contents, and the gapless repeats */
+static void check_mml_loops(void) {
+	for (int i = 0; i < (int)(sizeof(mml_loops) / sizeof(mml_loops[0]));
+			i++) {
+		struct seq_frame_map_t map;
+		struct seq_frame_map_t ref;
+		struct regress_mml_error_t error;
+		int err = regress_mml_compile(mml_loops[i][0], 0, &map, &error);
+		err |= regress_mml_compile(mml_loops[i][1], 0, &ref, &error);
+		if (err || !map_equal(&map, &ref)) {
+			printf("FAIL mml loops: %s\n", mml_loops[i][0]);
+			failures++;
+		}
+		mml_free(&map);
+		mml_free(&ref);
+	}
+
+	for (int i = 0; i < (int)(sizeof(mml_loop_errors)
+				/ sizeof(mml_loop_errors[0])); i++) {
+		struct seq_frame_map_t map;
+		struct regress_mml_error_t error;
+		if (!regress_mml_compile(mml_loop_errors[i][0], 0, &map, &error)
+				|| !error.err
+				|| strcmp(error.err, mml_loop_errors[i][1])) {
+			printf("FAIL mml loops: %s not reported\n",
+					mml_loop_errors[i][1]);
+			failures++;
+		}
+		mml_free(&map);
+	}
+
+	/* Same rhythm on every channel repeats, different lengths don't */
+	static const char* const repeats[] = {
+		"AB l8\nA [c d e f]4\nB [e g a b]4\n",
+		"A c d\nB e\n",
+	};
+	for (int i = 0; i < 2; i++) {
+		struct seq_frame_map_t map;
+		struct regress_mml_error_t error;
+		if (regress_mml_compile(repeats[i], 0, &map, &error)
+				|| seq_frame_map_repeats(&map) != !i) {
+			printf("FAIL mml loops: %s %s\n", repeats[i],
+					i ? "repeats" : "doesn't repeat");
+			failures++;
+		}
+		mml_free(&map);
+	}
+}
+
+/*! MML contents, and the same spelled otherwise */
+static const char* const mml_spellings[][2] = {
+	{ "l 8 c t\t+90 d", "l8 c t90 d" },
+	{ "c \t d|e\r\n", "c d e\n" },
+	{ "c \xc3\xa9 d", "c d" },
+	{ "a- b- d- e- g-", "g+ a+ c+ d+ f+" },
+	{ "n33 n45 n84", "o2 a o3 a o6 > c" },
+	{ "mn c ms d ml e", "c ms d ml e" },
+};
+
+/*! MML contents with errors, and the error expected */
+static const char* const mml_parse_errors[][2] = {
+	{ "c n d", "Invalid note code" },
+	{ "c a-- d", "Invalid sharp" },
+	{ "c x", "Unknown command" },
+	{ "l-4 c", "Invalid length" },
+	{ "c A d", "Misplaced channel selector" },
+	/* Clamped, not truncated to 1 */
+	{ "t-4294967295 c", "Invalid tempo" },
+};
+
+/*!
+ * The MML compiler: the same frames from different spellings, the
+ * errors, and the note durations exact in integers (the time scale is
+ * the duration in samples over 128).
+ */
+static void check_mml_parse(void) {
+	for (int i = 0; i < (int)(sizeof(mml_spellings)
+				/ sizeof(mml_spellings[0])); i++) {
+		struct seq_frame_map_t map;
+		struct seq_frame_map_t ref;
+		struct regress_mml_error_t error;
+		int err = regress_mml_compile(mml_spellings[i][0], 0, &map,
+				&error);
+		err |= regress_mml_compile(mml_spellings[i][1], 0, &ref, &error);
+		if (err || !map_equal(&map, &ref)) {
+			printf("FAIL mml parse: %s\n", mml_spellings[i][0]);
+			failures++;
+		}
+		mml_free(&map);
+		mml_free(&ref);
+	}
+
+	for (int i = 0; i < (int)(sizeof(mml_parse_errors)
+				/ sizeof(mml_parse_errors[0])); i++) {
+		struct seq_frame_map_t map;
+		struct regress_mml_error_t error;
+		if (!regress_mml_compile(mml_parse_errors[i][0], 0, &map,
+					&error)
+				|| error.count != 1
+				|| strcmp(error.err, mml_parse_errors[i][1])) {
+			printf("FAIL mml parse: %s not reported\n",
+					mml_parse_errors[i][1]);
+			failures++;
+		}
+		mml_free(&map);
+	}
+
+	/* t45 c10. lasts 200 time scales, not 199 */
+	static const int tempos[] = { 45, 90, 120, 150, 233 };
+	static const int lengths[] = { 1, 3, 4, 5, 8, 10, 12, 16, 25, 64 };
+	for (int t = 0; t < (int)(sizeof(tempos) / sizeof(tempos[0])); t++)
+		for (int l = 0; l < (int)(sizeof(lengths)
+					/ sizeof(lengths[0])); l++)
+			for (int dots = 0; dots <= 3; dots++) {
+				char content[32];
+				snprintf(content, sizeof(content), "t%d c%d%.*s",
+						tempos[t], lengths[l], dots, "...");
+				uint64_t samples = (uint64_t)synth_freq * 240;
+				uint64_t whole = (uint64_t)tempos[t] * lengths[l];
+				for (int i = 0; i < dots; i++) {
+					samples *= 3;
+					whole *= 2;
+				}
+				struct seq_frame_map_t map;
+				struct regress_mml_error_t error;
+				if (regress_mml_compile(content, 0, &map, &error)
+						|| map.channels[0].frames[0]
+						.adsr_def.time_scale
+						!= samples / whole / 128) {
+					printf("FAIL mml parse: %s duration\n",
+							content);
+					failures++;
+				}
+				mml_free(&map);
+			}
+}
+
+/*!
+ * Play every song as compiled for half the sample rate, twice as fast:
+ * the time scales are unchanged and the periods are doubled, exactly.
+ * Then as compiled for 44.1kHz: the rounding must be reported, and the
+ * length rescaled.
+ */
+static void check_retime(void) {
+	for (int i = 0; i < case_count; i++) {
+		const struct regress_case_t* rcase = &cases[i];
+		if (!rcase->frames)
+			continue;
+
+		/* Doubled by hand, saturated as the player does */
+		uint8_t exact = 1;
+		struct seq_frame_t* frames = malloc(sizeof(struct seq_frame_t)
+				* rcase->frame_count);
+		for (int f = 0; f < rcase->frame_count; f++) {
+			uint32_t period = rcase->frames[f].waveform_def.period;
+			frames[f] = rcase->frames[f];
+			if (period * 2 > UINT16_MAX) {
+				frames[f].waveform_def.period = UINT16_MAX;
+				exact = 0;
+			} else {
+				frames[f].waveform_def.period = period * 2;
+			}
+		}
+
+		struct regress_buf_t ref = { 0 };
+		struct regress_buf_t out = { 0 };
+		render_retimed(rcase, frames, synth_freq, SEQ_TEMPO_NORMAL,
+				&ref);
+		uint32_t error = render_retimed(rcase, rcase->frames,
+				synth_freq / 2, 2 * SEQ_TEMPO_NORMAL, &out);
+		uint32_t at = first_divergence(&ref, &out);
+		if (at != UINT32_MAX || (exact && error)) {
+			printf("FAIL retime %s: diverges at sample %u, "
+					"error %u ppm\n", rcase->name, at,
+					error);
+			failures++;
+		}
+		free(frames);
+		buf_free(&ref);
+		buf_free(&out);
+
+		engines[0].render(rcase, solo_mask(-1), &ref);
+		error = render_retimed(rcase, rcase->frames, 44100,
+				SEQ_TEMPO_NORMAL, &out);
+		uint32_t expected = (uint64_t)ref.len * synth_freq / 44100;
+		uint32_t diff = (out.len > expected) ? (out.len - expected)
+			: (expected - out.len);
+		if (!error || diff > expected / 100) {
+			printf("FAIL retime %s: %u samples from 44.1kHz, "
+					"expected %u, error %u ppm\n",
+					rcase->name, out.len, expected, error);
+			failures++;
+		}
+		buf_free(&ref);
+		buf_free(&out);
+	}
+}
+
+/*!
+ * The shift-and-add amplitude scaling (also the algorithm of the AVR
+ * assembly version) must match the multiplication for every input.
+ */
+static void check_voice_scale(void) {
+	for (int value = INT8_MIN; value <= INT8_MAX; value++) {
+		for (int amplitude = 0; amplitude <= UINT8_MAX; amplitude++) {
+			int16_t ref = ((int16_t)value * amplitude) >> 8;
+			int16_t out = voice_scale_shift_add(value, amplitude);
+			if (out != ref) {
+				printf("FAIL voice_scale_shift_add(%d, %d): "
+						"%d, expected %d\n", value,
+						amplitude, out, ref);
+				failures++;
+				return;
+			}
+		}
+	}
+}
+
+int main(int argc, char** argv) {
+	const char* golden_name = NULL;
+	int update = 0;
+
+	/*
+	 * More workers than cores too, to exercise the stealing.  The songs
+	 * are parsed split on it as they are added.
+	 */
+	if (sched_init(&sched, 4)) {
+		fprintf(stderr, "Cannot start the scheduler\n");
+		return 1;
+	}
+
+	check_voice_scale();
+	add_synthetic();
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--golden") && (i + 1) < argc) {
+			golden_name = argv[++i];
+		} else if (!strcmp(argv[i], "--update")) {
+			update = 1;
+		} else if (add_song(argv[i])) {
+			return 1;
+		}
+	}
+
+	if (golden_name) {
+		if (update) {
+			golden_out = fopen(golden_name, "w");
+			if (!golden_out) {
+				fprintf(stderr, "Cannot write golden file %s\n",
+						golden_name);
+				return 1;
+			}
+			fprintf(golden_out, "# case track samples "
+					"hashes (FNV-1a, every %lu samples)\n",
+					1UL << REGRESS_BLOCK_BITS);
+		} else if (golden_load(golden_name)) {
+			return 1;
+		}
+	}
+
+	for (int i = 0; i < case_count; i++)
+		run_case(&cases[i]);
+	check_sched_concurrent();
+	check_layers();
+	check_retime();
+	check_chunks();
+	check_seek();
+	check_split();
+	check_cache();
+	check_loops();
+	check_mml_loops();
+	check_mml_parse();
+	sched_destroy(&sched);
+
+	if (golden_out)
+		fclose(golden_out);
+
+	printf("%d cases, %d engines: %s (%d failures)\n", case_count,
+			(int)ENGINE_COUNT, failures ? "FAIL" : "PASS", failures);
+	return failures ? 1 : 0;
+}
+
+/*
+ * vim: set sw=8 ts=8 noet si tw=72
+ */
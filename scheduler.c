@@ -0,0 +1,436 @@
+/*!
+ * Polyphonic synthesizer for microcontrollers.  Render scheduler.
+ * (C) 2026 The atinysynth contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#define _GNU_SOURCE
+#include "scheduler.h"
+#include "debug.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+
+/*! Initial size of the task ring of a worker */
+#define SCHED_WORKER_TASKS	(16)
+
+/*! Append a task to the ring of a worker, and wake an idle worker */
+static void sched_push(struct sched_worker_t* worker, struct sched_task_t* task) {
+	pthread_mutex_lock(&worker->lock);
+	if (worker->count == worker->size) {
+		// Grow the ring, keeping the order
+		int size = worker->size * 2;
+		struct sched_task_t** tasks = malloc(sizeof(struct sched_task_t*) * size);
+		for (int i = 0; i < worker->count; i++) {
+			tasks[i] = worker->tasks[(worker->head + i) % worker->size];
+		}
+		free(worker->tasks);
+		worker->tasks = tasks;
+		worker->head = 0;
+		worker->size = size;
+	}
+	worker->tasks[(worker->head + worker->count) % worker->size] = task;
+	worker->count++;
+	pthread_mutex_unlock(&worker->lock);
+
+	struct sched_t* sched = worker->sched;
+	pthread_mutex_lock(&sched->lock);
+	sched->pending++;
+	pthread_cond_signal(&sched->wake);
+	pthread_mutex_unlock(&sched->lock);
+}
+
+/*! Take the oldest task of the worker's own ring */
+static struct sched_task_t* sched_pop(struct sched_worker_t* worker) {
+	struct sched_task_t* task = NULL;
+	pthread_mutex_lock(&worker->lock);
+	if (worker->count) {
+		task = worker->tasks[worker->head];
+		worker->head = (worker->head + 1) % worker->size;
+		worker->count--;
+	}
+	pthread_mutex_unlock(&worker->lock);
+	return task;
+}
+
+/*! Take the newest task of another worker, starting from a random one */
+static struct sched_task_t* sched_steal(struct sched_worker_t* worker) {
+	struct sched_t* sched = worker->sched;
+	int start = rand_r(&worker->seed) % sched->worker_count;
+	for (int i = 0; i < sched->worker_count; i++) {
+		struct sched_worker_t* victim = &sched->workers[(start + i) % sched->worker_count];
+		if (victim == worker) {
+			continue;
+		}
+		struct sched_task_t* task = NULL;
+		pthread_mutex_lock(&victim->lock);
+		if (victim->count) {
+			victim->count--;
+			task = victim->tasks[(victim->head + victim->count) % victim->size];
+		}
+		pthread_mutex_unlock(&victim->lock);
+		if (task) {
+			return task;
+		}
+	}
+	return NULL;
+}
+
+/*! Requeue a task to the workers in turn */
+static void sched_resume(struct sched_t* sched, struct sched_task_t* task) {
+	pthread_mutex_lock(&sched->lock);
+	int idx = sched->next_worker;
+	sched->next_worker = (idx + 1) % sched->worker_count;
+	pthread_mutex_unlock(&sched->lock);
+	sched_push(&sched->workers[idx], task);
+}
+
+/*!
+ * Render the next block of a task in `block`.
+ * Returns non-zero if the task is completed.
+ */
+static uint8_t sched_render_block(struct sched_task_t* task, struct sched_block_t* block) {
+	if (task->run) {
+		// A job, done in one go
+		task->run(task->user);
+		block->len = 0;
+		return 1;
+	}
+
+	struct poly_synth_t* synth = task->synth;
+	uint16_t len = 0;
+	uint8_t finished = 0;
+	while (len < SCHED_BLOCK_SAMPLES) {
+		// Same call sequence as the single-threaded loop
+		if (task->player) {
+			if (task->player->clock >= task->until) {
+				finished = 1;
+				break;
+			}
+			seq_player_feed(task->player);
+		}
+		if (!synth->enable) {
+			finished = 1;
+			break;
+		}
+		block->samples[len++] = poly_synth_next(synth);
+	}
+	block->len = len;
+	return finished;
+}
+
+static void* sched_worker_main(void* arg) {
+	struct sched_worker_t* worker = arg;
+	struct sched_t* sched = worker->sched;
+	while (1) {
+		struct sched_task_t* task = sched_pop(worker);
+		if (!task) {
+			task = sched_steal(worker);
+		}
+
+		pthread_mutex_lock(&sched->lock);
+		if (task) {
+			sched->pending--;
+		} else {
+			// Nothing to steal, sleep until a task is queued
+			while (!sched->stop && !sched->pending) {
+				pthread_cond_wait(&sched->wake, &sched->lock);
+			}
+		}
+		uint8_t stop = sched->stop;
+		pthread_mutex_unlock(&sched->lock);
+		if (stop) {
+			break;
+		}
+		if (!task) {
+			continue;
+		}
+
+		// The free slot of the queue is not accessed by the reader
+		pthread_mutex_lock(&task->lock);
+		task->state = SCHED_TASK_RUNNING;
+		struct sched_block_t* block = &task->queue[(task->head + task->count) % SCHED_QUEUE_BLOCKS];
+		pthread_mutex_unlock(&task->lock);
+		uint8_t finished = sched_render_block(task, block);
+
+		pthread_mutex_lock(&task->lock);
+		if (block->len) {
+			task->count++;
+		}
+		if (finished || task->cancel) {
+			task->state = SCHED_TASK_DONE;
+		} else if (task->count == SCHED_QUEUE_BLOCKS) {
+			// Resumed by the reader
+			task->state = SCHED_TASK_PARKED;
+		} else {
+			task->state = SCHED_TASK_QUEUED;
+		}
+		uint8_t requeue = (task->state == SCHED_TASK_QUEUED);
+		pthread_cond_broadcast(&task->ready);
+		pthread_mutex_unlock(&task->lock);
+
+		if (requeue) {
+			// Back to the end of the ring, the other tasks come first
+			sched_push(worker, task);
+		}
+	}
+	return NULL;
+}
+
+int sched_init(struct sched_t* sched, int worker_count) {
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cores < 1) {
+		cores = 1;
+	}
+	if (worker_count <= 0) {
+		worker_count = cores;
+	}
+
+	sched->worker_count = worker_count;
+	sched->pending = 0;
+	sched->stop = 0;
+	sched->next_worker = 0;
+	pthread_mutex_init(&sched->lock, NULL);
+	pthread_cond_init(&sched->wake, NULL);
+
+	sched->workers = malloc(sizeof(struct sched_worker_t) * worker_count);
+	for (int i = 0; i < worker_count; i++) {
+		struct sched_worker_t* worker = &sched->workers[i];
+		worker->sched = sched;
+		worker->size = SCHED_WORKER_TASKS;
+		worker->tasks = malloc(sizeof(struct sched_task_t*) * worker->size);
+		worker->head = 0;
+		worker->count = 0;
+		worker->seed = i + 1;
+		pthread_mutex_init(&worker->lock, NULL);
+	}
+
+	for (int i = 0; i < worker_count; i++) {
+		struct sched_worker_t* worker = &sched->workers[i];
+		if (pthread_create(&worker->thread, NULL, sched_worker_main, worker)) {
+			_DPRINTF("Cannot start worker %d", i);
+			// Stop the workers already started
+			for (int j = i; j < worker_count; j++) {
+				free(sched->workers[j].tasks);
+				pthread_mutex_destroy(&sched->workers[j].lock);
+			}
+			sched->worker_count = i;
+			sched_destroy(sched);
+			return 1;
+		}
+#ifdef __linux__
+		// Pinning is only a hint, failures are ignored
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(i % cores, &cpus);
+		pthread_setaffinity_np(worker->thread, sizeof(cpu_set_t), &cpus);
+#endif
+	}
+	return 0;
+}
+
+void sched_destroy(struct sched_t* sched) {
+	pthread_mutex_lock(&sched->lock);
+	sched->stop = 1;
+	pthread_cond_broadcast(&sched->wake);
+	pthread_mutex_unlock(&sched->lock);
+
+	for (int i = 0; i < sched->worker_count; i++) {
+		pthread_join(sched->workers[i].thread, NULL);
+	}
+	for (int i = 0; i < sched->worker_count; i++) {
+		free(sched->workers[i].tasks);
+		pthread_mutex_destroy(&sched->workers[i].lock);
+	}
+	free(sched->workers);
+	pthread_mutex_destroy(&sched->lock);
+	pthread_cond_destroy(&sched->wake);
+}
+
+void sched_task_init(struct sched_task_t* task, struct poly_synth_t* synth, struct seq_player_t* player) {
+	task->synth = synth;
+	task->player = player;
+	task->run = NULL;
+	task->user = NULL;
+	task->until = UINT32_MAX;
+	task->sched = NULL;
+	task->head = 0;
+	task->count = 0;
+	task->state = SCHED_TASK_QUEUED;
+	task->cancel = 0;
+	pthread_mutex_init(&task->lock, NULL);
+	pthread_cond_init(&task->ready, NULL);
+}
+
+void sched_task_init_job(struct sched_task_t* task, void (*run)(void* user), void* user) {
+	sched_task_init(task, NULL, NULL);
+	task->run = run;
+	task->user = user;
+}
+
+void sched_task_destroy(struct sched_task_t* task) {
+	pthread_mutex_destroy(&task->lock);
+	pthread_cond_destroy(&task->ready);
+}
+
+void sched_submit(struct sched_t* sched, struct sched_task_t* task) {
+	task->sched = sched;
+	task->state = SCHED_TASK_QUEUED;
+	sched_resume(sched, task);
+}
+
+uint16_t sched_task_read(struct sched_task_t* task, int8_t* samples) {
+	pthread_mutex_lock(&task->lock);
+	while (!task->count && task->state != SCHED_TASK_DONE) {
+		pthread_cond_wait(&task->ready, &task->lock);
+	}
+	if (!task->count) {
+		pthread_mutex_unlock(&task->lock);
+		return 0;
+	}
+
+	struct sched_block_t* block = &task->queue[task->head];
+	uint16_t len = block->len;
+	memcpy(samples, block->samples, len);
+	task->head = (task->head + 1) % SCHED_QUEUE_BLOCKS;
+	task->count--;
+
+	// A slot is free again, the rendering can continue
+	uint8_t resume = (task->state == SCHED_TASK_PARKED);
+	if (resume) {
+		task->state = SCHED_TASK_QUEUED;
+	}
+	pthread_mutex_unlock(&task->lock);
+
+	if (resume) {
+		sched_resume(task->sched, task);
+	}
+	return len;
+}
+
+void sched_task_wait(struct sched_task_t* task) {
+	int8_t samples[SCHED_BLOCK_SAMPLES];
+	while (sched_task_read(task, samples)) {
+	}
+}
+
+void sched_task_cancel(struct sched_task_t* task) {
+	pthread_mutex_lock(&task->lock);
+	task->cancel = 1;
+	if (task->state == SCHED_TASK_PARKED) {
+		// Not queued, no worker will see the flag
+		task->state = SCHED_TASK_DONE;
+	}
+	pthread_cond_broadcast(&task->ready);
+	pthread_mutex_unlock(&task->lock);
+}
+
+/*! A segment of a song, between two keyframes */
+struct sched_segment_t {
+	struct poly_synth_t synth;
+	struct voice_ch_t voice[SEQ_MAX_VOICES];
+	struct seq_player_t player;
+	struct seq_frame_source_t source;
+	struct sched_task_t task;
+	/*! Samples of the segment if the song doesn't end within it */
+	uint32_t span;
+};
+
+/*! Start rendering the segment from the keyframe `index` */
+static int sched_segment_start(struct sched_t* sched, struct sched_segment_t* segment, const struct seq_stream_header_t* stream_header, uint16_t tempo, const struct seq_keyframe_list_t* keyframes, uint32_t index, uintptr_t mute, const struct sched_split_t* split) {
+	const struct seq_keyframe_t* keyframe = &keyframes->keyframes[index];
+	if (split->open(split->user, keyframe->frame, &segment->source)) {
+		return 1;
+	}
+	segment->synth.voice = segment->voice;
+	segment->synth.enable = 0;
+	segment->synth.mute = mute;
+	if (seq_player_init(&segment->player, stream_header, SEQ_MAX_VOICES, &segment->synth, &segment->source)) {
+		if (split->close) {
+			split->close(split->user, &segment->source);
+		}
+		return 1;
+	}
+#if SEQ_RETIME
+	seq_player_set_tempo(&segment->player, tempo);
+#endif
+	seq_player_restore(&segment->player, keyframe);
+
+	sched_task_init(&segment->task, &segment->synth, &segment->player);
+	if ((index + 1) < keyframes->count) {
+		segment->task.until = keyframes->keyframes[index + 1].clock;
+	}
+	segment->span = segment->task.until - keyframe->clock;
+	sched_submit(sched, &segment->task);
+	return 0;
+}
+
+/*! Wait for a segment, discarding its output, and release it */
+static void sched_segment_end(struct sched_segment_t* segment, const struct sched_split_t* split) {
+	sched_task_cancel(&segment->task);
+	sched_task_wait(&segment->task);
+	sched_task_destroy(&segment->task);
+	if (split->close) {
+		split->close(split->user, &segment->source);
+	}
+}
+
+int sched_render_split(struct sched_t* sched, const struct seq_stream_header_t* stream_header, uint16_t tempo, const struct seq_keyframe_list_t* keyframes, uintptr_t mute, const struct sched_split_t* split) {
+	// A window of segments in flight, oldest first
+	uint32_t window = sched->worker_count * SCHED_SPLIT_TASKS;
+	struct sched_segment_t* segments = malloc(sizeof(struct sched_segment_t) * window);
+	int8_t samples[SCHED_BLOCK_SAMPLES];
+	uint32_t started = 0;
+	uint32_t next = 0;
+	int error = 0;
+	uint8_t stop = 0;
+
+	while (!stop && next < keyframes->count) {
+		while (!error && started < keyframes->count && (started - next) < window) {
+			error = sched_segment_start(sched, &segments[started % window], stream_header, tempo, keyframes, started, mute, split);
+			if (!error) {
+				started++;
+			}
+		}
+		if (next == started) {
+			break;
+		}
+
+		struct sched_segment_t* segment = &segments[next % window];
+		uint32_t rendered = 0;
+		uint16_t len;
+		while (!stop && (len = sched_task_read(&segment->task, samples))) {
+			rendered += len;
+			stop = split->write(split->user, samples, len);
+		}
+		// The song ended within the segment, as when rendered alone
+		if (rendered < segment->span) {
+			stop = 1;
+		}
+		sched_segment_end(segment, split);
+		next++;
+	}
+
+	// Abandon the segments past the end
+	while (next < started) {
+		sched_segment_end(&segments[next % window], split);
+		next++;
+	}
+	free(segments);
+	return error;
+}
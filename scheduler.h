@@ -0,0 +1,213 @@
+/*!
+ * Polyphonic synthesizer for microcontrollers.  Render scheduler.
+ * (C) 2026 The atinysynth contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+#ifndef _SCHEDULER_H
+#define _SCHEDULER_H
+
+#include "synth.h"
+#include "sequencer.h"
+#include <pthread.h>
+
+/*!
+ * Not meant for microcontrollers: requires POSIX threads.
+ *
+ * The scheduler renders many independent synths at the same time on a
+ * pool of worker threads.  Every synth (optionally fed by a sequencer
+ * player) is a task, rendered one block at a time into its own output
+ * queue.  After each block the task goes back to the end of a worker
+ * queue, so a long song cannot starve the others, and idle workers
+ * steal tasks from the busy ones.
+ *
+ * Noise voices use `rand()`, whose state is shared by all the threads:
+ * tasks playing noise are not reproducible when rendered concurrently.
+ *
+ * A task can also be a job, a function run once by a worker, to share
+ * the same threads with other host work (e.g. `mmlsplit.h`).
+ */
+
+#ifndef SCHED_BLOCK_SAMPLES
+/*! Number of samples rendered at once by a worker */
+#define SCHED_BLOCK_SAMPLES	(4096)
+#endif
+
+#ifndef SCHED_QUEUE_BLOCKS
+/*! Output blocks queued per task before its rendering is suspended */
+#define SCHED_QUEUE_BLOCKS	(4)
+#endif
+
+#ifndef SCHED_SPLIT_TASKS
+/*! Segments rendered at the same time by `sched_render_split`, per worker */
+#define SCHED_SPLIT_TASKS	(2)
+#endif
+
+/*!
+ * Largest keyframe interval for `sched_render_split` that renders a whole
+ * segment without waiting for it to be read.
+ */
+#define SCHED_SPLIT_SAMPLES	(SCHED_QUEUE_BLOCKS * SCHED_BLOCK_SAMPLES)
+
+/*! Task states */
+#define SCHED_TASK_QUEUED	(0)
+#define SCHED_TASK_RUNNING	(1)
+#define SCHED_TASK_PARKED	(2)
+#define SCHED_TASK_DONE		(3)
+
+struct sched_t;
+
+/*! A rendered block of samples */
+struct sched_block_t {
+	int8_t samples[SCHED_BLOCK_SAMPLES];
+	uint16_t len;
+};
+
+/*! A synth to be rendered, with its output queue */
+struct sched_task_t {
+	/*! The synth to render */
+	struct poly_synth_t* synth;
+	/*! The player feeding the synth, or NULL to play the enabled voices */
+	struct seq_player_t* player;
+	/*! The function of a job, run instead of rendering, or NULL */
+	void (*run)(void* user);
+	void* user;
+	/*!
+	 * Player clock at which the rendering stops, as if the song ended
+	 * there: a segment of a song.  UINT32_MAX by default.
+	 */
+	uint32_t until;
+	/*! The owner scheduler */
+	struct sched_t* sched;
+	/*! Output queue, a ring of blocks */
+	struct sched_block_t queue[SCHED_QUEUE_BLOCKS];
+	uint8_t head;
+	uint8_t count;
+	/*! One of `SCHED_TASK_*` */
+	uint8_t state;
+	/*! Set by `sched_task_cancel` */
+	uint8_t cancel;
+	/*! Protects the queue and the state, signals new blocks */
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+};
+
+/*! A worker thread, with its queue of tasks */
+struct sched_worker_t {
+	struct sched_t* sched;
+	pthread_t thread;
+	/*! Ring of tasks ready to render a block */
+	struct sched_task_t** tasks;
+	int head;
+	int count;
+	int size;
+	/*! Protects the task ring */
+	pthread_mutex_t lock;
+	/*! Seed used to pick the victims to steal from */
+	unsigned int seed;
+};
+
+/*! The scheduler */
+struct sched_t {
+	struct sched_worker_t* workers;
+	int worker_count;
+	/*! Number of queued tasks, idle workers sleep while zero */
+	int pending;
+	/*! Set to terminate the workers */
+	uint8_t stop;
+	/*! Worker that will receive the next resumed task */
+	int next_worker;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+};
+
+/*!
+ * Start the scheduler with `worker_count` threads, pinned to the cores
+ * where supported.  If zero, a thread per online core is started.
+ * Returns non-zero on failure.
+ */
+int sched_init(struct sched_t* sched, int worker_count);
+
+/*!
+ * Stop the workers and free the scheduler.  Tasks not yet completed
+ * are abandoned.
+ */
+void sched_destroy(struct sched_t* sched);
+
+/*!
+ * Prepare a task for a synth.  If `player` is not NULL it must be
+ * already initialized with `seq_player_init` for the same synth.
+ */
+void sched_task_init(struct sched_task_t* task, struct poly_synth_t* synth, struct seq_player_t* player);
+
+/*!
+ * Prepare a task that runs `run(user)` once on a worker, and renders no
+ * samples: `sched_task_wait` for it before destroying it.
+ */
+void sched_task_init_job(struct sched_task_t* task, void (*run)(void* user), void* user);
+
+/*! Free the resources of a completed (or never submitted) task */
+void sched_task_destroy(struct sched_task_t* task);
+
+/*! Start rendering a task */
+void sched_submit(struct sched_t* sched, struct sched_task_t* task);
+
+/*!
+ * Wait for the next rendered block of a task and copy it to `samples`
+ * (room for `SCHED_BLOCK_SAMPLES`).  Returns the number of samples, or
+ * zero when the task is completed.
+ */
+uint16_t sched_task_read(struct sched_task_t* task, int8_t* samples);
+
+/*! Wait for a task to be completed, discarding its samples */
+void sched_task_wait(struct sched_task_t* task);
+
+/*!
+ * Stop rendering a task, e.g. a song that never ends.  The blocks
+ * already rendered must still be read until `sched_task_read` returns
+ * zero, before the task can be destroyed.
+ */
+void sched_task_cancel(struct sched_task_t* task);
+
+/*! Input and output of `sched_render_split` */
+struct sched_split_t {
+	/*!
+	 * Open a source reading the stream from the frame `frame`, for a
+	 * segment.  Returns non-zero on failure.
+	 */
+	int (*open)(void* user, uint32_t frame, struct seq_frame_source_t* source);
+	/*! Release a source opened by `open`, can be NULL */
+	void (*close)(void* user, struct seq_frame_source_t* source);
+	/*!
+	 * Output the next `len` samples of the song.  Returns non-zero to
+	 * stop rendering.
+	 */
+	int (*write)(void* user, const int8_t* samples, uint16_t len);
+	void* user;
+};
+
+/*!
+ * Render a single song on all the workers: the timeline is cut at the
+ * keyframes, compiled for the same stream and `tempo`, and each segment is
+ * rendered by its own task from the state of its keyframe.  The output
+ * is written in order, sample for sample the same as rendering the song
+ * alone (noise apart).  Keyframes up to `SCHED_SPLIT_SAMPLES` apart keep
+ * the workers busy.  The voices in `mute` are rendered silent.  Returns
+ * non-zero if a source could not be opened.
+ */
+int sched_render_split(struct sched_t* sched, const struct seq_stream_header_t* stream_header, uint16_t tempo, const struct seq_keyframe_list_t* keyframes, uintptr_t mute, const struct sched_split_t* split);
+
+#endif
@@ -0,0 +1,136 @@
+/*!
+ * Polyphonic synthesizer for microcontrollers.  Compiled stream cache.
+ * (C) 2026 The atinysynth contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#include "seqcache.h"
+#include "debug.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*! 64-bit FNV-1a, the entries are named after it */
+#define SEQ_CACHE_HASH_INIT	(14695981039346656037ULL)
+#define SEQ_CACHE_HASH_PRIME	(1099511628211ULL)
+
+static uint64_t seq_cache_hash(uint64_t hash, const void* data, size_t size) {
+	const uint8_t* bytes = data;
+	for (size_t i = 0; i < size; i++) {
+		hash = (hash ^ bytes[i]) * SEQ_CACHE_HASH_PRIME;
+	}
+	return hash;
+}
+
+/*! Hash an integer as little-endian bytes, the same on every host */
+static uint64_t seq_cache_hash_u32(uint64_t hash, uint32_t value) {
+	uint8_t bytes[4] = { value, value >> 8, value >> 16, value >> 24 };
+	return seq_cache_hash(hash, bytes, sizeof(bytes));
+}
+
+uint64_t seq_cache_key(const char* content, size_t size, uint32_t options) {
+	uint64_t hash = SEQ_CACHE_HASH_INIT;
+	hash = seq_cache_hash_u32(hash, SEQ_CACHE_VERSION);
+	hash = seq_cache_hash_u32(hash, synth_freq);
+	hash = seq_cache_hash_u32(hash, options);
+	return seq_cache_hash(hash, content, size);
+}
+
+char* seq_cache_path(const char* dir, uint64_t key) {
+	// Directory, slash, 16 digits, extension
+	char* path = malloc(strlen(dir) + 22);
+	sprintf(path, "%s/%016" PRIx64 ".seq", dir, key);
+	return path;
+}
+
+int seq_cache_open(const char* dir, uint64_t key, struct seq_cache_entry_t* entry) {
+	char* path = seq_cache_path(dir, key);
+	int fd = open(path, O_RDONLY);
+	free(path);
+	if (fd < 0) {
+		return 1;
+	}
+
+	struct stat st;
+	void* data = MAP_FAILED;
+	// A stream has at least a header: an empty file is not an entry
+	if (!fstat(fd, &st) && st.st_size > 0) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	// The mapping stays valid without the file descriptor
+	close(fd);
+	if (data == MAP_FAILED) {
+		return 1;
+	}
+	entry->data = data;
+	entry->size = st.st_size;
+	_DPRINTF("cached stream %016" PRIx64 ", %zu bytes\n", key, entry->size);
+	return 0;
+}
+
+void seq_cache_close(struct seq_cache_entry_t* entry) {
+	munmap((void*)entry->data, entry->size);
+	entry->data = NULL;
+	entry->size = 0;
+}
+
+int seq_cache_store(const char* dir, uint64_t key, const char* name) {
+	// Only the last level is created
+	if (mkdir(dir, 0777) && access(dir, W_OK)) {
+		return 1;
+	}
+
+	FILE* in = fopen(name, "rb");
+	if (!in) {
+		return 1;
+	}
+	char* path = seq_cache_path(dir, key);
+	char* temp = malloc(strlen(path) + 8);
+	sprintf(temp, "%s.XXXXXX", path);
+	int fd = mkstemp(temp);
+	FILE* out = (fd < 0) ? NULL : fdopen(fd, "wb");
+	int err = !out;
+
+	char data[4096];
+	size_t len;
+	while (!err && (len = fread(data, 1, sizeof(data), in)) > 0) {
+		err = fwrite(data, 1, len, out) != len;
+	}
+	err = err || ferror(in);
+	if (out && fclose(out)) {
+		err = 1;
+	} else if (!out && fd >= 0) {
+		close(fd);
+	}
+	fclose(in);
+
+	// Readers see the whole entry or none
+	if (!err) {
+		err = rename(temp, path) != 0;
+	}
+	if (err && fd >= 0) {
+		unlink(temp);
+	}
+	free(temp);
+	free(path);
+	return err;
+}
@@ -0,0 +1,74 @@
+/*!
+ * Polyphonic synthesizer for microcontrollers.  Compiled stream cache.
+ * (C) 2026 The atinysynth contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+#ifndef _SEQCACHE_H
+#define _SEQCACHE_H
+
+#include "synth.h"
+#include <stddef.h>
+
+/*!
+ * Not meant for microcontrollers: requires a POSIX file system.
+ *
+ * Compiled streams are stored in a cache directory, one file per stream,
+ * named after a hash of everything the compiler output depends on: the
+ * MML content, `synth_freq`, `SEQ_CACHE_VERSION` and the output options.
+ * An unchanged song is then compiled only once, and its stream is read
+ * straight from the cache, mapped in memory.
+ *
+ * Entries are written to a temporary file and renamed, so any number of
+ * compilers (threads or processes) can share the same directory.
+ */
+
+#ifndef SEQ_CACHE_VERSION
+/*!
+ * Version of the compiler output.  To be increased whenever a same MML
+ * content compiles to another stream, so the older entries are not used.
+ */
+#define SEQ_CACHE_VERSION	(2)
+#endif
+
+/*! A cached stream, mapped in memory */
+struct seq_cache_entry_t {
+	const uint8_t* data;
+	size_t size;
+};
+
+/*!
+ * Key of the stream compiled from `content`.  `options` are the output
+ * options of the caller (format, chunking...) that change the stream.
+ */
+uint64_t seq_cache_key(const char* content, size_t size, uint32_t options);
+
+/*! Path of the entry of `key` in the `dir` directory, to be freed */
+char* seq_cache_path(const char* dir, uint64_t key);
+
+/*! Map the cached stream of `key`.  Returns non-zero if not cached */
+int seq_cache_open(const char* dir, uint64_t key, struct seq_cache_entry_t* entry);
+
+/*! Unmap a stream opened by `seq_cache_open` */
+void seq_cache_close(struct seq_cache_entry_t* entry);
+
+/*!
+ * Store a copy of the stream file `name` as the entry of `key`, creating
+ * the directory if needed.  Returns non-zero on error.
+ */
+int seq_cache_store(const char* dir, uint64_t key, const char* name);
+
+#endif
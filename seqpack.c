@@ -0,0 +1,720 @@
+/*!
+ * Polyphonic synthesizer for microcontrollers.  Compact sequencer stream.
+ * (C) 2026 The atinysynth contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#include "seqpack.h"
+#include "debug.h"
+#include <string.h>
+#ifdef __AVR_ARCH__
+#include <avr/pgmspace.h>
+#endif
+
+/*! Maximum size of an encoded frame: mask, 3+5 bytes of varints, 9 bytes */
+#define SEQ_PACK_FRAME_MAX	(18)
+
+/*! Fewer frames saved by a loop don't pay its control records */
+#define SEQ_PACK_LOOP_MIN_SAVED	(6)
+
+/*! Append a varint (7 bits per byte, least significant first) */
+static uint8_t* seq_pack_varint(uint8_t* pos, uint32_t value) {
+	while (value >= 0x80) {
+		*(pos++) = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	*(pos++) = value;
+	return pos;
+}
+
+/*! Read a byte of the frames, accounting the offset */
+static uint8_t seq_unpack_byte(struct seq_pack_decoder_t* decoder) {
+	decoder->offset++;
+	return decoder->read(decoder->user);
+}
+
+static uint32_t seq_unpack_varint(struct seq_pack_decoder_t* decoder) {
+	uint32_t value = 0;
+	uint8_t shift = 0;
+	uint8_t byte;
+	do {
+		byte = seq_unpack_byte(decoder);
+		value |= (uint32_t)(byte & 0x7f) << shift;
+		shift += 7;
+	} while ((byte & 0x80) && (shift < 32));
+	return value;
+}
+
+/*! Zig-zag coding, small differences of any sign take few bytes */
+static uint32_t seq_pack_zigzag(uint16_t value, uint16_t last) {
+	int32_t delta = (int32_t)value - last;
+	return (delta < 0) ? ((uint32_t)(-delta) << 1) - 1 : (uint32_t)delta << 1;
+}
+
+static uint16_t seq_unpack_zigzag(uint32_t zigzag, uint16_t last) {
+	int32_t delta = (zigzag & 1) ? -(int32_t)((zigzag + 1) >> 1) : (int32_t)(zigzag >> 1);
+	return last + delta;
+}
+
+/*! The instrument part of a frame */
+static void seq_instrument_of(struct seq_instrument_t* instrument, const struct seq_frame_t* frame) {
+	instrument->mode = frame->waveform_def.mode;
+	instrument->amplitude = frame->waveform_def.amplitude;
+	instrument->delay_time = frame->adsr_def.delay_time;
+	instrument->attack_time = frame->adsr_def.attack_time;
+	instrument->decay_time = frame->adsr_def.decay_time;
+	instrument->sustain_time = frame->adsr_def.sustain_time;
+	instrument->release_time = frame->adsr_def.release_time;
+	instrument->peak_amp = frame->adsr_def.peak_amp;
+	instrument->sustain_amp = frame->adsr_def.sustain_amp;
+}
+
+/*! Find the instrument of a frame in a table, returns -1 if not found */
+static int seq_find_instrument(const struct seq_instrument_table_t* table, const struct seq_frame_t* frame) {
+	struct seq_instrument_t instrument;
+	seq_instrument_of(&instrument, frame);
+	for (int i = 0; i < table->count; i++) {
+		// Only byte fields, no padding
+		if (!memcmp(&table->instruments[i], &instrument, sizeof(struct seq_instrument_t))) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+int seq_pack_add_instrument(void* user, const struct seq_frame_t* frame) {
+	struct seq_instrument_table_t* table = user;
+	if (seq_find_instrument(table, frame) >= 0) {
+		return 0;
+	}
+	if (table->count == SEQ_PACK_MAX_INSTRUMENTS) {
+		return 1;
+	}
+	seq_instrument_of(&table->instruments[table->count++], frame);
+	return 0;
+}
+
+void seq_pack_header(uint8_t* data, const struct seq_stream_header_t* header, uint8_t version) {
+	data[0] = 'S';
+	data[1] = 'E';
+	data[2] = 'Q';
+	data[3] = version;
+	data[4] = header->synth_frequency & 0xff;
+	data[5] = header->synth_frequency >> 8;
+	data[6] = header->voices;
+	data[7] = header->frames & 0xff;
+	data[8] = header->frames >> 8;
+}
+
+/*! Append a little-endian 32-bit value */
+static uint8_t* seq_pack_u32(uint8_t* pos, uint32_t value) {
+	for (uint8_t i = 0; i < 4; i++) {
+		*(pos++) = value & 0xff;
+		value >>= 8;
+	}
+	return pos;
+}
+
+static uint32_t seq_unpack_u32(const uint8_t* pos) {
+	return pos[0] | ((uint32_t)pos[1] << 8) | ((uint32_t)pos[2] << 16) | ((uint32_t)pos[3] << 24);
+}
+
+void seq_pack_header_chunked(uint8_t* data, const struct seq_stream_header_t* header, uint8_t flags, const struct seq_pack_chunking_t* chunking) {
+	data[0] = 'S';
+	data[1] = 'E';
+	data[2] = 'Q';
+	data[3] = SEQ_PACK_VERSION_CHUNKED;
+	data[4] = header->synth_frequency & 0xff;
+	data[5] = header->synth_frequency >> 8;
+	data[6] = header->voices;
+	uint8_t* pos = seq_pack_u32(data + 7, header->frames);
+	*(pos++) = flags;
+	*(pos++) = chunking->chunk_frames & 0xff;
+	*(pos++) = chunking->chunk_frames >> 8;
+	pos = seq_pack_u32(pos, chunking->chunks);
+	seq_pack_u32(pos, chunking->index_offset);
+}
+
+void seq_pack_chunk_encode(uint8_t* data, const struct seq_pack_chunk_t* chunk) {
+	data = seq_pack_u32(data, chunk->offset);
+	data = seq_pack_u32(data, chunk->size);
+	seq_pack_u32(data, chunk->hash);
+}
+
+void seq_pack_chunk_decode(struct seq_pack_chunk_t* chunk, const uint8_t* data) {
+	chunk->offset = seq_unpack_u32(data);
+	chunk->size = seq_unpack_u32(data + 4);
+	chunk->hash = seq_unpack_u32(data + 8);
+}
+
+uint32_t seq_pack_hash(uint32_t hash, const uint8_t* data, uint32_t len) {
+	while (len--) {
+		hash ^= *(data++);
+		hash *= 16777619UL;
+	}
+	return hash;
+}
+
+/*! Write through the encoder, accounting the offset and the current chunk */
+static int seq_pack_emit(struct seq_pack_encoder_t* encoder, const uint8_t* data, uint8_t len) {
+	encoder->offset += len;
+	if (encoder->chunk_left) {
+		encoder->chunk.size += len;
+		encoder->chunk.hash = seq_pack_hash(encoder->chunk.hash, data, len);
+	}
+	return encoder->write(encoder->user, data, len);
+}
+
+/*! Prepare the encoder after a header of `offset` bytes, and write the instruments */
+static int seq_pack_encoder_start(struct seq_pack_encoder_t* encoder, int (*write)(void* user, const uint8_t* data, uint8_t len), void* user, const struct seq_instrument_table_t* instruments, uint32_t offset) {
+	encoder->write = write;
+	encoder->user = user;
+	encoder->instruments = instruments;
+	memset(&encoder->last, 0, sizeof(struct seq_frame_t));
+	encoder->offset = offset;
+	encoder->chunk_frames = 0;
+	encoder->chunk_left = 0;
+	encoder->index = NULL;
+	encoder->loops = 0;
+	if (!instruments) {
+		return 0;
+	}
+
+	if (seq_pack_emit(encoder, &instruments->count, 1)) {
+		return 1;
+	}
+	for (int i = 0; i < instruments->count; i++) {
+		const struct seq_instrument_t* instrument = &instruments->instruments[i];
+		uint8_t data[SEQ_PACK_INSTRUMENT_SIZE];
+		data[0] = instrument->mode;
+		data[1] = instrument->amplitude;
+		data[2] = instrument->delay_time;
+		data[3] = instrument->attack_time;
+		data[4] = instrument->decay_time;
+		data[5] = instrument->sustain_time;
+		data[6] = instrument->release_time;
+		data[7] = instrument->peak_amp;
+		data[8] = instrument->sustain_amp;
+		if (seq_pack_emit(encoder, data, SEQ_PACK_INSTRUMENT_SIZE)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int seq_pack_encoder_init(struct seq_pack_encoder_t* encoder, int (*write)(void* user, const uint8_t* data, uint8_t len), void* user, const struct seq_instrument_table_t* instruments) {
+	return seq_pack_encoder_start(encoder, write, user, instruments, SEQ_PACK_HEADER_SIZE);
+}
+
+int seq_pack_encoder_init_chunked(struct seq_pack_encoder_t* encoder, int (*write)(void* user, const uint8_t* data, uint8_t len), void* user, const struct seq_instrument_table_t* instruments, uint16_t chunk_frames, int (*index)(void* user, const struct seq_pack_chunk_t* chunk), void* index_user) {
+	if (seq_pack_encoder_start(encoder, write, user, instruments, SEQ_PACK_HEADER_CHUNKED_SIZE)) {
+		return 1;
+	}
+	encoder->chunk_frames = chunk_frames;
+	encoder->index = index;
+	encoder->index_user = index_user;
+	return 0;
+}
+
+int seq_pack_encoder_finish(struct seq_pack_encoder_t* encoder) {
+	if (!encoder->chunk_left) {
+		return 0;
+	}
+	encoder->chunk_left = 0;
+	return encoder->index(encoder->index_user, &encoder->chunk);
+}
+
+/*! Open a chunk before its first frame, coded against an all zeros frame */
+static void seq_pack_chunk_begin(struct seq_pack_encoder_t* encoder) {
+	if (!encoder->chunk_frames || encoder->chunk_left) {
+		return;
+	}
+	memset(&encoder->last, 0, sizeof(struct seq_frame_t));
+	encoder->chunk.offset = encoder->offset;
+	encoder->chunk.size = 0;
+	encoder->chunk.hash = SEQ_PACK_HASH_INIT;
+	encoder->chunk_left = encoder->chunk_frames;
+}
+
+/*! Close the chunk after its last frame */
+static int seq_pack_chunk_end(struct seq_pack_encoder_t* encoder) {
+	if (!encoder->chunk_frames || --encoder->chunk_left) {
+		return 0;
+	}
+	return encoder->index(encoder->index_user, &encoder->chunk);
+}
+
+/*! Encode a version 2 frame: instrument index, period and time scale */
+static int seq_pack_write_note(struct seq_pack_encoder_t* encoder, const struct seq_frame_t* frame) {
+	struct seq_frame_t* last = &encoder->last;
+	uint8_t data[SEQ_PACK_FRAME_MAX];
+	uint8_t* pos = data + 1;
+
+	int instrument = seq_find_instrument(encoder->instruments, frame);
+	if (instrument < 0) {
+		_DPRINTF("Instrument not in table");
+		return 1;
+	}
+	if (instrument < SEQ_PACK_INSTRUMENT_ESCAPE) {
+		data[0] = instrument << SEQ_PACK_INSTRUMENT_SHIFT;
+	} else {
+		data[0] = SEQ_PACK_INSTRUMENT_ESCAPE << SEQ_PACK_INSTRUMENT_SHIFT;
+		*(pos++) = instrument;
+	}
+	if (frame->waveform_def.period != last->waveform_def.period) {
+		data[0] |= SEQ_PACK_NOTE_PERIOD;
+		pos = seq_pack_varint(pos, seq_pack_zigzag(frame->waveform_def.period, last->waveform_def.period));
+	}
+	if (frame->adsr_def.time_scale != last->adsr_def.time_scale) {
+		data[0] |= SEQ_PACK_NOTE_TIME_SCALE;
+		pos = seq_pack_varint(pos, frame->adsr_def.time_scale);
+	}
+
+	*last = *frame;
+	return seq_pack_emit(encoder, data, pos - data);
+}
+
+/*! Encode a version 1 frame: mask of the changed fields and their values */
+static int seq_pack_write_mask(struct seq_pack_encoder_t* encoder, const struct seq_frame_t* frame) {
+	struct seq_frame_t* last = &encoder->last;
+	uint8_t data[SEQ_PACK_FRAME_MAX];
+	uint8_t mask = 0;
+	uint8_t* pos = data + 1;
+
+	if (frame->waveform_def.mode != last->waveform_def.mode) {
+		mask |= SEQ_PACK_MODE;
+		*(pos++) = frame->waveform_def.mode;
+	}
+	if (frame->waveform_def.amplitude != last->waveform_def.amplitude) {
+		mask |= SEQ_PACK_AMPLITUDE;
+		*(pos++) = frame->waveform_def.amplitude;
+	}
+	if (frame->waveform_def.period != last->waveform_def.period) {
+		mask |= SEQ_PACK_PERIOD;
+		pos = seq_pack_varint(pos, seq_pack_zigzag(frame->waveform_def.period, last->waveform_def.period));
+	}
+	if (frame->adsr_def.time_scale != last->adsr_def.time_scale) {
+		mask |= SEQ_PACK_TIME_SCALE;
+		pos = seq_pack_varint(pos, frame->adsr_def.time_scale);
+	}
+	if (frame->adsr_def.delay_time != last->adsr_def.delay_time
+			|| frame->adsr_def.attack_time != last->adsr_def.attack_time
+			|| frame->adsr_def.decay_time != last->adsr_def.decay_time) {
+		mask |= SEQ_PACK_ATTACK;
+		*(pos++) = frame->adsr_def.delay_time;
+		*(pos++) = frame->adsr_def.attack_time;
+		*(pos++) = frame->adsr_def.decay_time;
+	}
+	if (frame->adsr_def.sustain_time != last->adsr_def.sustain_time
+			|| frame->adsr_def.release_time != last->adsr_def.release_time) {
+		mask |= SEQ_PACK_RELEASE;
+		*(pos++) = frame->adsr_def.sustain_time;
+		*(pos++) = frame->adsr_def.release_time;
+	}
+	if (frame->adsr_def.peak_amp != last->adsr_def.peak_amp
+			|| frame->adsr_def.sustain_amp != last->adsr_def.sustain_amp) {
+		mask |= SEQ_PACK_AMPS;
+		*(pos++) = frame->adsr_def.peak_amp;
+		*(pos++) = frame->adsr_def.sustain_amp;
+	}
+	data[0] = mask;
+
+	*last = *frame;
+	return seq_pack_emit(encoder, data, pos - data);
+}
+
+int seq_pack_write_frame(void* user, const struct seq_frame_t* frame) {
+	struct seq_pack_encoder_t* encoder = user;
+	seq_pack_chunk_begin(encoder);
+	int ret = encoder->instruments
+		? seq_pack_write_note(encoder, frame)
+		: seq_pack_write_mask(encoder, frame);
+	return ret ? ret : seq_pack_chunk_end(encoder);
+}
+
+static uint8_t seq_frames_equal(const struct seq_frame_t* a, const struct seq_frame_t* b, uint32_t count) {
+	while (count--) {
+		if (!seq_frame_equal(a++, b++)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*!
+ * The loop at the start of `frames` that saves the most frames: returns
+ * the number of times its body is played, zero if none is worth it.
+ */
+static uint32_t seq_pack_find_loop(const struct seq_frame_t* frames, uint32_t count, uint32_t* body) {
+	uint32_t max_body = count / 2;
+	if (max_body > SEQ_PACK_LOOP_MAX_BODY) {
+		max_body = SEQ_PACK_LOOP_MAX_BODY;
+	}
+	uint32_t best = 0;
+	uint32_t saved = SEQ_PACK_LOOP_MIN_SAVED - 1;
+	for (uint32_t len = 1; len <= max_body; len++) {
+		if (!seq_frame_equal(&frames[0], &frames[len])) {
+			continue;
+		}
+		uint32_t times = 1;
+		while ((times + 1) * len <= count && times < UINT16_MAX
+				&& seq_frames_equal(frames, frames + times * len, len)) {
+			times++;
+		}
+		if ((times - 1) * len > saved) {
+			saved = (times - 1) * len;
+			best = times;
+			*body = len;
+		}
+	}
+	return best;
+}
+
+/*! Encode a control record: the times of a loop at its start, zero at its end */
+static int seq_pack_write_control(struct seq_pack_encoder_t* encoder, uint32_t times) {
+	uint8_t data[7];
+	uint8_t* pos = data;
+	if (encoder->instruments) {
+		*(pos++) = SEQ_PACK_INSTRUMENT_ESCAPE << SEQ_PACK_INSTRUMENT_SHIFT;
+		*(pos++) = SEQ_PACK_CONTROL_INDEX;
+	} else {
+		*(pos++) = SEQ_PACK_CONTROL;
+	}
+	pos = seq_pack_varint(pos, times);
+	return seq_pack_emit(encoder, data, pos - data);
+}
+
+static int seq_pack_write_range(struct seq_pack_encoder_t* encoder, const struct seq_frame_t* frames, uint32_t count, uint8_t depth) {
+	uint32_t i = 0;
+	while (i < count) {
+		uint32_t body = 0;
+		uint32_t times = 0;
+		if (depth) {
+			// Loops don't cross the chunks
+			uint32_t left = encoder->chunk_left ? encoder->chunk_left : encoder->chunk_frames;
+			times = seq_pack_find_loop(frames + i, (left < count - i) ? left : count - i, &body);
+		}
+		if (!times) {
+			if (seq_pack_write_frame(encoder, &frames[i++])) {
+				return 1;
+			}
+			continue;
+		}
+
+		seq_pack_chunk_begin(encoder);
+		if (seq_pack_write_control(encoder, times)) {
+			return 1;
+		}
+		// The body is played from an all zeros frame every time
+		memset(&encoder->last, 0, sizeof(struct seq_frame_t));
+		if (seq_pack_write_range(encoder, frames + i, body, depth - 1)
+				|| seq_pack_write_control(encoder, 0)) {
+			return 1;
+		}
+		encoder->loops = 1;
+		// The repetitions count in the chunk, that can end with them
+		encoder->chunk_left -= (times - 1) * body;
+		if (!encoder->chunk_left && encoder->index(encoder->index_user, &encoder->chunk)) {
+			return 1;
+		}
+		i += times * body;
+	}
+	return 0;
+}
+
+int seq_pack_write_frames(struct seq_pack_encoder_t* encoder, const struct seq_frame_t* frames, uint32_t count, uint8_t depth) {
+	if (!encoder->chunk_frames) {
+		depth = 0;
+	}
+	return seq_pack_write_range(encoder, frames, count, depth);
+}
+
+int seq_pack_decoder_init(struct seq_pack_decoder_t* decoder, uint8_t (*read)(void* user), void* user, struct seq_stream_header_t* header) {
+	uint8_t data[SEQ_PACK_HEADER_CHUNKED_SIZE];
+	uint8_t size = SEQ_PACK_HEADER_SIZE;
+	for (uint8_t i = 0; i < size; i++) {
+		data[i] = read(user);
+		// The version tells the size of the rest of the header
+		if (i == 3 && data[3] == SEQ_PACK_VERSION_CHUNKED) {
+			size = SEQ_PACK_HEADER_CHUNKED_SIZE;
+		}
+	}
+	if (data[0] != 'S' || data[1] != 'E' || data[2] != 'Q') {
+		_DPRINTF("Not a compact stream");
+		return 1;
+	}
+	if (data[3] != SEQ_PACK_VERSION && data[3] != SEQ_PACK_VERSION_INSTRUMENTS && data[3] != SEQ_PACK_VERSION_CHUNKED) {
+		_DPRINTF("Unsupported stream version");
+		return 1;
+	}
+	header->synth_frequency = data[4] | ((uint16_t)data[5] << 8);
+	header->voices = data[6];
+
+	decoder->read = read;
+	decoder->user = user;
+	decoder->rewind = NULL;
+	decoder->version = data[3];
+	decoder->flags = 0;
+#if SEQ_PACK_MAX_LOOPS
+	decoder->loop_count = 0;
+#endif
+	decoder->offset = size;
+	decoder->chunking.chunk_frames = 0;
+	decoder->chunking.chunks = 0;
+	decoder->chunking.index_offset = 0;
+	decoder->chunk_left = 0;
+	if (decoder->version == SEQ_PACK_VERSION_CHUNKED) {
+		header->frames = seq_unpack_u32(data + 7);
+		decoder->flags = data[11];
+		decoder->version = (decoder->flags & SEQ_PACK_FLAG_INSTRUMENTS) ? SEQ_PACK_VERSION_INSTRUMENTS : SEQ_PACK_VERSION;
+		decoder->chunking.chunk_frames = data[12] | ((uint16_t)data[13] << 8);
+		decoder->chunking.chunks = seq_unpack_u32(data + 14);
+		decoder->chunking.index_offset = seq_unpack_u32(data + 18);
+#if !SEQ_PACK_MAX_LOOPS
+		if (decoder->flags & SEQ_PACK_FLAG_LOOPS) {
+			_DPRINTF("Loops not supported");
+			return 1;
+		}
+#endif
+		if (!decoder->chunking.chunk_frames
+				|| decoder->chunking.chunks != (header->frames + decoder->chunking.chunk_frames - 1) / decoder->chunking.chunk_frames) {
+			_DPRINTF("Bad chunk count");
+			return 1;
+		}
+	} else {
+		header->frames = data[7] | ((uint16_t)data[8] << 8);
+	}
+	decoder->frames = header->frames;
+	decoder->frame_count = header->frames;
+	decoder->repeat = (decoder->flags & SEQ_PACK_FLAG_REPEAT) != 0;
+	memset(&decoder->last, 0, sizeof(struct seq_frame_t));
+	decoder->instruments.count = 0;
+	decoder->start = decoder->offset;
+	if (decoder->version == SEQ_PACK_VERSION) {
+		return 0;
+	}
+
+	// Keep the instruments resident, the frames only refer to them
+	uint8_t count = read(user);
+	if (count > SEQ_PACK_MAX_INSTRUMENTS) {
+		_DPRINTF("Too many instruments");
+		return 1;
+	}
+	for (uint8_t i = 0; i < count; i++) {
+		struct seq_instrument_t* instrument = &decoder->instruments.instruments[i];
+		instrument->mode = read(user);
+		instrument->amplitude = read(user);
+		instrument->delay_time = read(user);
+		instrument->attack_time = read(user);
+		instrument->decay_time = read(user);
+		instrument->sustain_time = read(user);
+		instrument->release_time = read(user);
+		instrument->peak_amp = read(user);
+		instrument->sustain_amp = read(user);
+	}
+	decoder->instruments.count = count;
+	decoder->start += 1 + count * SEQ_PACK_INSTRUMENT_SIZE;
+	decoder->offset = decoder->start;
+	return 0;
+}
+
+void seq_pack_decoder_set_rewind(struct seq_pack_decoder_t* decoder, int (*rewind)(void* user, uint32_t bytes)) {
+	decoder->rewind = rewind;
+}
+
+int seq_pack_decoder_seek_chunk(struct seq_pack_decoder_t* decoder, uint32_t chunk, uint32_t offset) {
+	if (chunk >= decoder->chunking.chunks) {
+		return 1;
+	}
+	// The next frame opens the chunk, against an all zeros frame
+	decoder->frames = decoder->frame_count - chunk * decoder->chunking.chunk_frames;
+	decoder->chunk_left = 0;
+#if SEQ_PACK_MAX_LOOPS
+	decoder->loop_count = 0;
+#endif
+	decoder->offset = offset;
+	return 0;
+}
+
+/*! Move the reader back to `offset`, returns non-zero if it can't */
+static uint8_t seq_unpack_rewind(struct seq_pack_decoder_t* decoder, uint32_t offset) {
+	if (!decoder->rewind || decoder->rewind(decoder->user, decoder->offset - offset)) {
+		_DPRINTF("Can't rewind the stream");
+		return 1;
+	}
+	decoder->offset = offset;
+	return 0;
+}
+
+#if SEQ_PACK_MAX_LOOPS
+/*! Follow a control record, returns non-zero if the stream can't go on */
+static uint8_t seq_unpack_control(struct seq_pack_decoder_t* decoder) {
+	uint32_t times = seq_unpack_varint(decoder);
+	if (times) {
+		// Loop start
+		if (decoder->loop_count == SEQ_PACK_MAX_LOOPS) {
+			_DPRINTF("Too many nested loops");
+			return 1;
+		}
+		struct seq_pack_loop_t* loop = &decoder->loops[decoder->loop_count++];
+		loop->offset = decoder->offset;
+		loop->left = times - 1;
+	} else {
+		// Loop end, played again from the first frame if left
+		if (!decoder->loop_count) {
+			_DPRINTF("Loop end without start");
+			return 1;
+		}
+		struct seq_pack_loop_t* loop = &decoder->loops[decoder->loop_count - 1];
+		if (!loop->left) {
+			decoder->loop_count--;
+			return 0;
+		}
+		if (seq_unpack_rewind(decoder, loop->offset)) {
+			return 1;
+		}
+		loop->left--;
+	}
+	// The first frame of the body is coded against an all zeros frame
+	memset(&decoder->last, 0, sizeof(struct seq_frame_t));
+	return 0;
+}
+#endif
+
+/*! Decode a version 2 frame, after its flags and instrument index */
+static void seq_unpack_note(struct seq_pack_decoder_t* decoder, uint8_t flags, uint8_t index) {
+	struct seq_frame_t* last = &decoder->last;
+	if (index < decoder->instruments.count) {
+		const struct seq_instrument_t* instrument = &decoder->instruments.instruments[index];
+		last->waveform_def.mode = instrument->mode;
+		last->waveform_def.amplitude = instrument->amplitude;
+		last->adsr_def.delay_time = instrument->delay_time;
+		last->adsr_def.attack_time = instrument->attack_time;
+		last->adsr_def.decay_time = instrument->decay_time;
+		last->adsr_def.sustain_time = instrument->sustain_time;
+		last->adsr_def.release_time = instrument->release_time;
+		last->adsr_def.peak_amp = instrument->peak_amp;
+		last->adsr_def.sustain_amp = instrument->sustain_amp;
+	}
+	if (flags & SEQ_PACK_NOTE_PERIOD) {
+		last->waveform_def.period = seq_unpack_zigzag(seq_unpack_varint(decoder), last->waveform_def.period);
+	}
+	if (flags & SEQ_PACK_NOTE_TIME_SCALE) {
+		last->adsr_def.time_scale = seq_unpack_varint(decoder);
+	}
+}
+
+uint8_t seq_pack_read_rom(void* user) {
+	const uint8_t** pos = user;
+#ifdef __AVR_ARCH__
+	return pgm_read_byte((*pos)++);
+#else
+	return *((*pos)++);
+#endif
+}
+
+int seq_pack_rewind_rom(void* user, uint32_t bytes) {
+	const uint8_t** pos = user;
+	*pos -= bytes;
+	return 0;
+}
+
+uint8_t seq_pack_read_frame(void* user, struct seq_frame_t* frame) {
+	struct seq_pack_decoder_t* decoder = user;
+	struct seq_frame_t* last = &decoder->last;
+	if (!decoder->frames) {
+		if (!decoder->repeat || !decoder->frame_count || seq_unpack_rewind(decoder, decoder->start)) {
+			return 0;
+		}
+		// From the first frame again, that opens a chunk
+		decoder->frames = decoder->frame_count;
+		decoder->chunk_left = 0;
+#if SEQ_PACK_MAX_LOOPS
+		decoder->loop_count = 0;
+#endif
+	}
+	decoder->frames--;
+	if (decoder->chunking.chunk_frames) {
+		if (!decoder->chunk_left) {
+			memset(last, 0, sizeof(struct seq_frame_t));
+			decoder->chunk_left = decoder->chunking.chunk_frames;
+		}
+		decoder->chunk_left--;
+	}
+
+	uint8_t code;
+	uint8_t index;
+	while (1) {
+		code = seq_unpack_byte(decoder);
+		index = code >> SEQ_PACK_INSTRUMENT_SHIFT;
+		if (decoder->version == SEQ_PACK_VERSION_INSTRUMENTS && index == SEQ_PACK_INSTRUMENT_ESCAPE) {
+			index = seq_unpack_byte(decoder);
+		}
+#if SEQ_PACK_MAX_LOOPS
+		if (!(decoder->flags & SEQ_PACK_FLAG_LOOPS)
+				|| ((decoder->version == SEQ_PACK_VERSION_INSTRUMENTS)
+					? (index != SEQ_PACK_CONTROL_INDEX)
+					: !(code & SEQ_PACK_CONTROL))) {
+			break;
+		}
+		if (seq_unpack_control(decoder)) {
+			// Broken stream, or no rewind: it ends here
+			decoder->frames = 0;
+			decoder->repeat = 0;
+			return 0;
+		}
+#else
+		break;
+#endif
+	}
+
+	if (decoder->version == SEQ_PACK_VERSION_INSTRUMENTS) {
+		seq_unpack_note(decoder, code, index);
+		*frame = *last;
+		return 1;
+	}
+
+	uint8_t mask = code;
+	if (mask & SEQ_PACK_MODE) {
+		last->waveform_def.mode = seq_unpack_byte(decoder);
+	}
+	if (mask & SEQ_PACK_AMPLITUDE) {
+		last->waveform_def.amplitude = seq_unpack_byte(decoder);
+	}
+	if (mask & SEQ_PACK_PERIOD) {
+		last->waveform_def.period = seq_unpack_zigzag(seq_unpack_varint(decoder), last->waveform_def.period);
+	}
+	if (mask & SEQ_PACK_TIME_SCALE) {
+		last->adsr_def.time_scale = seq_unpack_varint(decoder);
+	}
+	if (mask & SEQ_PACK_ATTACK) {
+		last->adsr_def.delay_time = seq_unpack_byte(decoder);
+		last->adsr_def.attack_time = seq_unpack_byte(decoder);
+		last->adsr_def.decay_time = seq_unpack_byte(decoder);
+	}
+	if (mask & SEQ_PACK_RELEASE) {
+		last->adsr_def.sustain_time = seq_unpack_byte(decoder);
+		last->adsr_def.release_time = seq_unpack_byte(decoder);
+	}
+	if (mask & SEQ_PACK_AMPS) {
+		last->adsr_def.peak_amp = seq_unpack_byte(decoder);
+		last->adsr_def.sustain_amp = seq_unpack_byte(decoder);
+	}
+
+	*frame = *last;
+	return 1;
+}
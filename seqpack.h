@@ -0,0 +1,368 @@
+/*!
+ * Polyphonic synthesizer for microcontrollers.  Compact sequencer stream.
+ * (C) 2026 The atinysynth contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+#ifndef _SEQPACK_H
+#define _SEQPACK_H
+
+#include "sequencer.h"
+
+/*!
+ * Compact, versioned encoding of a compiled sequencer stream.
+ *
+ * Header, 9 bytes, multi-byte values are little-endian:
+ *   'S' 'E' 'Q' version(1) synth_frequency(16) voices(8) frames(16)
+ *
+ * Every frame is coded against the previous frame of the stream (all
+ * zeros for the first one): a field mask byte (`SEQ_PACK_*` bits)
+ * followed by the changed fields only, in bit order.  The period is
+ * stored as a zig-zag varint difference, the time scale as a varint,
+ * the other fields as plain bytes.
+ *
+ * Version 2 streams carry an instrument table after the header: a count
+ * byte, then `SEQ_PACK_INSTRUMENT_SIZE` bytes per instrument (mode,
+ * amplitude, delay, attack, decay, sustain and release times, peak and
+ * sustain amplitudes).  A frame is then a single byte with the
+ * `SEQ_PACK_NOTE_PERIOD` and `SEQ_PACK_NOTE_TIME_SCALE` bits and the
+ * instrument index in the upper bits (`SEQ_PACK_INSTRUMENT_ESCAPE` means that the
+ * index follows in the next byte), followed by the period difference and
+ * the time scale, if changed.
+ *
+ * Version 3 streams have a longer header, 22 bytes:
+ *   'S' 'E' 'Q' 3 synth_frequency(16) voices(8) frames(32) flags(8)
+ *   chunk_frames(16) chunks(32) index_offset(32)
+ * followed by the instrument table if `SEQ_PACK_FLAG_INSTRUMENTS` is set,
+ * and by the frames, coded as in version 2 or 1 respectively.  The frames
+ * are grouped in chunks of `chunk_frames` frames, the first one coded
+ * against an all zeros frame: a chunk can be decoded on its own.  The
+ * chunk index, at `index_offset` from the start of the stream, lists the
+ * offset, size and FNV-1a hash of every chunk (`SEQ_PACK_CHUNK_SIZE`
+ * bytes each), so a long stream can be validated, prefetched and played
+ * from any chunk.
+ *
+ * Version 3 streams with `SEQ_PACK_FLAG_LOOPS` also carry control records
+ * between the frames: a mask byte `SEQ_PACK_CONTROL` (version 1 coding)
+ * or an escaped instrument index `SEQ_PACK_CONTROL_INDEX` (version 2
+ * coding), followed by a varint: the number of times a loop is played
+ * at its start, zero at its end.  The first frame of the loop is coded
+ * against an all zeros frame, and the frames are counted as played.
+ * Loops can be nested, up to `SEQ_PACK_MAX_LOOPS` levels, and never cross
+ * a chunk.  With `SEQ_PACK_FLAG_REPEAT` the stream plays forever: the
+ * first frame follows the last one.
+ *
+ * The decoder doesn't need heap memory: its state is the previous frame,
+ * a frame counter, the instrument table and the open loops.
+ */
+
+/*! Version with field masks */
+#define SEQ_PACK_VERSION	(1)
+/*! Version with instrument table */
+#define SEQ_PACK_VERSION_INSTRUMENTS	(2)
+
+/*! Version with 32-bit counts and chunks */
+#define SEQ_PACK_VERSION_CHUNKED	(3)
+
+/*! Size of the header in bytes */
+#define SEQ_PACK_HEADER_SIZE	(9)
+/*! Size of the version 3 header in bytes */
+#define SEQ_PACK_HEADER_CHUNKED_SIZE	(22)
+
+/*! Version 3 flag: instrument table, frames coded as in version 2 */
+#define SEQ_PACK_FLAG_INSTRUMENTS	(1 << 0)
+/*! Version 3 flag: loop control records between the frames */
+#define SEQ_PACK_FLAG_LOOPS		(1 << 1)
+/*! Version 3 flag: the stream restarts after the last frame */
+#define SEQ_PACK_FLAG_REPEAT		(1 << 2)
+
+/*! Size of a chunk index entry in bytes */
+#define SEQ_PACK_CHUNK_SIZE	(12)
+
+/*! Initial value of `seq_pack_hash` */
+#define SEQ_PACK_HASH_INIT	(2166136261UL)
+
+/* Field mask bits */
+#define SEQ_PACK_MODE		(1 << 0)
+#define SEQ_PACK_AMPLITUDE	(1 << 1)
+#define SEQ_PACK_PERIOD		(1 << 2)
+#define SEQ_PACK_TIME_SCALE	(1 << 3)
+/*! Delay, attack and decay times */
+#define SEQ_PACK_ATTACK		(1 << 4)
+/*! Sustain and release times */
+#define SEQ_PACK_RELEASE	(1 << 5)
+/*! Peak and sustain amplitudes */
+#define SEQ_PACK_AMPS		(1 << 6)
+/*! Control record instead of a frame, with `SEQ_PACK_FLAG_LOOPS` only */
+#define SEQ_PACK_CONTROL	(1 << 7)
+
+/* Version 2 frame bits, and instrument index */
+#define SEQ_PACK_NOTE_PERIOD		(1 << 0)
+#define SEQ_PACK_NOTE_TIME_SCALE	(1 << 1)
+#define SEQ_PACK_INSTRUMENT_SHIFT	(2)
+#define SEQ_PACK_INSTRUMENT_ESCAPE	(0x3f)
+/*! Escaped index of a version 2 control record */
+#define SEQ_PACK_CONTROL_INDEX		(0xff)
+
+/*! Size of an instrument in the stream */
+#define SEQ_PACK_INSTRUMENT_SIZE	(9)
+
+#ifndef SEQ_PACK_MAX_INSTRUMENTS
+/*!
+ * Maximum number of instruments of a stream.  The decoder keeps them in
+ * RAM, `SEQ_PACK_INSTRUMENT_SIZE` bytes each: the value can be reduced
+ * in the `SYNTH_CFG` file.
+ */
+#define SEQ_PACK_MAX_INSTRUMENTS	(16)
+#endif
+
+#ifndef SEQ_PACK_MAX_LOOPS
+/*!
+ * Maximum nesting of the loops of a stream.  The decoder keeps the open
+ * loops in RAM, 6 bytes each: the value can be reduced in the
+ * `SYNTH_CFG` file, for streams encoded with fewer levels, and zero
+ * compiles the loops out of the decoder (streams with loops are refused).
+ */
+#define SEQ_PACK_MAX_LOOPS	(4)
+#endif
+
+#ifndef SEQ_PACK_LOOP_MAX_BODY
+/*! Longest loop body looked for by the encoder, in frames */
+#define SEQ_PACK_LOOP_MAX_BODY	(1024)
+#endif
+
+/*! 
+ * An instrument: all the fields of a frame, except the period and the
+ * time scale (the pitch and the duration of the note).
+ */
+struct seq_instrument_t {
+	/*! Waveform generation mode */
+	uint8_t mode;
+	/*! Waveform amplitude */
+	int8_t amplitude;
+	/*! Envelope times, in time units */
+	uint8_t delay_time;
+	uint8_t attack_time;
+	uint8_t decay_time;
+	uint8_t sustain_time;
+	uint8_t release_time;
+	/*! Envelope amplitudes */
+	uint8_t peak_amp;
+	uint8_t sustain_amp;
+};
+
+/*! Instrument table of a stream */
+struct seq_instrument_table_t {
+	uint8_t count;
+	struct seq_instrument_t instruments[SEQ_PACK_MAX_INSTRUMENTS];
+};
+
+/*! A chunk of a version 3 stream, as listed in the index */
+struct seq_pack_chunk_t {
+	/*! Offset of the first byte, from the start of the stream */
+	uint32_t offset;
+	/*! Size in bytes */
+	uint32_t size;
+	/*! FNV-1a hash of the bytes */
+	uint32_t hash;
+};
+
+/*! Layout of a version 3 stream, besides `seq_stream_header_t` */
+struct seq_pack_chunking_t {
+	/*! Frames per chunk, the last one can be shorter */
+	uint16_t chunk_frames;
+	/*! Number of chunks */
+	uint32_t chunks;
+	/*! Offset of the chunk index, from the start of the stream */
+	uint32_t index_offset;
+};
+
+/*! An open loop of the decoder */
+struct seq_pack_loop_t {
+	/*! Offset of the first frame, from the start of the stream */
+	uint32_t offset;
+	/*! Repetitions left */
+	uint16_t left;
+};
+
+/*! Encoder state */
+struct seq_pack_encoder_t {
+	/*! Byte writer, must return zero on success */
+	int (*write)(void* user, const uint8_t* data, uint8_t len);
+	void* user;
+	/*! Instruments of a version 2 stream, or NULL */
+	const struct seq_instrument_table_t* instruments;
+	/*! Last encoded frame, base of the differences */
+	struct seq_frame_t last;
+	/*! Bytes written from the start of the stream */
+	uint32_t offset;
+	/*! Frames per chunk, or zero for versions 1 and 2 */
+	uint16_t chunk_frames;
+	/*! Frames left in the current chunk */
+	uint16_t chunk_left;
+	/*! The current chunk */
+	struct seq_pack_chunk_t chunk;
+	/*! Index entry writer, called at the end of every chunk, must return zero on success */
+	int (*index)(void* user, const struct seq_pack_chunk_t* chunk);
+	void* index_user;
+	/*! Set once a loop is written: the stream needs `SEQ_PACK_FLAG_LOOPS` */
+	uint8_t loops;
+};
+
+/*! Decoder state */
+struct seq_pack_decoder_t {
+	/*! Byte reader, returns the next byte of the stream */
+	uint8_t (*read)(void* user);
+	void* user;
+	/*!
+	 * Moves the reader back by `bytes`, returns zero on success.  Needed
+	 * by the loops: without it (NULL) a stream ends at its first loop end.
+	 */
+	int (*rewind)(void* user, uint32_t bytes);
+	/*! Frames left to decode */
+	uint32_t frames;
+	/*! Frames of the stream */
+	uint32_t frame_count;
+	/*! Frame coding, `SEQ_PACK_VERSION` or `SEQ_PACK_VERSION_INSTRUMENTS` */
+	uint8_t version;
+	/*! `SEQ_PACK_FLAG_*` bits of a version 3 stream, zero otherwise */
+	uint8_t flags;
+	/*! Restart after the last frame, cleared to play a repeated stream once */
+	uint8_t repeat;
+	/*! Offset of the next byte, and of the first frame, from the start of the stream */
+	uint32_t offset;
+	uint32_t start;
+#if SEQ_PACK_MAX_LOOPS
+	/*! Open loops, innermost last */
+	struct seq_pack_loop_t loops[SEQ_PACK_MAX_LOOPS];
+	uint8_t loop_count;
+#endif
+	/*! Chunks of a version 3 stream (`chunk_frames` is zero otherwise) */
+	struct seq_pack_chunking_t chunking;
+	/*! Frames left in the current chunk */
+	uint16_t chunk_left;
+	/*! Last decoded frame, base of the differences */
+	struct seq_frame_t last;
+	/*! Instruments of a version 2 stream */
+	struct seq_instrument_table_t instruments;
+};
+
+/*! 
+ * Add the instrument of a frame to a table, if not already there.
+ * Use it as `seq_frame_sink_t` handler, with the table as user data, to
+ * collect the instruments of a stream.  Returns non-zero if the table
+ * is full.
+ */
+int seq_pack_add_instrument(void* table, const struct seq_frame_t* frame);
+
+/*! 
+ * Encode the header in `data`, `SEQ_PACK_HEADER_SIZE` bytes.  `version`
+ * must be `SEQ_PACK_VERSION_INSTRUMENTS` if the encoder has instruments.
+ * Versions 1 and 2 can't count more than 65535 frames.
+ */
+void seq_pack_header(uint8_t* data, const struct seq_stream_header_t* header, uint8_t version);
+
+/*! 
+ * Encode a version 3 header in `data`, `SEQ_PACK_HEADER_CHUNKED_SIZE`
+ * bytes.  `flags` are the `SEQ_PACK_FLAG_*` bits.
+ */
+void seq_pack_header_chunked(uint8_t* data, const struct seq_stream_header_t* header, uint8_t flags, const struct seq_pack_chunking_t* chunking);
+
+/*! Encode and decode a chunk index entry, `SEQ_PACK_CHUNK_SIZE` bytes */
+void seq_pack_chunk_encode(uint8_t* data, const struct seq_pack_chunk_t* chunk);
+void seq_pack_chunk_decode(struct seq_pack_chunk_t* chunk, const uint8_t* data);
+
+/*! Continue a FNV-1a hash (start from `SEQ_PACK_HASH_INIT`) */
+uint32_t seq_pack_hash(uint32_t hash, const uint8_t* data, uint32_t len);
+
+/*! 
+ * Prepare the encoder of what follows the header.  If `instruments` is
+ * not NULL, the table is written immediately and the frames are encoded
+ * in the version 2 format: it must contain all the instruments of the
+ * stream.  Returns non-zero if the writer failed.
+ */
+int seq_pack_encoder_init(struct seq_pack_encoder_t* encoder, int (*write)(void* user, const uint8_t* data, uint8_t len), void* user, const struct seq_instrument_table_t* instruments);
+
+/*! 
+ * Prepare the encoder of a version 3 stream, after its header: as
+ * `seq_pack_encoder_init`, and the frames are grouped in chunks of
+ * `chunk_frames` frames.  `index` is called with every completed chunk,
+ * the caller writes the index at the end of the stream.  Returns non-zero
+ * if the writer failed.
+ */
+int seq_pack_encoder_init_chunked(struct seq_pack_encoder_t* encoder, int (*write)(void* user, const uint8_t* data, uint8_t len), void* user, const struct seq_instrument_table_t* instruments, uint16_t chunk_frames, int (*index)(void* user, const struct seq_pack_chunk_t* chunk), void* index_user);
+
+/*! 
+ * Complete the last chunk of a version 3 stream, if any, after the last
+ * frame.  Returns non-zero if the index writer failed.
+ */
+int seq_pack_encoder_finish(struct seq_pack_encoder_t* encoder);
+
+/*!
+ * Encode a frame.  Use it as `seq_frame_sink_t` handler, with the
+ * encoder as user data.
+ */
+int seq_pack_write_frame(void* encoder, const struct seq_frame_t* frame);
+
+/*!
+ * Encode `count` frames, the repeated sequences as loops of up to `depth`
+ * levels (a greedy search, bodies up to `SEQ_PACK_LOOP_MAX_BODY` frames).
+ * Loops need a version 3 stream, `depth` is ignored otherwise; `loops` is
+ * set if any is written.  Returns non-zero if the writer failed.
+ *
+ * Unlike `seq_pack_write_frame`, the frames must all be in memory: a host
+ * tool buffers the whole song to look for its loops.
+ */
+int seq_pack_write_frames(struct seq_pack_encoder_t* encoder, const struct seq_frame_t* frames, uint32_t count, uint8_t depth);
+
+/*!
+ * Read and check the header (and the instruments), and prepare the
+ * decoder of the frames.  Returns non-zero if the stream is not a
+ * supported compact stream.
+ */
+int seq_pack_decoder_init(struct seq_pack_decoder_t* decoder, uint8_t (*read)(void* user), void* user, struct seq_stream_header_t* header);
+
+/*!
+ * Set the reader rewind of the decoder, needed by the streams with loops
+ * or repeated.  Without it, such a stream ends at its first loop end.
+ */
+void seq_pack_decoder_set_rewind(struct seq_pack_decoder_t* decoder, int (*rewind)(void* user, uint32_t bytes));
+
+/*!
+ * Continue decoding a version 3 stream from the first frame of a chunk:
+ * the reader must then read from `offset`, the offset of the chunk as
+ * listed in the index.  Returns non-zero if the stream has no such chunk.
+ */
+int seq_pack_decoder_seek_chunk(struct seq_pack_decoder_t* decoder, uint32_t chunk, uint32_t offset);
+
+/*!
+ * Byte reader for a stream embedded in the program image.  `user` points
+ * to the read position, a `const uint8_t*` that is advanced.  On AVR the
+ * stream is read from flash (PROGMEM, see `genseq.py`), so it doesn't
+ * need any RAM copy.
+ */
+uint8_t seq_pack_read_rom(void* user);
+
+/*! Reader rewind for `seq_pack_read_rom` */
+int seq_pack_rewind_rom(void* user, uint32_t bytes);
+
+/*!
+ * Decode the next frame, returns zero at the end of the stream.
+ * Use it as `seq_frame_source_t` handler, with the decoder as user data.
+ */
+uint8_t seq_pack_read_frame(void* decoder, struct seq_frame_t* frame);
+
+#endif
@@ -23,136 +23,682 @@
 #include <stdlib.h>
 #include <string.h>
 
-/*! State used between `seq_play_stream` and `seq_feed_synth` */
-static int frame_count;
-static uint8_t voice_count;
+/*!
+ * Compiler barrier around the staging slot: its content is written before
+ * `stage` publishes it, and read before `stage` releases it, even though
+ * only `stage` is volatile.  The producer and the consumer share a core.
+ */
+#define SEQ_BARRIER()	__asm__ __volatile__ ("" ::: "memory")
+
+/*! Player of the legacy single-stream API, fed by a handler without context */
+static struct seq_player_t default_player;
 static uint8_t (*new_frame_require)(struct seq_frame_t* frame);
 
 void seq_set_stream_require_handler(uint8_t (*handler)(struct seq_frame_t* frame)) {
 	new_frame_require = handler;
 }
 
+/*! Frame source handler of the default player */
+static uint8_t seq_read_default(void* user, struct seq_frame_t* frame) {
+	(void)user;
+	return new_frame_require(frame);
+}
+
+/*! Voice of the sequencer compiler, bound to a non-empty channel */
+struct compiler_voice_t {
+	/*! The input channel */
+	struct seq_frame_source_t* channel;
+	/*! The next frame of the channel */
+	struct seq_frame_t frame;
+	/*! The sample at which the voice becomes free */
+	uint32_t free_at;
+};
+
 /*! State of the sequencer compiler */
 struct compiler_state_t {
-	/*! The synth used for simulation */
-	struct poly_synth_t* synth;
-	/*! The input channel map */
-	struct seq_frame_map_t* input_map;
-	/*! The output frame stream */
-	struct seq_frame_t* out_stream;
-	/*! The position of writing frame in the output stream */
-	int stream_position;
-	/*! The positions of every channel in the input channel map */
-	int* channel_positions;
+	/*! The voices, one per non-empty channel */
+	struct compiler_voice_t* voices;
+	/*! Min-heap of busy voice indexes, ordered by `free_at` */
+	int* busy;
+	/*! Number of voices in `busy` */
+	int busy_count;
+	/*! Bit-field of free voices with frames left to play */
+	uintptr_t ready;
 };
 
-/*! Feed the first free channel and copy the selected frame in the output stream */
-static void seq_feed_channels(struct compiler_state_t* state) {
-	intptr_t mask = 1;
-	int voice_idx = 0;
-	for (int map_idx = 0; map_idx < state->input_map->channel_count; map_idx++) {
-		// Skip empty channels
-		const struct seq_frame_list_t* channel = &state->input_map->channels[map_idx]; 
-		if (channel->count > 0) {
-			if (state->channel_positions[voice_idx] < channel->count && (state->synth->enable & mask) == 0) {
-				// Feed data
-				struct seq_frame_t* frame = channel->frames + (state->channel_positions[voice_idx]++);
-
-				voice_wf_set(&state->synth->voice[voice_idx].wf, &frame->waveform_def);
-				adsr_config(&state->synth->voice[voice_idx].adsr, &frame->adsr_def);
-
-				state->synth->enable |= mask;
-
-				state->out_stream[state->stream_position++] = *frame;
-				// Don't overload the CPU with multiple frames per sample
-				// This will create minimum phase errors (of 1 sample period) but will keep the process real-time on slower CPUs
-				break;
-			}
-			mask <<= 1;
+static void seq_busy_push(struct compiler_state_t* state, int voice_idx) {
+	int pos = state->busy_count++;
+	uint32_t free_at = state->voices[voice_idx].free_at;
+	while (pos > 0) {
+		int parent = (pos - 1) / 2;
+		if (state->voices[state->busy[parent]].free_at <= free_at)
+			break;
+		state->busy[pos] = state->busy[parent];
+		pos = parent;
+	}
+	state->busy[pos] = voice_idx;
+}
+
+static int seq_busy_pop(struct compiler_state_t* state) {
+	int top = state->busy[0];
+	int last = state->busy[--state->busy_count];
+	uint32_t free_at = state->voices[last].free_at;
+	int pos = 0;
+	while (1) {
+		int child = pos * 2 + 1;
+		if (child >= state->busy_count)
+			break;
+		if ((child + 1) < state->busy_count
+				&& state->voices[state->busy[child + 1]].free_at
+				< state->voices[state->busy[child]].free_at)
+			child++;
+		if (free_at <= state->voices[state->busy[child]].free_at)
+			break;
+		state->busy[pos] = state->busy[child];
+		pos = child;
+	}
+	state->busy[pos] = last;
+	return top;
+}
+
+/*! Move all the voices free at `sample` to the ready set */
+static void seq_release_voices(struct compiler_state_t* state, uint32_t sample) {
+	while (state->busy_count
+			&& state->voices[state->busy[0]].free_at <= sample) {
+		state->ready |= (uintptr_t)1 << seq_busy_pop(state);
+	}
+}
+
+int seq_compile_stream(struct seq_frame_source_t* channels, int channel_count, struct seq_frame_sink_t* sink, int* frame_count, int* voice_count) {
+	struct compiler_state_t state;
+	state.voices = malloc(sizeof(struct compiler_voice_t) * channel_count);
+	state.busy = malloc(sizeof(int) * channel_count);
+	state.busy_count = 0;
+	state.ready = 0;
+
+	// Skip empty channels
+	int valid_channel_count = 0;
+	for (int i = 0; i < channel_count; i++) {
+		struct compiler_voice_t* voice = &state.voices[valid_channel_count];
+		if (channels[i].read(channels[i].user, &voice->frame)) {
+			voice->channel = &channels[i];
+			voice->free_at = 0;
+			state.ready |= (uintptr_t)1 << valid_channel_count;
+			valid_channel_count++;
+		}
+	}
+	*voice_count = valid_channel_count;
+
+	/*
+	 * The synth frees a voice exactly `adsr_duration` samples after it
+	 * has been fed, so the fetch order can be computed without running
+	 * the synth: it is a merge of the channels by end time.  As the
+	 * player does, feed at most one frame per sample, to the free voice
+	 * with the lowest index.
+	 */
+	int err = 0;
+	int stream_position = 0;
+	uint32_t sample = 0;
+	while (state.ready) {
+		int voice_idx = 0;
+		while (!(state.ready & ((uintptr_t)1 << voice_idx)))
 			voice_idx++;
+		state.ready &= ~((uintptr_t)1 << voice_idx);
+
+		struct compiler_voice_t* voice = &state.voices[voice_idx];
+		err = sink->write(sink->user, &voice->frame);
+		if (err) {
+			break;
+		}
+		stream_position++;
+
+		uint32_t duration = adsr_duration(&voice->frame.adsr_def);
+		// A voice that never ends cannot play the rest of its channel
+		if (duration < (UINT32_MAX - sample)
+				&& voice->channel->read(voice->channel->user, &voice->frame)) {
+			voice->free_at = sample + duration;
+			seq_busy_push(&state, voice_idx);
+		}
+
+		sample++;
+		seq_release_voices(&state, sample);
+		if (!state.ready && state.busy_count) {
+			// Nothing to do until the next voice is free
+			sample = state.voices[state.busy[0]].free_at;
+			seq_release_voices(&state, sample);
 		}
 	}
+	*frame_count = stream_position;
+
+	free(state.voices);
+	free(state.busy);
+	return err;
+}
+
+/*! Frame source handler for a channel of a frame map */
+static uint8_t seq_read_list(void* user, struct seq_frame_t* frame) {
+	struct seq_frame_list_t* list = user;
+	if (!list->count) {
+		return 0;
+	}
+	*frame = *(list->frames++);
+	list->count--;
+	return 1;
+}
+
+/*! Frame sink handler for a frame array */
+static int seq_write_array(void* user, const struct seq_frame_t* frame) {
+	struct seq_frame_t** pos = user;
+	*((*pos)++) = *frame;
+	return 0;
+}
+
+void seq_frame_map_open(const struct seq_frame_map_t* map, struct seq_frame_list_t* lists, struct seq_frame_source_t* channels) {
+	for (int i = 0; i < map->channel_count; i++) {
+		lists[i] = map->channels[i];
+		channels[i].read = seq_read_list;
+		channels[i].user = &lists[i];
+	}
 }
 
 void seq_compile(struct seq_frame_map_t* map, struct seq_frame_t** frame_stream, int* frame_count, int* voice_count) {
 	int total_frame_count = 0;
-	// Skip empty channels
-	int valid_channel_count = 0;
 	for (int i = 0; i < map->channel_count; i++) {
-		if (map->channels[i].count > 0) {
-			valid_channel_count++;
-			total_frame_count += map->channels[i].count;
-		}
+		total_frame_count += map->channels[i].count;
 	}
 
 	// Prepare output buffer, with total frame count
-	*frame_count = total_frame_count;
-	*voice_count = valid_channel_count;
 	*frame_stream = malloc(sizeof(struct seq_frame_t) * total_frame_count);
 
-	// Now play sequencer data, currently by channel, simulating the timing of the synth.
- 	struct poly_synth_t synth;
-	struct voice_ch_t* poly_voice = malloc(sizeof(struct voice_ch_t) * valid_channel_count);
-	synth.voice = poly_voice;
+	// Read the channels through copies of the lists, the map is left untouched
+	struct seq_frame_list_t* lists = malloc(sizeof(struct seq_frame_list_t) * map->channel_count);
+	struct seq_frame_source_t* channels = malloc(sizeof(struct seq_frame_source_t) * map->channel_count);
+	seq_frame_map_open(map, lists, channels);
+
+	struct seq_frame_t* pos = *frame_stream;
+	struct seq_frame_sink_t sink;
+	sink.write = seq_write_array;
+	sink.user = &pos;
+	seq_compile_stream(channels, map->channel_count, &sink, frame_count, voice_count);
+
+	free(lists);
+	free(channels);
+}
+
+int seq_frame_map_repeats(struct seq_frame_map_t* map) {
+	struct seq_frame_map_t twice;
+	twice.channel_count = map->channel_count;
+	twice.channels = malloc(sizeof(struct seq_frame_list_t) * map->channel_count);
+	for (int i = 0; i < map->channel_count; i++) {
+		const struct seq_frame_list_t* list = &map->channels[i];
+		twice.channels[i].count = list->count * 2;
+		twice.channels[i].frames = malloc(sizeof(struct seq_frame_t) * list->count * 2);
+		memcpy(twice.channels[i].frames, list->frames, sizeof(struct seq_frame_t) * list->count);
+		memcpy(twice.channels[i].frames + list->count, list->frames, sizeof(struct seq_frame_t) * list->count);
+	}
+
+	struct seq_frame_t* once_stream;
+	struct seq_frame_t* twice_stream;
+	int once_count, once_voices, twice_count, twice_voices;
+	seq_compile(map, &once_stream, &once_count, &once_voices);
+	seq_compile(&twice, &twice_stream, &twice_count, &twice_voices);
+	int repeats = once_count > 0 && twice_count == once_count * 2 && twice_voices == once_voices;
+	for (int i = 0; repeats && i < twice_count; i++) {
+		repeats = seq_frame_equal(&twice_stream[i], &once_stream[i % once_count]);
+	}
+
+	seq_free(once_stream);
+	seq_free(twice_stream);
+	for (int i = 0; i < twice.channel_count; i++) {
+		free(twice.channels[i].frames);
+	}
+	free(twice.channels);
+	return repeats;
+}
+
+uint8_t seq_frame_equal(const struct seq_frame_t* a, const struct seq_frame_t* b) {
+	return a->waveform_def.mode == b->waveform_def.mode
+		&& a->waveform_def.amplitude == b->waveform_def.amplitude
+		&& a->waveform_def.period == b->waveform_def.period
+		&& a->adsr_def.time_scale == b->adsr_def.time_scale
+		&& a->adsr_def.delay_time == b->adsr_def.delay_time
+		&& a->adsr_def.attack_time == b->adsr_def.attack_time
+		&& a->adsr_def.decay_time == b->adsr_def.decay_time
+		&& a->adsr_def.sustain_time == b->adsr_def.sustain_time
+		&& a->adsr_def.release_time == b->adsr_def.release_time
+		&& a->adsr_def.peak_amp == b->adsr_def.peak_amp
+		&& a->adsr_def.sustain_amp == b->adsr_def.sustain_amp;
+}
+
+/*! Frame source that counts the frames read, for the keyframes */
+struct seq_counted_source_t {
+	struct seq_frame_source_t source;
+	uint32_t count;
+};
+
+static uint8_t seq_read_counted(void* user, struct seq_frame_t* frame) {
+	struct seq_counted_source_t* counted = user;
+	if (!counted->source.read(counted->source.user, frame)) {
+		return 0;
+	}
+	counted->count++;
+	return 1;
+}
+
+/*!
+ * Voices of the stream as the synth would render them, advanced only at
+ * the keyframes from the timing of the player.
+ */
+struct seq_keyframe_voices_t {
+	struct voice_ch_t voice[SEQ_MAX_VOICES];
+	/*! Player clock the voices were advanced to */
+	uint32_t clock[SEQ_MAX_VOICES];
+	/*! Voices the synth still renders */
+	uintptr_t enable;
+};
+
+/*! Advance the voices to the player clock, as `poly_synth_next` */
+static void seq_keyframe_advance(struct seq_keyframe_voices_t* voices, const struct seq_player_t* player) {
+	for (uint8_t i = 0; i < player->voice_count; i++) {
+		uintptr_t mask = (uintptr_t)1 << i;
+		uint32_t samples = player->clock - voices->clock[i];
+		voices->clock[i] = player->clock;
+		if (!(voices->enable & mask)) {
+			continue;
+		}
+		struct voice_ch_t* voice = &voices->voice[i];
+		voice_ch_skip(voice, samples);
+		if (voice_ch_is_done(voice)) {
+			voices->enable &= ~mask;
+			adsr_reset(&voice->adsr);
+		}
+	}
+}
+
+/*! Snapshot of the player state and of its voices */
+static void seq_keyframe_take(struct seq_keyframe_t* keyframe, const struct seq_player_t* player, const struct seq_keyframe_voices_t* voices, uint32_t frame) {
+	keyframe->clock = player->clock;
+	keyframe->frame = frame;
+	keyframe->next_due = player->next_due;
+	memcpy(keyframe->voice_due, player->voice_due, sizeof(keyframe->voice_due));
+#ifdef ADSR_SHARED_DEF
+	memcpy(keyframe->voice_def, player->voice_def, sizeof(keyframe->voice_def));
+#endif
+	keyframe->enable = voices->enable;
+	memcpy(keyframe->voice, voices->voice, sizeof(struct voice_ch_t) * player->voice_count);
+}
+
+int seq_compile_keyframes(const struct seq_stream_header_t* stream_header, const struct seq_frame_source_t* source, uint16_t tempo, uint32_t interval, struct seq_keyframe_list_t* list) {
+	struct seq_counted_source_t counted;
+	counted.source = *source;
+	counted.count = 0;
+	struct seq_frame_source_t counting;
+	counting.read = seq_read_counted;
+	counting.user = &counted;
+
+	// The player only configures the voices of a private synth, that is
+	// never rendered: the voices are then advanced up to each keyframe
+	struct poly_synth_t synth;
+	struct seq_player_t player;
+	struct seq_keyframe_voices_t* voices = calloc(1, sizeof(struct seq_keyframe_voices_t));
+	synth.voice = calloc(SEQ_MAX_VOICES, sizeof(struct voice_ch_t));
 	synth.mute = 0;
-	synth.enable = 0;
+	list->interval = interval;
+	list->count = 0;
+	list->keyframes = NULL;
+	if (!interval || seq_player_init(&player, stream_header, SEQ_MAX_VOICES, &synth, &counting)) {
+		free(synth.voice);
+		free(voices);
+		return 1;
+	}
+#if SEQ_RETIME
+	seq_player_set_tempo(&player, tempo);
+#else
+	(void)tempo;
+#endif
 
-	struct compiler_state_t state;
-	state.channel_positions = malloc(sizeof(int) * valid_channel_count);
-	memset(state.channel_positions, 0, sizeof(int) * valid_channel_count);
-	state.input_map = map;
-	state.out_stream = *frame_stream;
-	state.stream_position = 0;
-	state.synth = &synth;
+	// Between two samples, the keyframe is the state before the next feed
+	uint32_t size = 0;
+	uint32_t end = 0;
+	while (player.clock < end || player.next_due != UINT32_MAX) {
+		if (!(player.clock % interval)) {
+			if (list->count == size) {
+				size += 64;
+				list->keyframes = realloc(list->keyframes, sizeof(struct seq_keyframe_t) * size);
+			}
+			seq_keyframe_advance(voices, &player);
+			seq_keyframe_take(&list->keyframes[list->count++], &player, voices, counted.count);
+		}
 
-	seq_feed_channels(&state);
-	while (synth.enable) {
-		poly_synth_next(&synth);
-		seq_feed_channels(&state);
+		// Jump to the next feed or keyframe, whichever comes first
+		uint32_t next = player.clock - (player.clock % interval);
+		next = (next <= (UINT32_MAX - interval)) ? (next + interval) : UINT32_MAX;
+		uint32_t due = (player.next_due != UINT32_MAX) ? player.next_due : end;
+		if (player.clock < due) {
+			player.clock = (next < due) ? next : due;
+			continue;
+		}
+
+		uint32_t voice_due[SEQ_MAX_VOICES];
+		memcpy(voice_due, player.voice_due, sizeof(voice_due));
+		seq_player_feed(&player);
+		for (uint8_t i = 0; i < player.voice_count; i++) {
+			if (player.voice_due[i] != voice_due[i]) {
+				// A new note, rendered from the next sample
+				voices->voice[i] = synth.voice[i];
+				voices->clock[i] = player.clock - 1;
+				voices->enable |= (uintptr_t)1 << i;
+			}
+		}
+		if (player.next_due == UINT32_MAX) {
+			// End-of-stream: wait for the last notes, unless they never end
+			end = player.clock;
+			for (uint8_t i = 0; i < player.voice_count; i++) {
+				if (player.voice_due[i] != UINT32_MAX && player.voice_due[i] > end) {
+					end = player.voice_due[i];
+				}
+			}
+		}
 	}
+	list->length = player.clock;
+
+	free(synth.voice);
+	free(voices);
+	return 0;
+}
+
+void seq_keyframes_free(struct seq_keyframe_list_t* list) {
+	free(list->keyframes);
+	list->keyframes = NULL;
+	list->count = 0;
+}
 
-	free(poly_voice);
-	free(state.channel_positions);
+int seq_player_init(struct seq_player_t* player, const struct seq_stream_header_t* stream_header, uint8_t voice_count, struct poly_synth_t* synth, const struct seq_frame_source_t* source) {
+	if (seq_player_init_layer(player, stream_header, voice_count, synth, source, 0, NULL)) {
+		return 1;
+	}
+	// Disable all channels
+	synth->enable = 0;
+	return 0;
 }
 
-int seq_play_stream(const struct seq_stream_header_t* stream_header, uint8_t _voice_count, struct poly_synth_t* synth) {
-	if (stream_header->voices > _voice_count) {
+int seq_player_init_layer(struct seq_player_t* player, const struct seq_stream_header_t* stream_header, uint8_t voice_count, struct poly_synth_t* synth, const struct seq_frame_source_t* source, uint8_t first_voice, struct seq_player_t* above) {
+	if ((stream_header->voices + first_voice) > voice_count || stream_header->voices > SEQ_MAX_VOICES) {
 		_DPRINTF("Not enough voices");
 		return 1;
 	}
+#if SEQ_RETIME
+	if (!stream_header->synth_frequency) {
+		_DPRINTF("Invalid sampling frequency");
+		return 1;
+	}
+	player->stream_freq = stream_header->synth_frequency;
+	player->tempo = SEQ_TEMPO_NORMAL;
+	player->retime_error = 0;
+#else
 	if (stream_header->synth_frequency != synth_freq) {
 		_DPRINTF("Mismatching sampling frequency");
 		return 1;
 	}
+#endif
 
-	frame_count = stream_header->frames;
-	voice_count = stream_header->voices;
-	// Disable all channels
-	synth->enable = 0;
+	player->synth = synth;
+	player->source = *source;
+	player->voice_count = stream_header->voices;
+	player->first_voice = first_voice;
+	player->above = above;
+	player->playing = 0;
+	// The voices are left playing, each one is reset by its first frame
+	for (uint8_t i = 0; i < player->voice_count; i++) {
+		player->voice_due[i] = 0;
+	}
+	player->clock = 0;
+	player->next_due = 0;
+	player->stage = SEQ_STAGE_OFF;
 	return 0;
 }
 
-void seq_feed_synth(struct poly_synth_t* synth) {
-	uintptr_t mask = 1;
-	for (uint8_t i = 0; i < voice_count; i++, mask <<= 1) {
-		if ((synth->enable & mask) == 0) {
+#if SEQ_RETIME
+void seq_player_set_tempo(struct seq_player_t* player, uint16_t tempo) {
+	player->tempo = tempo;
+}
+
+/*! 
+ * Round `value * num / den`, saturated to `max` and not zero if `value`
+ * isn't (a zero period or time scale would stop the note), and track the
+ * relative error.
+ */
+static uint32_t seq_retime_value(struct seq_player_t* player, uint32_t value, uint64_t num, uint64_t den, uint32_t max) {
+	if (!value) {
+		return 0;
+	}
+
+	uint64_t exact = value * num;
+	uint64_t scaled = (exact + den / 2) / den;
+	if (!scaled) {
+		scaled = 1;
+	} else if (scaled > max) {
+		scaled = max;
+	}
+
+	// Error relative to the exact value, in parts per million
+	uint64_t approx = scaled * den;
+	uint64_t diff = (approx > exact) ? (approx - exact) : (exact - approx);
+	uint64_t error = (diff <= (UINT64_MAX / 1000000))
+		? ((diff * 1000000) / exact) : (diff / (exact / 1000000));
+	if (error > player->retime_error) {
+		player->retime_error = (error < UINT32_MAX) ? error : UINT32_MAX;
+	}
+	return scaled;
+}
+
+/*! Rescale a frame compiled for the stream sample rate and tempo */
+static void seq_retime_frame(struct seq_player_t* player, struct seq_frame_t* frame) {
+	// The pitch only depends on the sample rate
+	frame->waveform_def.period = seq_retime_value(player,
+			frame->waveform_def.period, synth_freq,
+			player->stream_freq, UINT16_MAX);
+	frame->adsr_def.time_scale = seq_retime_value(player,
+			frame->adsr_def.time_scale,
+			(uint64_t)synth_freq * SEQ_TEMPO_NORMAL,
+			(uint64_t)player->stream_freq * player->tempo, UINT32_MAX);
+}
+#endif
+
+void seq_player_prepare(struct seq_player_t* player) {
+	if (player->stage == SEQ_STAGE_READY || player->stage == SEQ_STAGE_END) {
+		return;
+	}
+
+	struct seq_frame_t frame;
+	if (!player->source.read(player->source.user, &frame)) {
+		player->stage = SEQ_STAGE_END;
+		return;
+	}
+
+#if SEQ_RETIME
+	if (player->stream_freq != synth_freq || player->tempo != SEQ_TEMPO_NORMAL) {
+		seq_retime_frame(player, &frame);
+	}
+#endif
+
+	struct seq_staged_frame_t* staged = &player->staged;
+	voice_wf_set(&staged->wf, &frame.waveform_def);
+	staged->adsr_def = frame.adsr_def;
+	staged->duration = adsr_duration(&frame.adsr_def);
+	// Publish the frame only once written
+	SEQ_BARRIER();
+	player->stage = SEQ_STAGE_READY;
+}
+
+/*! Non-zero if a layer above plays a note on the voices of `mask` */
+static uint8_t seq_voice_taken(const struct seq_player_t* player, uintptr_t mask) {
+	for (struct seq_player_t* above = player->above; above; above = above->above) {
+		// The synth disables the voice when the note above is done
+		above->playing &= player->synth->enable;
+		if (above->playing & mask) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void seq_player_feed(struct seq_player_t* player) {
+	// Voices are only freed at known samples: nothing to do in between
+	if (player->clock < player->next_due) {
+		player->clock++;
+		return;
+	}
+
+	for (uint8_t i = 0; i < player->voice_count; i++) {
+		if (player->voice_due[i] <= player->clock) {
 			// Feed data
-			struct seq_frame_t frame;
-			if (!new_frame_require(&frame)) {
-				// End-of-stream
+			uint8_t lookahead = (player->stage != SEQ_STAGE_OFF);
+			if (!lookahead) {
+				// Read and configure the frame now
+				player->stage = SEQ_STAGE_EMPTY;
+				seq_player_prepare(player);
+			}
+			if (player->stage == SEQ_STAGE_EMPTY) {
+				// Not staged yet, retry at the next sample
+				break;
+			}
+			if (player->stage == SEQ_STAGE_END) {
+				// End-of-stream, the clock still counts the samples
+				player->next_due = UINT32_MAX;
+				player->clock++;
 				return;
 			}
 
-			voice_wf_set(&synth->voice[i].wf, &frame.waveform_def);
-			adsr_config(&synth->voice[i].adsr, &frame.adsr_def);
+			const struct seq_staged_frame_t* staged = &player->staged;
+			uintptr_t mask = (uintptr_t)1 << (player->first_voice + i);
+			if (!player->above || !seq_voice_taken(player, mask)) {
+				struct poly_synth_t* synth = player->synth;
+				struct voice_ch_t* voice = &synth->voice[player->first_voice + i];
+				voice->wf = staged->wf;
+#ifdef ADSR_SHARED_DEF
+				// The voice keeps a reference, the slot is reused
+				player->voice_def[i] = staged->adsr_def;
+				adsr_config(&voice->adsr, &player->voice_def[i]);
+#else
+				adsr_config(&voice->adsr, &staged->adsr_def);
+#endif
+
+				synth->enable |= mask;
+				player->playing |= mask;
+			}
+			// Otherwise the frame is skipped, but its time still elapses
+
+			// The synth will disable the voice exactly when its envelope is done
+			uint32_t duration = staged->duration;
+			player->voice_due[i] = (duration < (UINT32_MAX - player->clock))
+				? (player->clock + duration) : UINT32_MAX;
 
-			synth->enable |= mask;
+			// Release the slot, only once copied
+			SEQ_BARRIER();
+			player->stage = lookahead ? SEQ_STAGE_EMPTY : SEQ_STAGE_OFF;
 
 			// Don't overload the CPU with multiple frames per sample
 			// This will create minimum phase errors (of 1 sample period) but will keep the process real-time on slower CPUs
 			break;
 		}
 	}
+
+	player->clock++;
+	player->next_due = UINT32_MAX;
+	for (uint8_t i = 0; i < player->voice_count; i++) {
+		if (player->voice_due[i] < player->next_due) {
+			player->next_due = player->voice_due[i];
+		}
+	}
+}
+
+const struct seq_keyframe_t* seq_keyframe_find(const struct seq_keyframe_list_t* list, uint32_t clock) {
+	uint32_t low = 0;
+	uint32_t high = list->count;
+	// The keyframes are sorted by clock, the first one is at zero
+	while ((high - low) > 1) {
+		uint32_t mid = low + (high - low) / 2;
+		if (list->keyframes[mid].clock <= clock) {
+			low = mid;
+		} else {
+			high = mid;
+		}
+	}
+	return &list->keyframes[low];
+}
+
+void seq_player_restore(struct seq_player_t* player, const struct seq_keyframe_t* keyframe) {
+	struct poly_synth_t* synth = player->synth;
+	player->clock = keyframe->clock;
+	player->next_due = keyframe->next_due;
+	memcpy(player->voice_due, keyframe->voice_due, sizeof(player->voice_due));
+#ifdef ADSR_SHARED_DEF
+	memcpy(player->voice_def, keyframe->voice_def, sizeof(player->voice_def));
+#endif
+
+	uintptr_t voices = (((uintptr_t)1 << player->voice_count) - 1) << player->first_voice;
+	for (uint8_t i = 0; i < player->voice_count; i++) {
+		struct voice_ch_t* voice = &synth->voice[player->first_voice + i];
+		*voice = keyframe->voice[i];
+#ifdef ADSR_SHARED_DEF
+		// The snapshot referenced the envelopes of another player
+		voice->adsr.def = &player->voice_def[i];
+#endif
+	}
+	player->playing = keyframe->enable << player->first_voice;
+	synth->enable = (synth->enable & ~voices) | player->playing;
+
+	// A staged frame was read past the keyframe
+	if (player->stage != SEQ_STAGE_OFF) {
+		player->stage = SEQ_STAGE_EMPTY;
+	}
+}
+
+void seq_player_skip(struct seq_player_t* player, uint32_t clock) {
+	while (player->clock < clock) {
+		seq_player_feed(player);
+		poly_synth_next(player->synth);
+	}
+}
+
+int seq_player_seek(struct seq_player_t* player, const struct seq_keyframe_list_t* list, uint32_t clock, int (*rewind)(void* user, uint32_t frame), void* user) {
+	if (clock > list->length) {
+		clock = list->length;
+	}
+	const struct seq_keyframe_t* keyframe = seq_keyframe_find(list, clock);
+	if (rewind(user, keyframe->frame)) {
+		return 1;
+	}
+	seq_player_restore(player, keyframe);
+	seq_player_skip(player, clock);
+	return 0;
+}
+
+int seq_play_stream(const struct seq_stream_header_t* stream_header, uint8_t voice_count, struct poly_synth_t* synth) {
+	struct seq_frame_source_t source;
+	source.read = seq_read_default;
+	source.user = NULL;
+	return seq_player_init(&default_player, stream_header, voice_count, synth, &source);
+}
+
+void seq_feed_synth(struct poly_synth_t* synth) {
+	default_player.synth = synth;
+	seq_player_feed(&default_player);
+}
+
+#if SEQ_RETIME
+void seq_set_stream_tempo(uint16_t tempo) {
+	seq_player_set_tempo(&default_player, tempo);
+}
+
+uint32_t seq_stream_retime_error(void) {
+	return default_player.retime_error;
+}
+#endif
+
+int seq_seek_stream(const struct seq_keyframe_list_t* list, uint32_t clock, int (*rewind)(void* user, uint32_t frame), void* user) {
+	return seq_player_seek(&default_player, list, clock, rewind, user);
 }
 
 void seq_free(struct seq_frame_t* frame_stream) {
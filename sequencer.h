@@ -24,6 +24,27 @@
 #include "waveform.h"
 #include "synth.h"
 
+#ifndef SEQ_MAX_VOICES
+/*!
+ * Maximum number of voices the sequencer player can feed.  Each voice
+ * costs 4 bytes of RAM, the value can be reduced in the `SYNTH_CFG` file.
+ */
+#define SEQ_MAX_VOICES		(16)
+#endif
+
+#ifndef SEQ_RETIME
+/*!
+ * Play the streams compiled for another sample rate, rescaling their
+ * periods and time scales, and change the playback tempo.  It uses 64-bit
+ * arithmetic when a frame is read: set it to 0 in the `SYNTH_CFG` file to
+ * only accept the streams compiled for `synth_freq`.
+ */
+#define SEQ_RETIME		(1)
+#endif
+
+/*! Tempo of the stream, 8.8 fixed point */
+#define SEQ_TEMPO_NORMAL	(256)
+
 /*! 
  * Define a single step/frame of the sequencer. It applies to the active channel.
  * Contains the definition of the next waveform and envelope.
@@ -42,13 +63,198 @@ struct seq_stream_header_t {
 	/*! Number of voices. They will all be enabled */
 	uint8_t voices;
 	/*! Total frame count */
-	uint16_t frames;
+	uint32_t frames;
 	/*! Follow frames data, as stream of seq_frame_t */
 };
 
 /*! 
- * Plays a stream sequence of frames, in the order requested by the synth.
+ * A source of frames, e.g. the frames of a channel, or of a compiled stream.
+ * `read` must return 1 if a new frame was acquired, or zero if EOF.
+ */
+struct seq_frame_source_t {
+	uint8_t (*read)(void* user, struct seq_frame_t* frame);
+	void* user;
+};
+
+/*! State of the staging slot of a player */
+#define SEQ_STAGE_OFF		(0)	/*!< No lookahead, frames read when due */
+#define SEQ_STAGE_EMPTY		(1)	/*!< Waiting for `seq_player_prepare` */
+#define SEQ_STAGE_READY		(2)	/*!< The next frame is staged */
+#define SEQ_STAGE_END		(3)	/*!< End-of-stream reached */
+
+/*! 
+ * The next frame of a stream, read and configured ahead of time: starting
+ * it on a voice is a copy, without the divisions of `voice_wf_set`.
+ */
+struct seq_staged_frame_t {
+	/*! Waveform generator, ready to run */
+	struct voice_wf_gen_t wf;
+	/*! Envelope definition */
+	struct adsr_env_def_t adsr_def;
+	/*! Envelope duration, as computed by `adsr_duration` */
+	uint32_t duration;
+};
+
+/*! 
+ * State of a sequencer player.  Every player feeds its own synth from its
+ * own source, so any number of streams can be played at the same time.
+ */
+struct seq_player_t {
+	/*! The synth to feed */
+	struct poly_synth_t* synth;
+	/*! The stream, in fetch order */
+	struct seq_frame_source_t source;
+	/*! Number of voices used by the stream */
+	uint8_t voice_count;
+	/*! First voice of the synth fed by the player */
+	uint8_t first_voice;
+	/*! Player of the layer above, that can take the voices of this one, or NULL */
+	struct seq_player_t* above;
+	/*! Voices of the synth where the player started a note, maybe still playing */
+	uintptr_t playing;
+	/*! Samples elapsed since `seq_player_init` */
+	uint32_t clock;
+	/*! Next sample at which a voice is free (or UINT32_MAX at end-of-stream) */
+	uint32_t next_due;
+	/*! Sample at which each voice is free, as computed by `adsr_duration` */
+	uint32_t voice_due[SEQ_MAX_VOICES];
+#ifdef ADSR_SHARED_DEF
+	/*! Envelopes of the playing frames, referenced by the voices */
+	struct adsr_env_def_t voice_def[SEQ_MAX_VOICES];
+#endif
+#if SEQ_RETIME
+	/*! Sample rate the stream was compiled for */
+	uint16_t stream_freq;
+	/*! Playback tempo, 8.8 fixed point (`SEQ_TEMPO_NORMAL`) */
+	uint16_t tempo;
+	/*!
+	 * Largest relative error of the periods and time scales rescaled so
+	 * far, in parts per million
+	 */
+	uint32_t retime_error;
+#endif
+	/*! Staging slot state, `SEQ_STAGE_*` */
+	volatile uint8_t stage;
+	/*! The next frame, if `stage` is `SEQ_STAGE_READY` */
+	struct seq_staged_frame_t staged;
+};
+
+/*! 
+ * Prepare a player for a stream sequence of frames, in the order requested by the synth.
  * The frames must then be sorted in the same fetch order and not in channel order.
+ * `voice_count` is the number of voices available in `synth`.
+ * A stream compiled for another sample rate is retimed while read, with
+ * `SEQ_RETIME`: the rounding errors are reported in `retime_error`.
+ * Returns non-zero if the stream cannot be played by the synth.
+ */
+int seq_player_init(struct seq_player_t* player, const struct seq_stream_header_t* stream_header, uint8_t voice_count, struct poly_synth_t* synth, const struct seq_frame_source_t* source);
+
+/*! 
+ * Prepare a player for a layer of a synth shared with other players, e.g.
+ * sound effects over music.  The stream is played on the voices starting
+ * at `first_voice`.  No voice is disabled: a note already playing goes on
+until the layer feeds its voice.
+ *
+ * Layers may use the same voices: `above`, if not NULL, is the player of
+ * the layer with higher priority (which can have its own `above`).  While
+ * a layer above plays a note on a voice, the frames due on that voice are
+ * skipped: the timing of the stream is kept, and the voice is fed again
+ * by its first frame after the note above ends.  Feed the layers from the
+ * top one, every sample.
+ */
+int seq_player_init_layer(struct seq_player_t* player, const struct seq_stream_header_t* stream_header, uint8_t voice_count, struct poly_synth_t* synth, const struct seq_frame_source_t* source, uint8_t first_voice, struct seq_player_t* above);
+
+#if SEQ_RETIME
+/*! 
+ * Change the playback tempo, 8.8 fixed point and non-zero: 512 plays twice
+ * as fast, the pitch is unchanged.  It applies to the frames not read yet.
+ */
+void seq_player_set_tempo(struct seq_player_t* player, uint16_t tempo);
+#endif
+
+/*! 
+ * Must be called at every sample, before `poly_synth_next`.
+ * The time at which each voice will be free is computed from the envelope
+ * definition of its frame, so between those samples the call only
+ * advances the player clock.
+ */
+void seq_player_feed(struct seq_player_t* player);
+
+/*! 
+ * Lookahead: read the next frame and configure it in the staging slot,
+ * if empty, so that `seq_player_feed` only has to copy it to the voice
+ * that becomes free.  Call it outside of the time-critical path (e.g.
+ * from the main loop while `seq_player_feed` runs in the sample rate
+ * interrupt), often enough to stage every frame before it is due: a
+ * late frame starts one sample later.
+ *
+ * The first call, before the first `seq_player_feed`, switches the
+ * player to lookahead: from then on, only this function reads the
+ * source.  The two functions can then run concurrently, as a single
+ * producer and a single consumer of the slot.
+ */
+void seq_player_prepare(struct seq_player_t* player);
+
+/*! 
+ * Snapshot of a player and its voices, taken between two samples: playback
+ * can resume from it, see `seq_player_seek`.
+ */
+struct seq_keyframe_t {
+	/*! Player clock, the samples rendered before the keyframe */
+	uint32_t clock;
+	/*! Frames read from the stream before the keyframe */
+	uint32_t frame;
+	/*! Player timing, see `seq_player_t` */
+	uint32_t next_due;
+	uint32_t voice_due[SEQ_MAX_VOICES];
+#ifdef ADSR_SHARED_DEF
+	struct adsr_env_def_t voice_def[SEQ_MAX_VOICES];
+#endif
+	/*! Voices of the stream playing, from its first voice */
+	uintptr_t enable;
+	/*! State of the voices of the stream */
+	struct voice_ch_t voice[SEQ_MAX_VOICES];
+};
+
+/*! Keyframes of a stream, every `interval` samples */
+struct seq_keyframe_list_t {
+	/*! Samples between two keyframes */
+	uint32_t interval;
+	/*! Length of the stream in samples, until its last note ends */
+	uint32_t length;
+	/*! Keyframe count, the first one is at sample zero */
+	uint32_t count;
+	struct seq_keyframe_t* keyframes;
+};
+
+/*! 
+ * The last keyframe at or before the sample `clock`, by binary search.
+ */
+const struct seq_keyframe_t* seq_keyframe_find(const struct seq_keyframe_list_t* list, uint32_t clock);
+
+/*! 
+ * Restore a player from a keyframe compiled for the same stream, sample
+ * rate and tempo: the source must then read from frame `keyframe->frame`.
+ * The other voices of the synth are untouched.
+ */
+void seq_player_restore(struct seq_player_t* player, const struct seq_keyframe_t* keyframe);
+
+/*! 
+ * Render and drop samples until the player clock reaches `clock`.
+ */
+void seq_player_skip(struct seq_player_t* player, uint32_t clock);
+
+/*! 
+ * Seek to the sample `clock` (at most the length of the stream): restore
+ * the keyframe before it, after `rewind` moved the source to its frame,
+ * and render the samples in between.  Continue with `seq_player_feed`
+ * and `poly_synth_next`, as after `seq_player_init`.  Noise voices don't
+ * replay the same noise.  Returns non-zero if `rewind` failed.
+ */
+int seq_player_seek(struct seq_player_t* player, const struct seq_keyframe_list_t* list, uint32_t clock, int (*rewind)(void* user, uint32_t frame), void* user);
+
+/*! 
+ * Plays a stream sequence of frames with a single, global player.
  * Frames will be fed using the handler passed by `seq_set_stream_require_handler`.
  */
 int seq_play_stream(const struct seq_stream_header_t* stream_header, uint8_t voice_count, struct poly_synth_t* synth);
@@ -59,6 +265,17 @@ void seq_set_stream_require_handler(uint8_t (*handler)(struct seq_frame_t* frame
 /*! Use it when `seq_play_stream` is in use, must be called at every sample */
 void seq_feed_synth(struct poly_synth_t* synth);
 
+#if SEQ_RETIME
+/*! Change the tempo of the stream played by `seq_play_stream`, see `seq_player_set_tempo` */
+void seq_set_stream_tempo(uint16_t tempo);
+
+/*! Largest timing error of the stream played by `seq_play_stream`, in parts per million */
+uint32_t seq_stream_retime_error(void);
+#endif
+
+/*! Seek the stream played by `seq_play_stream`, see `seq_player_seek` */
+int seq_seek_stream(const struct seq_keyframe_list_t* list, uint32_t clock, int (*rewind)(void* user, uint32_t frame), void* user);
+
 /*! List of frames, used by `seq_frame_map_t` */
 struct seq_frame_list_t {
 	/*! Frame count */
@@ -79,10 +296,58 @@ struct seq_frame_map_t {
 	struct seq_frame_list_t* channels;
 }; 
 
+/*! 
+ * A destination of frames.
+ * `write` must return zero on success, non-zero aborts the compilation.
+ */
+struct seq_frame_sink_t {
+	int (*write)(void* user, const struct seq_frame_t* frame);
+	void* user;
+};
+
+/*! 
+ * Compile/reorder the frames produced by the channel sources to a sequential stream.
+ * Frames are written to the sink as soon as their fetch order is known, only
+ * one frame per channel is kept in memory.
+ * Empty channels are skipped and don't use a voice.
+ * Returns non-zero if the sink failed.
+ */
+int seq_compile_stream(struct seq_frame_source_t* channels, int channel_count, struct seq_frame_sink_t* sink, int* frame_count, int* voice_count);
+
+/*!
+ * Prepare a frame source for each channel of a frame map, to be compiled by
+ * `seq_compile_stream`.  They read through the `lists` copies (one per
+ * channel), the map is left untouched and can be opened again.
+ */
+void seq_frame_map_open(const struct seq_frame_map_t* map, struct seq_frame_list_t* lists, struct seq_frame_source_t* channels);
+
 /*! Compile/reorder a frame-map (by channel) to a sequential stream */
 void seq_compile(struct seq_frame_map_t* map, struct seq_frame_t** frame_stream, int* frame_count, int* voice_count);
 
+/*!
+ * Non-zero if the stream of a frame map can be played again right after
+ * its last frame, with no gap: the channels played twice compile to the
+ * stream twice, with the same voices.
+ */
+int seq_frame_map_repeats(struct seq_frame_map_t* map);
+
+/*! Compare two frames, field by field (the structure has padding) */
+uint8_t seq_frame_equal(const struct seq_frame_t* a, const struct seq_frame_t* b);
+
 /*! Free the stream allocated by `seq_compile`. */
 void seq_free(struct seq_frame_t* frame_stream);
 
+/*! 
+ * Take a keyframe every `interval` samples of a compiled stream, played
+ * at the synth sample rate and `tempo` (`SEQ_TEMPO_NORMAL` without
+ * `SEQ_RETIME`).  The stream is not rendered: the voices are derived from
+ * the timing of the player and advanced with `voice_ch_skip`, so it costs
+ * a small part of a render.  The list is allocated, free it with
+ * `seq_keyframes_free`.  Returns non-zero if the stream cannot be played.
+ */
+int seq_compile_keyframes(const struct seq_stream_header_t* stream_header, const struct seq_frame_source_t* source, uint16_t tempo, uint32_t interval, struct seq_keyframe_list_t* list);
+
+/*! Free the keyframes allocated by `seq_compile_keyframes` */
+void seq_keyframes_free(struct seq_keyframe_list_t* list);
+
 #endif
@@ -31,6 +31,11 @@
 #include SYNTH_CFG
 #endif
 
+#ifdef SEQ_SONG_CFG
+/* Song compiled to code, see gensong.py: voices and features used */
+#include SEQ_SONG_CFG
+#endif
+
 #ifndef SYNTH_FREQ
 /*!
  * Sample rate for the synthesizer: this needs to be declared in the
@@ -72,8 +77,14 @@ static inline int8_t poly_synth_next(struct poly_synth_t* const synth) {
 	int16_t sample = 0;
 	uintptr_t mask = 1;
 	uint8_t idx = 0;
+	/* Channels still to compute in this sample */
+	uintptr_t pending = synth->enable;
+
+	/* Idle: nothing to compute, the output is silent */
+	if (!pending)
+		return 0;
 
-	while (mask) {
+	while (pending) {
 		if (synth->enable & mask) {
 			/* Channel is enabled */
 			int8_t ch_sample = voice_ch_next(
@@ -88,6 +99,7 @@ static inline int8_t poly_synth_next(struct poly_synth_t* const synth) {
 				adsr_reset(&synth->voice[idx].adsr);
 			}
 		}
+		pending &= ~mask;
 		idx++;
 		mask <<= 1;
 	}
@@ -45,6 +45,74 @@ inline static uint8_t voice_ch_is_done(struct voice_ch_t* const voice) {
 	return adsr_is_done(&(voice->adsr));
 }
 
+/*!
+ * Scale a waveform sample by an envelope amplitude, `value * amplitude >> 8`,
+ * with an 8 by 8 bit shift-and-add unsigned multiplication: on cores
+ * without a multiplier it avoids the generic 16-bit multiplication
+ * routine.
+ */
+inline static int16_t voice_scale_shift_add(int8_t value, uint8_t amplitude) {
+	uint8_t negative = (value < 0);
+	uint8_t mag = negative ? -value : value;
+	uint8_t hi = 0;
+	uint8_t lo = amplitude;
+	uint8_t i;
+
+	for (i = 0; i < 8; i++) {
+		/* Same steps as the AVR assembly version */
+		uint16_t sum = hi;
+		if (lo & 1)
+			sum += mag;
+		lo = (lo >> 1) | ((sum & 1) << 7);
+		hi = sum >> 1;
+	}
+
+	/* The shift rounds towards minus infinity */
+	if (negative)
+		return -(int16_t)(hi + (lo != 0));
+	return hi;
+}
+
+#if defined(VOICE_SCALE_ASM) && defined(__AVR_ARCH__) \
+		&& !defined(__AVR_HAVE_MUL__)
+/*!
+ * `voice_scale_shift_add` in AVR assembly, the unsigned multiplication of
+ * the AVR200 application note (`mpy8u`).
+ */
+inline static int16_t voice_scale(int8_t value, uint8_t amplitude) {
+	uint8_t negative = (value < 0);
+	uint8_t mag = negative ? -value : value;
+	uint8_t hi;
+	uint8_t lo = amplitude;
+	uint8_t count;
+
+	__asm__ (
+		"clr	%0"		"\n\t"
+		"ldi	%2, 8"		"\n\t"
+		"lsr	%1"		"\n\t"
+	"1:"	"brcc	2f"		"\n\t"
+		"add	%0, %3"		"\n\t"
+	"2:"	"ror	%0"		"\n\t"
+		"ror	%1"		"\n\t"
+		"dec	%2"		"\n\t"
+		"brne	1b"		"\n\t"
+		: "=&r" (hi), "+r" (lo), "=&d" (count)
+		: "r" (mag)
+	);
+
+	if (negative)
+		return -(int16_t)(hi + (lo != 0));
+	return hi;
+}
+#elif defined(VOICE_SCALE_SHIFT_ADD)
+#define voice_scale		voice_scale_shift_add
+#else
+/*! Scale a waveform sample by an envelope amplitude */
+inline static int16_t voice_scale(int8_t value, uint8_t amplitude) {
+	return ((int16_t)value * amplitude) >> 8;
+}
+#endif
+
 /*!
  * Compute the next voice channel sample.
  */
@@ -54,10 +122,9 @@ inline static int8_t voice_ch_next(struct voice_ch_t* const voice) {
 	if (!amplitude)
 		return 0;
 
-	int16_t value = voice_wf_next(&(voice->wf));
-	_DPRINTF("ch=%p value=%d\n", voice, value);
-	value *= amplitude;
-	value >>= 8;
+	int8_t sample = voice_wf_next(&(voice->wf));
+	_DPRINTF("ch=%p value=%d\n", voice, sample);
+	int16_t value = voice_scale(sample, amplitude);
 
 	_DPRINTF("ch=%p out=%d\n", voice, value);
 
@@ -70,6 +137,20 @@ inline static int8_t voice_ch_next(struct voice_ch_t* const voice) {
 		return value;
 }
 
+/*!
+ * Advance the voice channel by up to `samples` samples without computing
+ * them, as `voice_ch_next` would, stopping once the envelope is done.
+ * Returns the samples advanced.
+ */
+inline static uint32_t voice_ch_skip(struct voice_ch_t* const voice,
+		uint32_t samples) {
+	uint32_t audible;
+	uint32_t done = adsr_skip(&(voice->adsr), samples, &audible);
+	/* The waveform only runs while the envelope is audible */
+	voice_wf_skip(&(voice->wf), audible);
+	return done;
+}
+
 /*
  * vim: set sw=8 ts=8 noet si tw=72
  */
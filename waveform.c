@@ -23,6 +23,17 @@
 #include "debug.h"
 #include <stdlib.h>
 
+#ifndef VOICE_MODES
+/*!
+ * Waveform modes supported by the generator, as `1 << VOICE_MODE_*` bits.
+ * The others can be stripped in the `SYNTH_CFG` file to save flash.
+ */
+#define VOICE_MODES		(0x1f)
+#endif
+
+/*! Non-zero if the mode is supported */
+#define VOICE_MODE_USED(mode)	(VOICE_MODES & (1 << (mode)))
+
 /* Amplitude scaling */
 #define VOICE_WF_AMP_SCALE	(8)
 
@@ -36,10 +47,13 @@
 
 int8_t voice_wf_next(struct voice_wf_gen_t* const wf_gen) {
 	switch(wf_gen->mode) {
+#if VOICE_MODE_USED(VOICE_MODE_DC)
 		case VOICE_MODE_DC:
 			_DPRINTF("wf=%p mode=DC amp=%d\n",
 					wf_gen, wf_gen->amplitude);
 			return wf_gen->amplitude;
+#endif
+#if VOICE_MODE_USED(VOICE_MODE_NOISE)
 		case VOICE_MODE_NOISE:
 			wf_gen->sample = (rand() /
 				(RAND_MAX/512)) - 256;
@@ -48,6 +62,8 @@ int8_t voice_wf_next(struct voice_wf_gen_t* const wf_gen) {
 					wf_gen, wf_gen->amplitude,
 					wf_gen->sample);
 			break;
+#endif
+#if VOICE_MODE_USED(VOICE_MODE_SQUARE)
 		case VOICE_MODE_SQUARE:
 			if ((wf_gen->period_remain >> PERIOD_FP_SCALE) == 0) {
 				/* Swap value */
@@ -61,6 +77,8 @@ int8_t voice_wf_next(struct voice_wf_gen_t* const wf_gen) {
 					wf_gen->period_remain,
 					wf_gen->sample);
 			break;
+#endif
+#if VOICE_MODE_USED(VOICE_MODE_SAWTOOTH)
 		case VOICE_MODE_SAWTOOTH:
 			if ((wf_gen->period_remain >> PERIOD_FP_SCALE) == 0) {
 				/* Back to -amplitude */
@@ -76,6 +94,8 @@ int8_t voice_wf_next(struct voice_wf_gen_t* const wf_gen) {
 					wf_gen->period_remain, wf_gen->step,
 					wf_gen->sample);
 			break;
+#endif
+#if VOICE_MODE_USED(VOICE_MODE_TRIANGLE)
 		case VOICE_MODE_TRIANGLE:
 			if ((wf_gen->period_remain >> PERIOD_FP_SCALE) == 0) {
 				/* Switch direction */
@@ -95,11 +115,35 @@ int8_t voice_wf_next(struct voice_wf_gen_t* const wf_gen) {
 					wf_gen->period_remain, wf_gen->step,
 					wf_gen->sample);
 			break;
+#endif
 	}
 
 	return wf_gen->sample >> VOICE_WF_AMP_SCALE;
 }
 
+void voice_wf_skip(struct voice_wf_gen_t* const wf_gen, uint32_t samples) {
+	if ((wf_gen->mode != VOICE_MODE_SQUARE)
+			&& (wf_gen->mode != VOICE_MODE_SAWTOOTH)
+			&& (wf_gen->mode != VOICE_MODE_TRIANGLE))
+		return;
+
+	while (samples) {
+		/* Samples before the period wraps around */
+		uint32_t steady = wf_gen->period_remain >> PERIOD_FP_SCALE;
+		if (steady > samples)
+			steady = samples;
+		wf_gen->period_remain -= steady << PERIOD_FP_SCALE;
+		if (wf_gen->mode != VOICE_MODE_SQUARE)
+			wf_gen->sample += (int32_t)steady * wf_gen->step;
+		samples -= steady;
+		if (samples) {
+			/* The wrapping sample itself */
+			voice_wf_next(wf_gen);
+			samples--;
+		}
+	}
+}
+
 /* Compute frequency period (sawtooth wave) */
 uint16_t voice_wf_freq_to_period(uint16_t freq) {
 	/* Use 16-bit 12.4 fixed point */
@@ -187,21 +231,31 @@ void voice_wf_set_noise(struct voice_wf_gen_t* const wf_gen,
 
 void voice_wf_set(struct voice_wf_gen_t* const wf_gen, struct voice_wf_def_t* const wf_def) {
 	switch (wf_def->mode) {
+#if VOICE_MODE_USED(VOICE_MODE_DC)
 		case VOICE_MODE_DC:
 			voice_wf_set_dc(wf_gen, wf_def->amplitude);
 			break;
+#endif
+#if VOICE_MODE_USED(VOICE_MODE_SQUARE)
 		case VOICE_MODE_SQUARE:
 			voice_wf_set_square_p(wf_gen, wf_def->period, wf_def->amplitude);
 			break;
+#endif
+#if VOICE_MODE_USED(VOICE_MODE_SAWTOOTH)
 		case VOICE_MODE_SAWTOOTH:
 			voice_wf_set_sawtooth_p(wf_gen, wf_def->period, wf_def->amplitude);
 			break;
+#endif
+#if VOICE_MODE_USED(VOICE_MODE_TRIANGLE)
 		case VOICE_MODE_TRIANGLE:
 			voice_wf_set_triangle_p(wf_gen, wf_def->period, wf_def->amplitude);
 			break;
+#endif
+#if VOICE_MODE_USED(VOICE_MODE_NOISE)
 		case VOICE_MODE_NOISE:
 			voice_wf_set_noise(wf_gen, wf_def->amplitude);
 			break;
+#endif
 	}
 }
 
@@ -105,6 +105,13 @@ void voice_wf_set(struct voice_wf_gen_t* const wf_gen, struct voice_wf_def_t* co
  */
 int8_t voice_wf_next(struct voice_wf_gen_t* const wf_gen);
 
+/*!
+ * Advance the generator by `samples` samples without computing them, as
+ * many calls of `voice_wf_next` would.  Noise is not advanced: its
+ * samples are not reproducible anyway.
+ */
+void voice_wf_skip(struct voice_wf_gen_t* const wf_gen, uint32_t samples);
+
 #endif
 /*
  * vim: set sw=8 ts=8 noet si tw=72